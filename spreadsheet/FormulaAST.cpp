@@ -1,11 +1,24 @@
 #include "FormulaAST.h"
 
+#include "aggregate_kernels.h"
+#include "cell.h"
+#include "evaluation_context.h"
+#include "value_columns.h"
+
+#ifdef SPREADSHEET_WITH_ANTLR
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#endif
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
+#include <climits>
 #include <cmath>
+#include <cstdlib>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <sstream>
@@ -14,6 +27,21 @@
 
 namespace ASTImpl {
 
+	namespace {
+		constexpr std::string_view FUNCTION_NAMES[] = { "SUM", "AVERAGE", "MIN", "MAX", "COUNT" };
+
+		// A1-запись без промежуточной строки; недопустимая позиция не печатается
+		void PrintPosition(std::ostream& out, Position pos) {
+			char buffer[Position::MAX_STRING_LENGTH];
+			const char* end = pos.ToChars(buffer, buffer + sizeof(buffer)).ptr;
+			out.write(buffer, end - buffer);
+		}
+	}// namespace
+
+	std::string_view GetFunctionName(Function function) {
+		return FUNCTION_NAMES[static_cast<int>(function)];
+	}
+
 	enum ExprPrecedence {
 		EP_ADD,
 		EP_SUB,
@@ -72,15 +100,24 @@ namespace ASTImpl {
 	class Expr {
 	public:
 		virtual ~Expr() = default;
-		virtual void Print(std::ostream& out) const = 0;
-		virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-		//virtual double Evaluate() const = 0;
-		virtual double Evaluate(const std::function<CellInterface::Value(Position)>& linker) const = 0;
+		// cell references are stored relative to the anchor, printing resolves them
+		virtual void Print(std::ostream& out, Position anchor) const = 0;
+		virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position anchor) const = 0;
+		// appends the node to the program in postfix order
+		virtual void Compile(std::vector<Instruction>& program) const = 0;
+		// same for an argument of function, which leaves a partial result instead of a value
+		virtual void CompileArgument(std::vector<Instruction>& program, Function function) const {
+			Compile(program);
+			Instruction instruction{};
+			instruction.code = OpCode::Argument;
+			instruction.function = function;
+			program.push_back(instruction);
+		}
 
 		// higher is tighter
 		virtual ExprPrecedence GetPrecedence() const = 0;
 
-		void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+		void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence, Position anchor,
 			bool right_child = false) const {
 			auto precedence = GetPrecedence();
 			auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -89,7 +126,7 @@ namespace ASTImpl {
 				out << '(';
 			}
 
-			DoPrintFormula(out, precedence);
+			DoPrintFormula(out, precedence, anchor);
 
 			if (parens_needed) {
 				out << ')';
@@ -114,18 +151,18 @@ namespace ASTImpl {
 				, rhs_(std::move(rhs)) {
 			}
 
-			void Print(std::ostream& out) const override {
+			void Print(std::ostream& out, Position anchor) const override {
 				out << '(' << static_cast<char>(type_) << ' ';
-				lhs_->Print(out);
+				lhs_->Print(out, anchor);
 				out << ' ';
-				rhs_->Print(out);
+				rhs_->Print(out, anchor);
 				out << ')';
 			}
 
-			void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-				lhs_->PrintFormula(out, precedence);
+			void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position anchor) const override {
+				lhs_->PrintFormula(out, precedence, anchor);
 				out << static_cast<char>(type_);
-				rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+				rhs_->PrintFormula(out, precedence, anchor, /* right_child = */ true);
 			}
 
 			ExprPrecedence GetPrecedence() const override {
@@ -145,22 +182,12 @@ namespace ASTImpl {
 				}
 			}
 
-			double Evaluate(const std::function<CellInterface::Value(Position)>& linker) const override {
-				double EXP = 1e-10;
-				auto lhs = lhs_->Evaluate(linker);
-				auto rhs = rhs_->Evaluate(linker);
-
-				if (!(std::isfinite(lhs) && std::isfinite(rhs))) {
-					throw FormulaError{ FormulaError::Category::Arithmetic };
-				}
-				if (type_ == Type::Divide && std::abs(rhs) <= EXP) {
-					throw FormulaError{ FormulaError::Category::Arithmetic };
-				}
-				double result = DoOperation(lhs, rhs);
-				if (!std::isfinite(result)) {
-					throw FormulaError{ FormulaError::Category::Arithmetic };
-				}
-				return result;
+			void Compile(std::vector<Instruction>& program) const override {
+				lhs_->Compile(program);
+				rhs_->Compile(program);
+				Instruction instruction{};
+				instruction.code = GetOpCode();
+				program.push_back(instruction);
 			}
 
 		private:
@@ -168,20 +195,20 @@ namespace ASTImpl {
 			std::unique_ptr<Expr> lhs_;
 			std::unique_ptr<Expr> rhs_;
 
-			double DoOperation(double lhs, double rhs) const {
+			OpCode GetOpCode() const {
 				switch (type_) {
 				case Add:
-					return lhs + rhs;
+					return OpCode::Add;
 				case Subtract:
-					return lhs - rhs;
+					return OpCode::Subtract;
 				case Multiply:
-					return lhs * rhs;
+					return OpCode::Multiply;
 				case Divide:
-					return lhs / rhs;
+					return OpCode::Divide;
 				default:
 					// have to do this because VC++ has a buggy warning
 					assert(false);
-					return static_cast<double>(INT_MAX);
+					return OpCode::Add;
 				}
 			}
 		};
@@ -199,41 +226,31 @@ namespace ASTImpl {
 				, operand_(std::move(operand)) {
 			}
 
-			void Print(std::ostream& out) const override {
+			void Print(std::ostream& out, Position anchor) const override {
 				out << '(' << static_cast<char>(type_) << ' ';
-				operand_->Print(out);
+				operand_->Print(out, anchor);
 				out << ')';
 			}
 
-			void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+			void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position anchor) const override {
 				out << static_cast<char>(type_);
-				operand_->PrintFormula(out, precedence);
+				operand_->PrintFormula(out, precedence, anchor);
 			}
 
 			ExprPrecedence GetPrecedence() const override {
 				return EP_UNARY;
 			}
 
-			double Evaluate(const std::function<CellInterface::Value(Position)>& linker) const override {
-				auto op = operand_->Evaluate(linker);
-				if (!std::isfinite(op)) {
-					throw FormulaError{ FormulaError::Category::Arithmetic };
-				}
-				return DoOperation(op);
+			void Compile(std::vector<Instruction>& program) const override {
+				operand_->Compile(program);
+				Instruction instruction{};
+				instruction.code = type_ == Type::UnaryMinus ? OpCode::UnaryMinus : OpCode::UnaryPlus;
+				program.push_back(instruction);
 			}
 
 		private:
 			Type type_;
 			std::unique_ptr<Expr> operand_;
-
-			double DoOperation(double op) const {
-				if (type_ == Type::UnaryMinus) {
-					return op * (-1.0);
-				}
-				else {
-					return op;
-				}
-			}
 		};
 
 		class NumberExpr final : public Expr {
@@ -242,11 +259,11 @@ namespace ASTImpl {
 				: value_(value) {
 			}
 
-			void Print(std::ostream& out) const override {
+			void Print(std::ostream& out, Position /* anchor */) const override {
 				out << value_;
 			}
 
-			void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+			void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position /* anchor */) const override {
 				out << value_;
 			}
 
@@ -254,69 +271,485 @@ namespace ASTImpl {
 				return EP_ATOM;
 			}
 
-			double Evaluate(const std::function<CellInterface::Value(Position)>&) const override {
-				return value_;
+			void Compile(std::vector<Instruction>& program) const override {
+				Instruction instruction{};
+				instruction.code = OpCode::Number;
+				instruction.number = value_;
+				program.push_back(instruction);
 			}
 
 		private:
 			double value_;
 		};
 
+		// holds the offset of the referenced cell from the anchor
 		class CellExpr final : public Expr {
 		public:
 			explicit CellExpr(const Position* cell)
 				: cell_(cell) {
 			}
 
-			void Print(std::ostream& out) const override {
-				if (!cell_->IsValid()) {
+			void Print(std::ostream& out, Position anchor) const override {
+				const Position cell{ anchor.row + cell_->row, anchor.col + cell_->col };
+				if (!cell.IsValid()) {
 					out << FormulaError::Category::Ref;
 				}
 				else {
-					out << cell_->ToString();
+					PrintPosition(out, cell);
 				}
 			}
 
-			void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-				Print(out);
+			void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position anchor) const override {
+				Print(out, anchor);
 			}
 
 			ExprPrecedence GetPrecedence() const override {
 				return EP_ATOM;
 			}
 
-			// Для чисел метод возвращает значение числа по ссылке из таблицы.
-			double Evaluate(const std::function<CellInterface::Value(Position)>& linker) const override {
-				if (!cell_->IsValid()) {
-					throw FormulaError{ FormulaError::Category::Ref };
+			void Compile(std::vector<Instruction>& program) const override {
+				Instruction instruction{};
+				instruction.code = OpCode::Cell;
+				instruction.cell = { cell_->row, cell_->col };
+				program.push_back(instruction);
+			}
+
+		private:
+			const Position* cell_;
+		};
+
+		// Rectangle of cells as an argument of a function; a lone cell argument is a range
+		// of one cell, so it is read like any range.
+		class RangeExpr final : public Expr {
+		public:
+			explicit RangeExpr(RangeReference range)
+				: range_(range) {
+			}
+
+			// corners are offsets from the anchor, in any order
+			static std::unique_ptr<RangeExpr> FromCorners(Position first, Position last) {
+				const Position top_left{ std::min(first.row, last.row), std::min(first.col, last.col) };
+				const Size size{ std::abs(first.row - last.row) + 1, std::abs(first.col - last.col) + 1 };
+				return std::make_unique<RangeExpr>(RangeReference{ top_left, size });
+			}
+
+			void Print(std::ostream& out, Position anchor) const override {
+				const Position top_left{ anchor.row + range_.top_left.row, anchor.col + range_.top_left.col };
+				const Position bottom_right{ top_left.row + range_.size.rows - 1, top_left.col + range_.size.cols - 1 };
+				if (!top_left.IsValid() || !bottom_right.IsValid()) {
+					out << FormulaError::Category::Ref;
+					return;
 				}
-				auto val = linker(*cell_);
-				if (std::holds_alternative<FormulaError>(val)) {
-					throw std::get<FormulaError>(val);
+				PrintPosition(out, top_left);
+				if (!(top_left == bottom_right)) {
+					out << ':';
+					PrintPosition(out, bottom_right);
 				}
-				if (std::holds_alternative<std::string>(val)) {
-					std::string text = std::get<std::string>(val);
-					if (text.empty()) {
-						return 0;
+			}
+
+			void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position anchor) const override {
+				Print(out, anchor);
+			}
+
+			ExprPrecedence GetPrecedence() const override {
+				return EP_ATOM;
+			}
+
+			void Compile(std::vector<Instruction>& /* program */) const override {
+				// диапазон бывает только аргументом функции
+				assert(false);
+			}
+
+			void CompileArgument(std::vector<Instruction>& program, Function function) const override {
+				Instruction instruction{};
+				instruction.code = OpCode::Range;
+				instruction.function = function;
+				instruction.range = {
+					static_cast<int16_t>(range_.top_left.row), static_cast<int16_t>(range_.top_left.col),
+					static_cast<uint16_t>(range_.size.rows), static_cast<uint16_t>(range_.size.cols),
+				};
+				program.push_back(instruction);
+			}
+
+		private:
+			RangeReference range_;
+		};
+
+		class FunctionExpr final : public Expr {
+		public:
+			FunctionExpr(Function function, std::vector<std::unique_ptr<Expr>> args)
+				: function_(function)
+				, args_(std::move(args)) {
+			}
+
+			void Print(std::ostream& out, Position anchor) const override {
+				out << '(' << GetFunctionName(function_);
+				for (const auto& arg : args_) {
+					out << ' ';
+					arg->Print(out, anchor);
+				}
+				out << ')';
+			}
+
+			void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position anchor) const override {
+				out << GetFunctionName(function_) << '(';
+				bool first = true;
+				for (const auto& arg : args_) {
+					if (!first) {
+						out << ',';
 					}
-					for (auto sign : text) {
-						if (!std::isdigit(sign)) {
-							throw FormulaError{ FormulaError::Category::Value };
+					first = false;
+					// аргумент никогда не нуждается в скобках
+					arg->PrintFormula(out, EP_ADD, anchor);
+				}
+				out << ')';
+			}
+
+			ExprPrecedence GetPrecedence() const override {
+				return EP_ATOM;
+			}
+
+			void Compile(std::vector<Instruction>& program) const override {
+				for (const auto& arg : args_) {
+					arg->CompileArgument(program, function_);
+				}
+				Instruction instruction{};
+				instruction.code = OpCode::Call;
+				instruction.function = function_;
+				instruction.arg_count = static_cast<uint32_t>(args_.size());
+				program.push_back(instruction);
+			}
+
+		private:
+			Function function_;
+			std::vector<std::unique_ptr<Expr>> args_;
+		};
+
+		// Tokens of Formula.g4; whitespace is skipped and never becomes a token.
+		enum class TokenType {
+			Number,
+			Cell,
+			Function,
+			Add,
+			Sub,
+			Mul,
+			Div,
+			LeftParen,
+			RightParen,
+			Colon,
+			Comma,
+			End,
+		};
+
+		struct Token {
+			TokenType type;
+			std::string_view text;  // slice of the formula
+		};
+
+		// Lexer for the Formula.g4 tokens with the same longest-match behaviour as the generated
+		// one. It works on a view of the formula: tokens are slices of the input, nothing is copied.
+		class Lexer {
+		public:
+			explicit Lexer(std::string_view input)
+				: input_(input) {
+				Advance();
+			}
+
+			const Token& Peek() const {
+				return current_;
+			}
+
+			Token Next() {
+				Token token = current_;
+				Advance();
+				return token;
+			}
+
+		private:
+			static bool IsDigit(char c) {
+				return c >= '0' && c <= '9';
+			}
+
+			static bool IsLetter(char c) {
+				return c >= 'A' && c <= 'Z';
+			}
+
+			static bool IsSpace(char c) {
+				return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+			}
+
+			size_t SkipDigits(size_t pos) const {
+				while (pos < input_.size() && IsDigit(input_[pos])) {
+					++pos;
+				}
+				return pos;
+			}
+
+			void Emit(TokenType type, size_t end) {
+				current_ = { type, input_.substr(pos_, end - pos_) };
+				pos_ = end;
+			}
+
+			[[noreturn]] void Fail() const {
+				throw ParsingError("Error when lexing: token recognition error at: '" + std::string(input_.substr(pos_, 1)) + "'");
+			}
+
+			void Advance() {
+				while (pos_ < input_.size() && IsSpace(input_[pos_])) {
+					++pos_;
+				}
+				if (pos_ == input_.size()) {
+					Emit(TokenType::End, pos_);
+					return;
+				}
+
+				switch (input_[pos_]) {
+				case '+':
+					Emit(TokenType::Add, pos_ + 1);
+					return;
+				case '-':
+					Emit(TokenType::Sub, pos_ + 1);
+					return;
+				case '*':
+					Emit(TokenType::Mul, pos_ + 1);
+					return;
+				case '/':
+					Emit(TokenType::Div, pos_ + 1);
+					return;
+				case '(':
+					Emit(TokenType::LeftParen, pos_ + 1);
+					return;
+				case ')':
+					Emit(TokenType::RightParen, pos_ + 1);
+					return;
+				case ':':
+					Emit(TokenType::Colon, pos_ + 1);
+					return;
+				case ',':
+					Emit(TokenType::Comma, pos_ + 1);
+					return;
+				default:
+					break;
+				}
+
+				if (IsLetter(input_[pos_])) {
+					// CELL: [A-Z]+[0-9]+, или имя функции, если цифр нет
+					size_t end = pos_;
+					while (end < input_.size() && IsLetter(input_[end])) {
+						++end;
+					}
+					const size_t digits_end = SkipDigits(end);
+					if (digits_end != end) {
+						Emit(TokenType::Cell, digits_end);
+						return;
+					}
+					const std::string_view word = input_.substr(pos_, end - pos_);
+					if (std::find(std::begin(FUNCTION_NAMES), std::end(FUNCTION_NAMES), word) == std::end(FUNCTION_NAMES)) {
+						Fail();
+					}
+					Emit(TokenType::Function, end);
+					return;
+				}
+
+				if (IsDigit(input_[pos_]) || input_[pos_] == '.') {
+					// NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+					size_t end = SkipDigits(pos_);
+					if (end < input_.size() && input_[end] == '.') {
+						const size_t fraction_end = SkipDigits(end + 1);
+						if (fraction_end != end + 1) {
+							end = fraction_end;
+						}
+						else if (end == pos_) {
+							Fail();
 						}
+						// "1." is the number 1 followed by a '.' that fails on the next call
 					}
-					double numb = std::stod(text);
-					if (!std::isfinite(numb)) {
-						throw FormulaError{ FormulaError::Category::Arithmetic };
+					// EXPONENT: [eE] [-+]? UINT; without digits it is not part of the number
+					if (end < input_.size() && (input_[end] == 'e' || input_[end] == 'E')) {
+						size_t exponent = end + 1;
+						if (exponent < input_.size() && (input_[exponent] == '+' || input_[exponent] == '-')) {
+							++exponent;
+						}
+						const size_t exponent_end = SkipDigits(exponent);
+						if (exponent_end != exponent) {
+							end = exponent_end;
+						}
 					}
-						return numb;
+					Emit(TokenType::Number, end);
+					return;
 				}
-				return std::get<double>(val);
+
+				Fail();
+			}
+
+			std::string_view input_;
+			size_t pos_ = 0;
+			Token current_{ TokenType::End, {} };
+		};
+
+		// Pratt parser for Formula.g4 that builds the AST right away. Binding powers follow the
+		// order of the grammar alternatives: a unary sign binds tighter than * and /, which bind
+		// tighter than + and -; binary operators are left-associative.
+		class Parser {
+		public:
+			Parser(std::string_view input, Position anchor)
+				: lexer_(input)
+				, anchor_(anchor) {
+			}
+
+			FormulaAST Parse() {
+				auto root = ParseExpression(BP_ADDITIVE);
+				if (lexer_.Peek().type != TokenType::End) {
+					Unexpected(lexer_.Peek());
+				}
+				return FormulaAST(std::move(root), std::move(cells_));
 			}
 
 		private:
-			const Position* cell_;
+			enum BindingPower {
+				BP_NONE,
+				BP_ADDITIVE,
+				BP_MULTIPLICATIVE,
+				BP_UNARY,
+			};
+
+			static BindingPower GetInfixPower(TokenType type) {
+				switch (type) {
+				case TokenType::Add:
+				case TokenType::Sub:
+					return BP_ADDITIVE;
+				case TokenType::Mul:
+				case TokenType::Div:
+					return BP_MULTIPLICATIVE;
+				default:
+					return BP_NONE;
+				}
+			}
+
+			[[noreturn]] static void Unexpected(const Token& token) {
+				throw ParsingError("Error when parsing: " + (token.type == TokenType::End ? std::string("<EOF>") : std::string(token.text)));
+			}
+
+			void Expect(TokenType type) {
+				if (lexer_.Peek().type != type) {
+					Unexpected(lexer_.Peek());
+				}
+				lexer_.Next();
+			}
+
+			std::unique_ptr<Expr> ParseExpression(BindingPower min_power) {
+				return ParseInfix(ParsePrefix(), min_power);
+			}
+
+			// continues an expression whose first operand is already parsed
+			std::unique_ptr<Expr> ParseInfix(std::unique_ptr<Expr> lhs, BindingPower min_power) {
+				for (;;) {
+					const Token& op = lexer_.Peek();
+					const BindingPower power = GetInfixPower(op.type);
+					if (power == BP_NONE || power < min_power) {
+						return lhs;
+					}
+					const auto type = static_cast<BinaryOpExpr::Type>(lexer_.Next().text.front());
+					// правый операнд связывается сильнее: 1-2-3 == (1-2)-3
+					auto rhs = ParseExpression(static_cast<BindingPower>(power + 1));
+					lhs = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
+				}
+			}
+
+			std::unique_ptr<Expr> ParsePrefix() {
+				const Token token = lexer_.Next();
+				switch (token.type) {
+				case TokenType::Number:
+					return std::make_unique<NumberExpr>(ParseNumber(token.text));
+				case TokenType::Cell:
+					return MakeCellExpr(token);
+				case TokenType::Function: {
+					const auto name = std::find(std::begin(FUNCTION_NAMES), std::end(FUNCTION_NAMES), token.text);
+					const auto function = static_cast<Function>(name - std::begin(FUNCTION_NAMES));
+					Expect(TokenType::LeftParen);
+					std::vector<std::unique_ptr<Expr>> args;
+					args.push_back(ParseArgument());
+					while (lexer_.Peek().type == TokenType::Comma) {
+						lexer_.Next();
+						args.push_back(ParseArgument());
+					}
+					Expect(TokenType::RightParen);
+					return std::make_unique<FunctionExpr>(function, std::move(args));
+				}
+				case TokenType::Add:
+				case TokenType::Sub: {
+					const auto type = static_cast<UnaryOpExpr::Type>(token.text.front());
+					return std::make_unique<UnaryOpExpr>(type, ParseExpression(BP_UNARY));
+				}
+				case TokenType::LeftParen: {
+					auto expr = ParseExpression(BP_ADDITIVE);
+					Expect(TokenType::RightParen);
+					return expr;
+				}
+				default:
+					Unexpected(token);
+				}
+			}
+
+			// A1:B2, a lone cell (a range of one cell) or any other expression
+			std::unique_ptr<Expr> ParseArgument() {
+				if (lexer_.Peek().type != TokenType::Cell) {
+					return ParseExpression(BP_ADDITIVE);
+				}
+				const Token first = lexer_.Next();
+				switch (lexer_.Peek().type) {
+				case TokenType::Colon: {
+					lexer_.Next();
+					const Token last = lexer_.Next();
+					if (last.type != TokenType::Cell) {
+						Unexpected(last);
+					}
+					return RangeExpr::FromCorners(ToOffset(first), ToOffset(last));
+				}
+				case TokenType::Comma:
+				case TokenType::RightParen:
+					return RangeExpr::FromCorners(ToOffset(first), ToOffset(first));
+				default:
+					return ParseInfix(MakeCellExpr(first), BP_ADDITIVE);
+				}
+			}
+
+			// offset of the referenced cell from the anchor
+			Position ToOffset(const Token& token) const {
+				const Position pos = Position::FromString(token.text);
+				if (!pos.IsValid()) {
+					throw FormulaException("Invalid position: " + std::string(token.text));
+				}
+				return { pos.row - anchor_.row, pos.col - anchor_.col };
+			}
+
+			std::unique_ptr<Expr> MakeCellExpr(const Token& token) {
+				cells_.push_front(ToOffset(token));
+				return std::make_unique<CellExpr>(&cells_.front());
+			}
+
+			static double ParseNumber(std::string_view text) {
+				double value = 0;
+				const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+				if (error == std::errc::result_out_of_range) {
+					// from_chars отвергает и слишком маленькие числа, а поток округлял их до нуля
+					value = std::strtod(std::string(text).c_str(), nullptr);
+					if (std::isinf(value)) {
+						throw ParsingError("Invalid number: " + std::string(text));
+					}
+				}
+				else if (error != std::errc{} || end != text.data() + text.size()) {
+					throw ParsingError("Invalid number: " + std::string(text));
+				}
+				return value;
+			}
+
+			Lexer lexer_;
+			Position anchor_;
+			std::forward_list<Position> cells_;
 		};
 
+#ifdef SPREADSHEET_WITH_ANTLR
 		class ParseASTListener final : public FormulaBaseListener {
 		public:
 			std::unique_ptr<Expr> MoveRoot() {
@@ -402,11 +835,42 @@ namespace ASTImpl {
 				args_.back() = std::move(node);
 			}
 
+			void exitRange(FormulaParser::RangeContext* ctx) override {
+				const auto corners = ctx->CELL();
+				const Position first = ParseCorner(corners.front()->getSymbol()->getText());
+				const Position last = ParseCorner(corners.back()->getSymbol()->getText());
+				args_.push_back(RangeExpr::FromCorners(first, last));
+			}
+
+			void exitFunction(FormulaParser::FunctionContext* ctx) override {
+				const size_t count = ctx->arg().size();
+				assert(args_.size() >= count);
+
+				std::vector<std::unique_ptr<Expr>> args;
+				for (auto it = args_.end() - count; it != args_.end(); ++it) {
+					args.push_back(std::move(*it));
+				}
+				args_.erase(args_.end() - count, args_.end());
+
+				const std::string name = ctx->FUNCTION()->getSymbol()->getText();
+				const auto function = static_cast<Function>(
+					std::find(std::begin(FUNCTION_NAMES), std::end(FUNCTION_NAMES), name) - std::begin(FUNCTION_NAMES));
+				args_.push_back(std::make_unique<FunctionExpr>(function, std::move(args)));
+			}
+
 			void visitErrorNode(antlr4::tree::ErrorNode* node) override {
 				throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
 			}
 
 		private:
+			static Position ParseCorner(const std::string& text) {
+				const Position pos = Position::FromString(text);
+				if (!pos.IsValid()) {
+					throw FormulaException("Invalid position: " + text);
+				}
+				return pos;
+			}
+
 			std::vector<std::unique_ptr<Expr>> args_;
 			std::forward_list<Position> cells_;
 		};
@@ -420,11 +884,144 @@ namespace ASTImpl {
 				throw ParsingError("Error when lexing: " + msg);
 			}
 		};
+#endif
 
 	}  // namespace
 }  // namespace ASTImpl
 
 FormulaAST ParseFormulaAST(std::istream& in) {
+	const std::string text{ std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+	return ParseFormulaAST(std::string_view{ text });
+}
+
+FormulaAST ParseFormulaAST(std::string_view text, Position anchor) {
+	return ASTImpl::Parser(text, anchor).Parse();
+}
+
+bool MakeFormulaKey(std::string_view text, Position anchor, std::string& key) {
+	key.clear();
+	// смещения дописываются в ключ без временных строк
+	const auto append_number = [&key](int number) {
+		char buffer[16];
+		key.append(buffer, std::to_chars(buffer, buffer + sizeof(buffer), number).ptr);
+	};
+	try {
+		for (ASTImpl::Lexer lexer(text); lexer.Peek().type != ASTImpl::TokenType::End; lexer.Next()) {
+			const ASTImpl::Token& token = lexer.Peek();
+			if (token.type == ASTImpl::TokenType::Cell) {
+				const Position pos = Position::FromString(token.text);
+				if (!pos.IsValid()) {
+					return false;
+				}
+				key += 'R';
+				append_number(pos.row - anchor.row);
+				key += 'C';
+				append_number(pos.col - anchor.col);
+			}
+			else {
+				key += token.text;
+			}
+			// разделитель, чтобы "1 2" и "12" не давали один ключ
+			key += ' ';
+		}
+	}
+	catch (const ParsingError&) {
+		return false;
+	}
+	return true;
+}
+
+FormulaAST BuildFormulaAST(const std::vector<ASTImpl::Instruction>& program) {
+	using namespace ASTImpl;
+	// аргумент функции помечен ею: он годится только для вызова этой функции
+	struct Entry {
+		std::unique_ptr<Expr> expr;
+		std::optional<Function> argument_of;
+	};
+	std::vector<Entry> stack;
+	std::forward_list<Position> cells;
+	auto pop_entry = [&stack]() {
+		if (stack.empty()) {
+			throw ParsingError("Malformed formula program");
+		}
+		Entry entry = std::move(stack.back());
+		stack.pop_back();
+		return entry;
+	};
+	auto pop = [&pop_entry]() {
+		Entry entry = pop_entry();
+		if (entry.argument_of) {
+			throw ParsingError("Malformed formula program");
+		}
+		return std::move(entry.expr);
+	};
+	for (const Instruction& instruction : program) {
+		switch (instruction.code) {
+		case OpCode::Number:
+			stack.push_back({ std::make_unique<NumberExpr>(instruction.number), std::nullopt });
+			break;
+		case OpCode::Cell:
+			cells.push_front({ instruction.cell.row, instruction.cell.col });
+			stack.push_back({ std::make_unique<CellExpr>(&cells.front()), std::nullopt });
+			break;
+		case OpCode::Range: {
+			const auto& range = instruction.range;
+			if (range.rows == 0 || range.cols == 0) {
+				throw ParsingError("Malformed formula program");
+			}
+			auto expr = std::make_unique<RangeExpr>(RangeReference{ { range.row, range.col }, { range.rows, range.cols } });
+			stack.push_back({ std::move(expr), instruction.function });
+			break;
+		}
+		case OpCode::Argument:
+			stack.push_back({ pop(), instruction.function });
+			break;
+		case OpCode::Call: {
+			if (instruction.arg_count == 0 || instruction.arg_count > stack.size()) {
+				throw ParsingError("Malformed formula program");
+			}
+			std::vector<std::unique_ptr<Expr>> args(instruction.arg_count);
+			for (auto it = args.rbegin(); it != args.rend(); ++it) {
+				Entry entry = pop_entry();
+				if (entry.argument_of != instruction.function) {
+					throw ParsingError("Malformed formula program");
+				}
+				*it = std::move(entry.expr);
+			}
+			stack.push_back({ std::make_unique<FunctionExpr>(instruction.function, std::move(args)), std::nullopt });
+			break;
+		}
+		case OpCode::Add:
+		case OpCode::Subtract:
+		case OpCode::Multiply:
+		case OpCode::Divide: {
+			static constexpr BinaryOpExpr::Type TYPES[] = {
+				BinaryOpExpr::Add, BinaryOpExpr::Subtract, BinaryOpExpr::Multiply, BinaryOpExpr::Divide,
+			};
+			const auto type = TYPES[static_cast<int>(instruction.code) - static_cast<int>(OpCode::Add)];
+			std::unique_ptr<Expr> rhs = pop();
+			std::unique_ptr<Expr> lhs = pop();
+			stack.push_back({ std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs)), std::nullopt });
+			break;
+		}
+		case OpCode::UnaryPlus:
+		case OpCode::UnaryMinus: {
+			const auto type = instruction.code == OpCode::UnaryMinus ? UnaryOpExpr::UnaryMinus : UnaryOpExpr::UnaryPlus;
+			stack.push_back({ std::make_unique<UnaryOpExpr>(type, pop()), std::nullopt });
+			break;
+		}
+		default:
+			throw ParsingError("Malformed formula program");
+		}
+	}
+	if (stack.size() != 1) {
+		throw ParsingError("Malformed formula program");
+	}
+	return FormulaAST(pop(), std::move(cells));
+}
+
+#ifdef SPREADSHEET_WITH_ANTLR
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in) {
 	using namespace antlr4;
 
 	ANTLRInputStream input(in);
@@ -447,28 +1044,340 @@ FormulaAST ParseFormulaAST(std::istream& in) {
 
 	return FormulaAST(listener.MoveRoot(), listener.MoveCells());
 }
+#endif
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-	std::istringstream in(in_str);
-	return ParseFormulaAST(in);
-}
-
-void FormulaAST::PrintCells(std::ostream& out) const {
+void FormulaAST::PrintCells(std::ostream& out, Position anchor) const {
 	for (auto cell : cells_) {
-		out << cell.ToString() << ' ';
+		ASTImpl::PrintPosition(out, Position{ anchor.row + cell.row, anchor.col + cell.col });
+		out << ' ';
 	}
 }
 
-void FormulaAST::Print(std::ostream& out) const {
-	root_expr_->Print(out);
+void FormulaAST::Print(std::ostream& out, Position anchor) const {
+	root_expr_->Print(out, anchor);
+}
+
+void FormulaAST::PrintFormula(std::ostream& out, Position anchor) const {
+	root_expr_->PrintFormula(out, ASTImpl::EP_ATOM, anchor);
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-	root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+namespace {
+	// Для чисел возвращает значение числа по ссылке из таблицы, иначе ошибку.
+	FormulaInterface::Value ReadCell(Position pos, const std::function<CellInterface::Value(Position)>& linker) {
+		if (!pos.IsValid()) {
+			return FormulaError{ FormulaError::Category::Ref };
+		}
+		auto val = linker(pos);
+		if (std::holds_alternative<FormulaError>(val)) {
+			return std::get<FormulaError>(val);
+		}
+		if (std::holds_alternative<std::string>(val)) {
+			return TextImpl::ToNumber(std::get<std::string>(val));
+		}
+		return std::get<double>(val);
+	}
+
+	// Обёртка над std::function с тем же интерфейсом, что у EvaluationContext.
+	class FunctionContext {
+	public:
+		explicit FunctionContext(const std::function<CellInterface::Value(Position)>& linker)
+			: linker_(linker)
+		{
+		}
+
+		FormulaInterface::Value GetNumber(Position pos) const {
+			return ReadCell(pos, linker_);
+		}
+
+		// пустая ячейка и текст, не являющийся числом, в диапазоне пропускаются
+		std::optional<FormulaInterface::Value> GetRangeOperand(Position pos) const {
+			auto val = linker_(pos);
+			if (const std::string* text = std::get_if<std::string>(&val)) {
+				if (text->empty()) {
+					return std::nullopt;
+				}
+				const FormulaInterface::Value number = TextImpl::ToNumber(*text);
+				if (std::holds_alternative<FormulaError>(number)) {
+					return std::nullopt;
+				}
+				return number;
+			}
+			if (const FormulaError* error = std::get_if<FormulaError>(&val)) {
+				return *error;
+			}
+			return std::get<double>(val);
+		}
+
+		// кэша столбцов нет: нужные строки сегмента собираются по одной ячейке
+		ValueSpan GetValueSpan(Position pos, int end_row) const {
+			const int first_row = pos.row - pos.row % ValueSpan::SIZE;
+			end_row = std::min(end_row, first_row + ValueSpan::SIZE);
+			segment_.Reset();
+			for (int row = pos.row; row < end_row; ++row) {
+				const std::optional<FormulaInterface::Value> operand = GetRangeOperand({ row, pos.col });
+				if (!operand) {
+					continue;
+				}
+				if (const double* number = std::get_if<double>(&*operand)) {
+					segment_.SetNumber(row - first_row, *number);
+				}
+				else {
+					segment_.SetError(row - first_row, std::get<FormulaError>(*operand).GetCategory());
+				}
+			}
+			return { segment_, first_row };
+		}
+
+	private:
+		const std::function<CellInterface::Value(Position)>& linker_;
+		mutable ValueSegment segment_;
+	};
+
+	// Результат не конечен, если операция некорректна: это всегда ошибка Arithmetic.
+	double DoBinaryOperation(ASTImpl::OpCode code, double lhs, double rhs) {
+		constexpr double EXP = 1e-10;
+		constexpr double INVALID = std::numeric_limits<double>::quiet_NaN();
+		if (!std::isfinite(lhs) || !std::isfinite(rhs)) {
+			return INVALID;
+		}
+		switch (code) {
+		case ASTImpl::OpCode::Add:
+			return lhs + rhs;
+		case ASTImpl::OpCode::Subtract:
+			return lhs - rhs;
+		case ASTImpl::OpCode::Multiply:
+			return lhs * rhs;
+		case ASTImpl::OpCode::Divide:
+			return std::abs(rhs) <= EXP ? INVALID : lhs / rhs;
+		default:
+			assert(false);
+			return INVALID;
+		}
+	}
+
+	// число значений, которые один аргумент функции оставляет на стеке
+	size_t GetPartialWidth(ASTImpl::Function function) {
+		return function == ASTImpl::Function::Average ? 2 : 1;
+	}
+
+	// Частичный результат функции по числам диапазона.
+	struct RangeTotals {
+		double sum = 0;
+		double min = std::numeric_limits<double>::infinity();
+		double max = -std::numeric_limits<double>::infinity();
+		double count = 0;
+
+		// числа строк [begin, end) сегмента
+		void Add(ASTImpl::Function function, const ValueSpan& span, int begin, int end) {
+			using ASTImpl::Function;
+			count += static_cast<double>(span.CountNumbers(begin, end));
+			if (function == Function::Sum || function == Function::Average) {
+				// на месте ячеек без числа лежат нули
+				sum += SumKernel(span.GetValues() + begin, static_cast<size_t>(end - begin));
+				return;
+			}
+			if (function == Function::Count) {
+				return;
+			}
+			// MIN и MAX идут прямо по сегменту, если дыр нет, иначе по собранным числам
+			const double* values = span.GetValues() + begin;
+			size_t size = static_cast<size_t>(end - begin);
+			double buffer[ValueSpan::SIZE];
+			if (!span.AllNumbers(begin, end)) {
+				size = 0;
+				span.ForEachNumber(begin, end, [&buffer, &size](double value) {
+					buffer[size++] = value;
+				});
+				values = buffer;
+			}
+			if (function == Function::Min) {
+				min = std::min(min, MinKernel(values, size));
+			}
+			else {
+				max = std::max(max, MaxKernel(values, size));
+			}
+		}
+
+		// returns the number of values pushed
+		size_t Push(ASTImpl::Function function, double* top) const {
+			using ASTImpl::Function;
+			switch (function) {
+			case Function::Sum:
+				*top = sum;
+				break;
+			case Function::Average:
+				top[0] = sum;
+				top[1] = count;
+				break;
+			case Function::Min:
+				*top = min;
+				break;
+			case Function::Max:
+				*top = max;
+				break;
+			case Function::Count:
+				*top = count;
+				break;
+			}
+			return GetPartialWidth(function);
+		}
+	};
+
+	// Диапазон читается по столбцам сегментами кэша значений, и векторные ядра идут прямо
+	// по ним. Ошибка формулы в диапазоне становится результатом, как и у одиночной ссылки;
+	// из нескольких берётся первая в построчном порядке, поэтому после найденной ошибки
+	// следующие столбцы просматриваются только выше неё.
+	template <typename Context>
+	std::optional<FormulaError> ReadRange(const Context& context, ASTImpl::Function function, Position top_left, Size size, RangeTotals& totals) {
+		std::optional<FormulaError> error;
+		int end_row = top_left.row + size.rows;
+		for (int col = top_left.col; col < top_left.col + size.cols; ++col) {
+			for (int row = top_left.row; row < end_row;) {
+				const ValueSpan span = context.GetValueSpan({ row, col }, end_row);
+				const int begin = row - span.GetFirstRow();
+				const int end = std::min(end_row - span.GetFirstRow(), ValueSpan::SIZE);
+				const int error_index = span.FindError(begin, end);
+				if (error_index != end) {
+					error = FormulaError{ span.GetError(error_index) };
+					end_row = span.GetFirstRow() + error_index;
+					break;
+				}
+				if (!error) {
+					totals.Add(function, span, begin, end);
+				}
+				row = span.GetFirstRow() + end;
+			}
+		}
+		return error;
+	}
+
+	// Сводит частичные результаты аргументов в значение функции; не конечный результат
+	// означает ошибку Arithmetic. MIN и MAX без единого числа дают 0, AVERAGE — ошибку.
+	double CombinePartials(ASTImpl::Function function, const double* partials, size_t arg_count) {
+		using ASTImpl::Function;
+		double result = 0;
+		switch (function) {
+		case Function::Sum:
+		case Function::Count:
+			for (size_t i = 0; i < arg_count; ++i) {
+				result += partials[i];
+			}
+			return result;
+		case Function::Average: {
+			double count = 0;
+			for (size_t i = 0; i < arg_count; ++i) {
+				result += partials[2 * i];
+				count += partials[2 * i + 1];
+			}
+			return count == 0 ? std::numeric_limits<double>::quiet_NaN() : result / count;
+		}
+		case Function::Min:
+			result = *std::min_element(partials, partials + arg_count);
+			return std::isinf(result) && result > 0 ? 0.0 : result;
+		case Function::Max:
+			result = *std::max_element(partials, partials + arg_count);
+			return std::isinf(result) && result < 0 ? 0.0 : result;
+		}
+		return std::numeric_limits<double>::quiet_NaN();
+	}
+
+	// Context is anything with `FormulaInterface::Value GetNumber(Position) const` that
+	// returns the operand or the error it holds, and
+	// `ValueSpan GetValueSpan(Position pos, int end_row) const` that returns the column
+	// segment holding pos with at least the rows [pos.row, end_row) of it filled in.
+	// Instantiated per context type, so the calls inline. Errors are returned as values:
+	// the first one met in postfix order wins, the rest of the program is skipped.
+	template <typename Context>
+	FormulaInterface::Value Interpret(const std::vector<ASTImpl::Instruction>& program, size_t max_stack_depth, const Context& context, Position anchor) {
+		using ASTImpl::OpCode;
+		const FormulaError arithmetic_error{ FormulaError::Category::Arithmetic };
+
+		// стек вычислений обычно помещается в массив на стеке функции
+		constexpr size_t INLINE_STACK_DEPTH = 64;
+		double inline_stack[INLINE_STACK_DEPTH];
+		std::vector<double> heap_stack;
+		double* top = inline_stack;
+		if (max_stack_depth > INLINE_STACK_DEPTH) {
+			heap_stack.resize(max_stack_depth);
+			top = heap_stack.data();
+		}
+
+		for (const ASTImpl::Instruction& instruction : program) {
+			switch (instruction.code) {
+			case OpCode::Number:
+				*top++ = instruction.number;
+				break;
+			case OpCode::Cell: {
+				const FormulaInterface::Value operand = context.GetNumber({ anchor.row + instruction.cell.row, anchor.col + instruction.cell.col });
+				if (const FormulaError* error = std::get_if<FormulaError>(&operand)) {
+					return *error;
+				}
+				*top++ = *std::get_if<double>(&operand);
+				break;
+			}
+			case OpCode::Add:
+			case OpCode::Subtract:
+			case OpCode::Multiply:
+			case OpCode::Divide:
+				--top;
+				top[-1] = DoBinaryOperation(instruction.code, top[-1], top[0]);
+				if (!std::isfinite(top[-1])) {
+					return arithmetic_error;
+				}
+				break;
+			case OpCode::UnaryPlus:
+				if (!std::isfinite(top[-1])) {
+					return arithmetic_error;
+				}
+				break;
+			case OpCode::UnaryMinus:
+				if (!std::isfinite(top[-1])) {
+					return arithmetic_error;
+				}
+				top[-1] = -top[-1];
+				break;
+			case OpCode::Range: {
+				const auto& range = instruction.range;
+				const Position top_left{ anchor.row + range.row, anchor.col + range.col };
+				const Size size{ range.rows, range.cols };
+				if (!top_left.IsValid() || !Position{ top_left.row + size.rows - 1, top_left.col + size.cols - 1 }.IsValid()) {
+					return FormulaError{ FormulaError::Category::Ref };
+				}
+				RangeTotals totals;
+				if (const auto error = ReadRange(context, instruction.function, top_left, size, totals)) {
+					return *error;
+				}
+				top += totals.Push(instruction.function, top);
+				break;
+			}
+			case OpCode::Argument:
+				// одно значение: сумма, минимум и максимум равны ему самому
+				if (instruction.function == ASTImpl::Function::Count) {
+					top[-1] = 1;
+				}
+				else if (instruction.function == ASTImpl::Function::Average) {
+					*top++ = 1;
+				}
+				break;
+			case OpCode::Call:
+				top -= GetPartialWidth(instruction.function) * instruction.arg_count;
+				*top = CombinePartials(instruction.function, top, instruction.arg_count);
+				if (!std::isfinite(*top++)) {
+					return arithmetic_error;
+				}
+				break;
+			}
+		}
+		return top[-1];
+	}
+}  // namespace
+
+FormulaInterface::Value FormulaAST::Execute(const std::function<CellInterface::Value(Position)>& linker, Position anchor) const {
+	return Interpret(program_, max_stack_depth_, FunctionContext{ linker }, anchor);
 }
 
-double FormulaAST::Execute(const std::function<CellInterface::Value(Position)>& linker) const {
-	return root_expr_->Evaluate(linker);
+FormulaInterface::Value FormulaAST::Execute(const EvaluationContext& context, Position anchor) const {
+	return Interpret(program_, max_stack_depth_, context, anchor);
 }
 
 FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
@@ -476,6 +1385,38 @@ FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_li
 	, cells_(std::move(cells)) 
 {
 	cells_.sort();  // to avoid sorting in GetReferencedCells
+
+	root_expr_->Compile(program_);
+	size_t depth = 0;
+	for (const auto& instruction : program_) {
+		switch (instruction.code) {
+		case ASTImpl::OpCode::Number:
+		case ASTImpl::OpCode::Cell:
+			++depth;
+			break;
+		case ASTImpl::OpCode::UnaryPlus:
+		case ASTImpl::OpCode::UnaryMinus:
+			break;
+		case ASTImpl::OpCode::Range: {
+			const auto& range = instruction.range;
+			ranges_.push_back({ { range.row, range.col }, { range.rows, range.cols } });
+			depth += GetPartialWidth(instruction.function);
+			break;
+		}
+		case ASTImpl::OpCode::Argument:
+			depth += GetPartialWidth(instruction.function) - 1;
+			break;
+		case ASTImpl::OpCode::Call:
+			depth -= GetPartialWidth(instruction.function) * instruction.arg_count - 1;
+			break;
+		default:
+			--depth;
+			break;
+		}
+		max_stack_depth_ = std::max(max_stack_depth_, depth);
+	}
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
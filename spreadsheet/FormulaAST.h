@@ -1,16 +1,82 @@
 #pragma once
 
-#include "FormulaLexer.h"
 #include "common.h"
+#include "formula.h"
 
+#include <cstdint>
 #include <forward_list>
 #include <functional>
+#include <istream>
 #include <stdexcept>
+#include <string_view>
+#include <vector>
+
+class EvaluationContext;
 
 namespace ASTImpl {
 	class Expr;
+
+	enum class OpCode : uint8_t {
+		Number,      // push number
+		Cell,        // push the numeric value of cell
+		Add,         // pop rhs, pop lhs, push lhs op rhs
+		Subtract,
+		Multiply,
+		Divide,
+		UnaryPlus,   // replace top
+		UnaryMinus,
+		Range,       // push the partial result of function over the numbers in range
+		Argument,    // turn the value on top into a partial result of function
+		Call,        // pop arg_count partial results, push the result of function
+	};
+
+	// Aggregate functions. A call is compiled as its arguments, each leaving a partial
+	// result on the stack (two values, sum and count, for Average; one for the rest),
+	// followed by Call, which combines them.
+	enum class Function : uint8_t {
+		Sum,
+		Average,
+		Min,
+		Max,
+		Count,
+	};
+
+	// One step of a compiled formula. The program is the expression in postfix order
+	// with literals and cell positions stored right in the instructions.
+	struct Instruction {
+		struct CellSlot {
+			int row;
+			int col;
+		};
+
+		// offsets fit in 16 bits since the sheet is at most 16384 cells wide and high
+		struct RangeSlot {
+			int16_t row;
+			int16_t col;
+			uint16_t rows;
+			uint16_t cols;
+		};
+
+		OpCode code;
+		Function function;  // for Range, Argument and Call
+		union {
+			double number;
+			CellSlot cell;
+			RangeSlot range;
+			uint32_t arg_count;
+		};
+	};
+
+	std::string_view GetFunctionName(Function function);
 }
 
+// Rectangle of cells referenced by a formula; like single cells it is stored as an offset
+// from the cell the formula belongs to.
+struct RangeReference {
+	Position top_left;
+	Size size;
+};
+
 class ParsingError : public std::runtime_error {
 	using std::runtime_error::runtime_error;
 };
@@ -18,15 +84,24 @@ class ParsingError : public std::runtime_error {
 class FormulaAST {
 public:
 	explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells);
-	FormulaAST(FormulaAST&&) = default;
-	FormulaAST& operator=(FormulaAST&&) = default;
+	FormulaAST(FormulaAST&&);
+	FormulaAST& operator=(FormulaAST&&);
 	~FormulaAST();
 
-	double Execute(const std::function<CellInterface::Value(Position)>& linker) const;
-	void PrintCells(std::ostream& out) const;
-	void Print(std::ostream& out) const;
-	void PrintFormula(std::ostream& out) const;
+	// Cell references are kept relative to the cell the formula was parsed for (R1C1 style),
+	// so the same AST serves every cell where the formula has the same shape; the methods
+	// below take the position of the cell to resolve them against.
 
+	// runs the compiled program; the AST itself is only used for printing.
+	// Errors come back as values, nothing is thrown during evaluation.
+	FormulaInterface::Value Execute(const std::function<CellInterface::Value(Position)>& linker, Position anchor = {}) const;
+	// same program, operands are read straight from the sheet
+	FormulaInterface::Value Execute(const EvaluationContext& context, Position anchor = {}) const;
+	void PrintCells(std::ostream& out, Position anchor = {}) const;
+	void Print(std::ostream& out, Position anchor = {}) const;
+	void PrintFormula(std::ostream& out, Position anchor = {}) const;
+
+	// offsets of the referenced cells from the anchor, sorted
 	std::forward_list<Position>& GetCells() {
 		return cells_;
 	}
@@ -34,13 +109,46 @@ public:
 		return cells_;
 	}
 
+	// offsets of the referenced ranges, in the order of the formula; their cells are not
+	// in GetCells()
+	const std::vector<RangeReference>& GetRanges() const {
+		return ranges_;
+	}
+
+	const std::vector<ASTImpl::Instruction>& GetProgram() const {
+		return program_;
+	}
+
 private:
 	std::unique_ptr<ASTImpl::Expr> root_expr_;
 	// physically stores cells so that they can be
 	// efficiently traversed without going through
 	// the whole AST
 	std::forward_list<Position> cells_;
+	std::vector<RangeReference> ranges_;
+	std::vector<ASTImpl::Instruction> program_;
+	size_t max_stack_depth_ = 0;
 };
 
+// Hand-written parser for the language of Formula.g4. Syntax errors are reported with
+// ParsingError, a well-formed reference to a cell outside the sheet with FormulaException.
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
\ No newline at end of file
+// anchor is the cell the formula belongs to; references are stored relative to it
+FormulaAST ParseFormulaAST(std::string_view text, Position anchor = {});
+
+// Writes to key the shape of the formula: its tokens with cell references replaced by their
+// offsets from anchor. Formulas with equal keys parse to the same relative AST, e.g. =A1*B1
+// in C1 and =A2*B2 in C2. Returns false if the text does not lex or references a cell
+// outside the sheet; only the parser reports those errors.
+bool MakeFormulaKey(std::string_view text, Position anchor, std::string& key);
+
+// Rebuilds the AST of a compiled program (see FormulaAST::GetProgram), e.g. one read back
+// from a snapshot, without going through the text. Throws ParsingError if the program is
+// not a well-formed postfix expression.
+FormulaAST BuildFormulaAST(const std::vector<ASTImpl::Instruction>& program);
+
+#ifdef SPREADSHEET_WITH_ANTLR
+// The parser generated by ANTLR from Formula.g4, kept to compare against
+// (configure with -DSPREADSHEET_WITH_ANTLR=ON).
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in);
+#endif
\ No newline at end of file
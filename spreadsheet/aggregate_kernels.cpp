@@ -0,0 +1,92 @@
+#include "aggregate_kernels.h"
+
+#include <algorithm>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SPREADSHEET_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace {
+	constexpr double INF = std::numeric_limits<double>::infinity();
+}// namespace
+
+#ifdef SPREADSHEET_SSE2
+
+// по четыре числа за шаг в два регистра, чтобы сложения не ждали друг друга
+double SumKernel(const double* values, size_t count) {
+	__m128d sum0 = _mm_setzero_pd();
+	__m128d sum1 = _mm_setzero_pd();
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		sum0 = _mm_add_pd(sum0, _mm_loadu_pd(values + i));
+		sum1 = _mm_add_pd(sum1, _mm_loadu_pd(values + i + 2));
+	}
+	const __m128d sum = _mm_add_pd(sum0, sum1);
+	double result = _mm_cvtsd_f64(sum) + _mm_cvtsd_f64(_mm_unpackhi_pd(sum, sum));
+	for (; i < count; ++i) {
+		result += values[i];
+	}
+	return result;
+}
+
+double MinKernel(const double* values, size_t count) {
+	__m128d min0 = _mm_set1_pd(INF);
+	__m128d min1 = min0;
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		min0 = _mm_min_pd(min0, _mm_loadu_pd(values + i));
+		min1 = _mm_min_pd(min1, _mm_loadu_pd(values + i + 2));
+	}
+	const __m128d min = _mm_min_pd(min0, min1);
+	double result = std::min(_mm_cvtsd_f64(min), _mm_cvtsd_f64(_mm_unpackhi_pd(min, min)));
+	for (; i < count; ++i) {
+		result = std::min(result, values[i]);
+	}
+	return result;
+}
+
+double MaxKernel(const double* values, size_t count) {
+	__m128d max0 = _mm_set1_pd(-INF);
+	__m128d max1 = max0;
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		max0 = _mm_max_pd(max0, _mm_loadu_pd(values + i));
+		max1 = _mm_max_pd(max1, _mm_loadu_pd(values + i + 2));
+	}
+	const __m128d max = _mm_max_pd(max0, max1);
+	double result = std::max(_mm_cvtsd_f64(max), _mm_cvtsd_f64(_mm_unpackhi_pd(max, max)));
+	for (; i < count; ++i) {
+		result = std::max(result, values[i]);
+	}
+	return result;
+}
+
+#else
+
+double SumKernel(const double* values, size_t count) {
+	double result = 0;
+	for (size_t i = 0; i < count; ++i) {
+		result += values[i];
+	}
+	return result;
+}
+
+double MinKernel(const double* values, size_t count) {
+	double result = INF;
+	for (size_t i = 0; i < count; ++i) {
+		result = std::min(result, values[i]);
+	}
+	return result;
+}
+
+double MaxKernel(const double* values, size_t count) {
+	double result = -INF;
+	for (size_t i = 0; i < count; ++i) {
+		result = std::max(result, values[i]);
+	}
+	return result;
+}
+
+#endif
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstddef>
+
+// Reductions over contiguous runs of doubles for the range functions of formulas.
+// They use SSE2 where the target has it (every x86-64 compiler does) and a plain loop
+// elsewhere. The sum adds in a different order than a left-to-right loop, so its last
+// bits may differ from one.
+double SumKernel(const double* values, size_t count);
+// +infinity for an empty run
+double MinKernel(const double* values, size_t count);
+// -infinity for an empty run
+double MaxKernel(const double* values, size_t count);
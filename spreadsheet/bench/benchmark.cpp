@@ -0,0 +1,850 @@
+// Microbenchmarks for the spreadsheet engine.
+// Built as a separate target (spreadsheet_bench); not part of the unit test run.
+
+#include "FormulaAST.h"
+#include "aggregate_kernels.h"
+#include "common.h"
+#include "evaluation_context.h"
+#include "formula.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+// ---------------------------------------------------------------------------
+// allocation accounting: every heap block carries its size in a small header
+// so that the benchmarks can report live bytes and allocation counts
+// ---------------------------------------------------------------------------
+
+namespace {
+	constexpr std::size_t HEADER_SIZE = alignof(std::max_align_t);
+
+	std::atomic<std::size_t> live_bytes{ 0 };
+	std::atomic<std::size_t> allocation_count{ 0 };
+
+	void* CountedAlloc(std::size_t size) {
+		void* block = std::malloc(size + HEADER_SIZE);
+		if (!block) {
+			throw std::bad_alloc{};
+		}
+		*static_cast<std::size_t*>(block) = size;
+		live_bytes += size;
+		++allocation_count;
+		return static_cast<char*>(block) + HEADER_SIZE;
+	}
+
+	void CountedFree(void* ptr) noexcept {
+		if (!ptr) {
+			return;
+		}
+		void* block = static_cast<char*>(ptr) - HEADER_SIZE;
+		live_bytes -= *static_cast<std::size_t*>(block);
+		std::free(block);
+	}
+}// namespace
+
+void* operator new(std::size_t size) {
+	return CountedAlloc(size);
+}
+
+void* operator new[](std::size_t size) {
+	return CountedAlloc(size);
+}
+
+void operator delete(void* ptr) noexcept {
+	CountedFree(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+	CountedFree(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+	CountedFree(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+	CountedFree(ptr);
+}
+
+namespace {
+	class Measure {
+	public:
+		explicit Measure(std::string name)
+			: name_(std::move(name))
+			, start_(std::chrono::steady_clock::now())
+			, start_bytes_(live_bytes.load())
+			, start_allocations_(allocation_count.load()) {
+		}
+
+		// prints elapsed time and, if items > 0, heap usage per item
+		void Report(std::size_t items) const {
+			using namespace std::chrono;
+			const auto elapsed = duration_cast<microseconds>(steady_clock::now() - start_).count();
+			std::cout << std::left << std::setw(40) << name_ << std::right << std::fixed
+				<< std::setw(10) << std::setprecision(3) << elapsed / 1000.0 << " ms";
+			if (items > 0) {
+				const double bytes = static_cast<double>(live_bytes.load()) - static_cast<double>(start_bytes_);
+				const double allocations = static_cast<double>(allocation_count.load() - start_allocations_);
+				std::cout << std::setw(10) << std::setprecision(1) << bytes / items << " B/cell"
+					<< std::setw(8) << std::setprecision(2) << allocations / items << " alloc/cell";
+			}
+			std::cout << std::defaultfloat << std::endl;
+		}
+
+	private:
+		std::string name_;
+		std::chrono::steady_clock::time_point start_;
+		std::size_t start_bytes_;
+		std::size_t start_allocations_;
+	};
+
+	constexpr int ROWS = 1000;
+	constexpr int COLS = 100;
+
+	void BenchSetNumbers() {
+		auto sheet = CreateSheet();
+		Measure m("SetCell numbers 1000x100");
+		for (int row = 0; row < ROWS; ++row) {
+			for (int col = 0; col < COLS; ++col) {
+				sheet->SetCell({ row, col }, std::to_string(row * COLS + col));
+			}
+		}
+		m.Report(ROWS * COLS);
+	}
+
+	void BenchSetFormulas() {
+		auto sheet = CreateSheet();
+		for (int row = 0; row < ROWS; ++row) {
+			sheet->SetCell({ row, 0 }, std::to_string(row));
+		}
+		Measure m("SetCell formulas =A{n}*2 1000x1");
+		for (int row = 0; row < ROWS; ++row) {
+			sheet->SetCell({ row, 1 }, "=A" + std::to_string(row + 1) + "*2");
+		}
+		m.Report(ROWS);
+	}
+	void BenchRewireFormulas() {
+		constexpr int FORMULAS = 10000;
+		auto sheet = CreateSheet();
+		for (int row = 0; row < FORMULAS; ++row) {
+			sheet->SetCell({ row, 1 }, "=A" + std::to_string(row + 1) + "+A" + std::to_string(row + 2));
+		}
+		Measure m("SetCell rewire 2 edges x10000");
+		for (int row = 0; row < FORMULAS; ++row) {
+			sheet->SetCell({ row, 1 }, "=A" + std::to_string(row + 3) + "+A1");
+		}
+		m.Report(0);
+	}
+	// загрузка листа снизу вверх, где каждая формула ссылается на строку выше:
+	// по одной ячейке порядок графа перестраивается на каждой вставке
+	void BenchLoadFormulas() {
+		constexpr int LOAD_ROWS = 10000;
+		std::vector<std::pair<Position, std::string>> cells;
+		for (int row = LOAD_ROWS - 1; row >= 0; --row) {
+			const std::string n = std::to_string(row + 1);
+			cells.push_back({ Position{ row, 0 }, n });
+			cells.push_back({ Position{ row, 1 }, row == 0 ? "=A1" : "=A" + n + "+B" + std::to_string(row) });
+		}
+		{
+			Sheet sheet;
+			Measure m("Load 10000x2 with SetCell");
+			for (const auto& [pos, text] : cells) {
+				sheet.SetCell(pos, text);
+			}
+			m.Report(cells.size());
+		}
+		{
+			Sheet sheet;
+			auto batch = cells;
+			Measure m("Load 10000x2 with SetCells");
+			sheet.SetCells(std::move(batch));
+			m.Report(cells.size());
+		}
+	}
+
+	// числовой файл в формате PrintTexts
+	void BenchLoadTexts() {
+		constexpr int LOAD_ROWS = 10000;
+		std::string text;
+		for (int row = 0; row < LOAD_ROWS; ++row) {
+			for (int col = 0; col < COLS; ++col) {
+				text += std::to_string(row * COLS + col) + (col + 1 < COLS ? "\t" : "\n");
+			}
+		}
+		const double megabytes = text.size() / 1e6;
+		Sheet sheet;
+		std::istringstream input(std::move(text));
+		const auto start = std::chrono::steady_clock::now();
+		Measure m("LoadTexts 10000x100 numbers");
+		sheet.LoadTexts(input);
+		m.Report(LOAD_ROWS * COLS);
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		std::cout << "  " << std::setprecision(1) << std::fixed << megabytes / elapsed.count() << " MB/s"
+			<< std::defaultfloat << std::endl;
+	}
+
+	// сохранение и восстановление листа: текстом через PrintTexts/LoadTexts и снимком
+	void BenchSaveRestore() {
+		constexpr int SAVE_ROWS = 10000;
+		Sheet sheet;
+		std::vector<std::pair<Position, std::string>> cells;
+		for (int row = 0; row < SAVE_ROWS; ++row) {
+			const std::string n = std::to_string(row + 1);
+			cells.push_back({ Position{ row, 0 }, std::to_string(row * 0.5) });
+			cells.push_back({ Position{ row, 1 }, "=A" + n + "*2+1" });
+			cells.push_back({ Position{ row, 2 }, "=(A" + n + "+B" + n + ")/(1+A" + n + ")" });
+			cells.push_back({ Position{ row, 3 }, "=C" + n + "-B" + n + "*0.25+" + n });
+			cells.push_back({ Position{ row, 4 }, "label " + n });
+		}
+		sheet.SetCells(std::move(cells));
+		const size_t cell_count = SAVE_ROWS * 5;
+
+		std::string text;
+		{
+			Measure m("Save 10000x5 as text");
+			std::ostringstream out;
+			sheet.PrintTexts(out);
+			text = out.str();
+			m.Report(0);
+		}
+		{
+			Sheet restored;
+			std::istringstream in(text);
+			Measure m("Restore 10000x5 from text");
+			restored.LoadTexts(in);
+			m.Report(cell_count);
+		}
+		std::string snapshot;
+		{
+			Measure m("Save 10000x5 as snapshot");
+			std::ostringstream out;
+			sheet.SaveSnapshot(out);
+			snapshot = out.str();
+			m.Report(0);
+		}
+		{
+			Sheet restored;
+			std::istringstream in(snapshot);
+			Measure m("Restore 10000x5 from snapshot");
+			restored.LoadSnapshot(in);
+			m.Report(cell_count);
+		}
+		std::cout << "  text " << text.size() << " bytes, snapshot " << snapshot.size() << " bytes" << std::endl;
+	}
+
+	// широкая модель: 4 уровня по 16000 независимых формул
+	void BenchRecalculate() {
+		constexpr int WIDTH = 16000;
+		constexpr int LEVELS = 4;
+		Sheet sheet;
+		std::vector<std::pair<Position, std::string>> cells;
+		for (int col = 0; col < WIDTH; ++col) {
+			cells.push_back({ Position{ 0, col }, std::to_string(col) });
+			for (int row = 1; row <= LEVELS; ++row) {
+				const std::string above = Position{ row - 1, col }.ToString();
+				const std::string left = Position{ row - 1, col > 0 ? col - 1 : col }.ToString();
+				cells.push_back({ Position{ row, col }, "=(" + above + "*3+" + left + ")/(1+" + above + ")-" + left + "/7" });
+			}
+		}
+		sheet.SetCells(std::move(cells));
+		{
+			Measure m("Lazy GetValue 16000x4 formulas");
+			double sum = 0;
+			for (int row = 1; row <= LEVELS; ++row) {
+				for (int col = 0; col < WIDTH; ++col) {
+					const auto value = sheet.GetCell(Position{ row, col })->GetValue();
+					sum += std::holds_alternative<double>(value) ? std::get<double>(value) : 0.0;
+				}
+			}
+			m.Report(0);
+			if (sum == 0) {
+				std::cout << "unexpected sum" << std::endl;
+			}
+		}
+		Measure m("RecalculateAll 16000x4 formulas");
+		sheet.RecalculateAll();
+		m.Report(0);
+		std::cout << "  " << std::thread::hardware_concurrency() << " hardware threads" << std::endl;
+	}
+
+	// правка в начале цепочки из 16000 формул и чтение её конца: на потоке клиента
+	// и с фоновым пересчётом, где правка сама по себе ничего не вычисляет
+	void BenchBackgroundRecalc() {
+		constexpr int CHAIN = 16000;
+		constexpr int EDITS = 50;
+		Sheet sheet;
+		std::vector<std::pair<Position, std::string>> cells;
+		cells.push_back({ Position{ 0, 0 }, "0" });
+		for (int row = 1; row < CHAIN; ++row) {
+			cells.push_back({ Position{ row, 0 }, "=A" + std::to_string(row) + "+1" });
+		}
+		sheet.SetCells(std::move(cells));
+		const Position last{ CHAIN - 1, 0 };
+		{
+			Measure m("Edit + read chain x50 (foreground)");
+			for (int edit = 0; edit < EDITS; ++edit) {
+				sheet.SetCell({ 0, 0 }, std::to_string(edit));
+				sheet.GetValue(last);
+			}
+			m.Report(0);
+		}
+		sheet.SetBackgroundRecalc(true);
+		sheet.WaitRecalcIdle();
+		{
+			Measure m("Edit chain x50 (background, edits)");
+			for (int edit = 0; edit < EDITS; ++edit) {
+				sheet.SetCell({ 0, 0 }, std::to_string(edit));
+			}
+			m.Report(0);
+		}
+		Measure m("  then WaitRecalcIdle");
+		sheet.WaitRecalcIdle();
+		m.Report(0);
+		sheet.SetBackgroundRecalc(false);
+	}
+
+	// readers share the sheet, so reads should scale with the threads while one writer edits
+	void BenchConcurrentReaders() {
+		constexpr int ROWS = 10000;
+		constexpr int READS = 400000;  // per thread
+		Sheet sheet;
+		std::vector<std::pair<Position, std::string>> cells;
+		cells.push_back({ Position{ 0, 0 }, "1" });
+		for (int row = 1; row < ROWS; ++row) {
+			const std::string n = std::to_string(row);
+			cells.push_back({ Position{ row, 0 }, "=A" + n + "+1" });
+			cells.push_back({ Position{ row, 1 }, "=A" + n + "*2+B" + n });
+		}
+		sheet.SetCells(std::move(cells));
+		sheet.RecalculateAll();
+
+		const unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned threads = 1; threads <= max_threads; threads = threads < max_threads ? std::min(threads * 2, max_threads) : threads + 1) {
+			std::atomic<bool> done = false;
+			// писатель правит ячейку без зависимых, чтобы чтения не уходили в пересчёт
+			std::thread writer([&] {
+				for (int edit = 0; !done; ++edit) {
+					sheet.SetCell({ 0, 2 }, std::to_string(edit));
+				}
+			});
+			Measure m("GetValue x400000 on " + std::to_string(threads) + " thread(s)");
+			std::vector<std::thread> readers;
+			for (unsigned t = 0; t < threads; ++t) {
+				readers.emplace_back([&sheet, t] {
+					double sum = 0;
+					for (int i = 0; i < READS; ++i) {
+						const auto value = sheet.GetValue({ 1 + static_cast<int>((i * 7 + t) % (ROWS - 1)), i % 2 });
+						sum += std::get<double>(value);
+					}
+					if (sum == 0) {
+						std::cout << "unexpected sum" << std::endl;
+					}
+				});
+			}
+			for (std::thread& reader : readers) {
+				reader.join();
+			}
+			m.Report(0);
+			done = true;
+			writer.join();
+		}
+
+		// A long reader keeps the writer waiting, and new readers queue up behind the
+		// writer. They should sleep there: the process CPU time stays near the wall time
+		// of the long reader instead of growing with the number of queued readers.
+		constexpr unsigned QUEUED_READERS = 4;
+		constexpr int PRINTS = 20;
+		std::atomic<bool> done = false;
+		std::vector<std::thread> contenders;
+		contenders.emplace_back([&] {
+			for (int edit = 0; !done; ++edit) {
+				sheet.SetCell({ 0, 2 }, std::to_string(edit));
+			}
+		});
+		for (unsigned t = 0; t < QUEUED_READERS; ++t) {
+			contenders.emplace_back([&sheet, &done, t] {
+				double sum = 0;
+				for (int i = 0; !done; ++i) {
+					sum += std::get<double>(sheet.GetValue({ 1 + static_cast<int>((i * 7 + t) % (ROWS - 1)), 0 }));
+				}
+				if (sum < 0) {
+					std::cout << "unexpected sum" << std::endl;
+				}
+			});
+		}
+		const std::clock_t cpu_start = std::clock();
+		Measure m("PrintValues x20, writer + 4 readers wait");
+		for (int print = 0; print < PRINTS; ++print) {
+			std::ostringstream output;
+			sheet.PrintValues(output);
+		}
+		m.Report(0);
+		const double cpu_ms = 1000.0 * static_cast<double>(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+		done = true;
+		for (std::thread& contender : contenders) {
+			contender.join();
+		}
+		std::cout << std::left << std::setw(40) << "  process CPU meanwhile" << std::right << std::fixed
+			<< std::setw(10) << std::setprecision(3) << cpu_ms << " ms" << std::defaultfloat << std::endl;
+	}
+
+	void BenchEvaluateFormulas() {
+		constexpr int FORMULAS = 10000;
+		constexpr int PASSES = 20;
+		auto sheet = std::make_unique<Sheet>();
+		std::vector<std::unique_ptr<FormulaInterface>> formulas;
+		for (int row = 0; row < FORMULAS; ++row) {
+			const std::string n = std::to_string(row + 1);
+			sheet->SetCell({ row, 0 }, "=" + n);
+			sheet->SetCell({ row, 1 }, "=" + n + "/2");
+			formulas.push_back(ParseFormula("(A" + n + "+B" + n + ")*2-A" + n + "/(1+B" + n + ")+-3"));
+		}
+		Measure m("Evaluate 10000 formulas x20");
+		double sum = 0;
+		for (int pass = 0; pass < PASSES; ++pass) {
+			for (const auto& formula : formulas) {
+				auto value = formula->Evaluate(*sheet);
+				sum += std::holds_alternative<double>(value) ? std::get<double>(value) : 0.0;
+			}
+		}
+		m.Report(0);
+
+		Measure direct("Evaluate 10000 formulas x20 (context)");
+		const EvaluationContext context{ *sheet };
+		for (int pass = 0; pass < PASSES; ++pass) {
+			for (const auto& formula : formulas) {
+				auto value = formula->Evaluate(context);
+				sum += std::holds_alternative<double>(value) ? std::get<double>(value) : 0.0;
+			}
+		}
+		direct.Report(0);
+		if (sum == 0) {
+			std::cout << "unexpected sum" << std::endl;
+		}
+	}
+
+	std::vector<std::string> MakeParseInputs() {
+		std::vector<std::string> inputs;
+		for (int i = 1; i <= 10000; ++i) {
+			const std::string n = std::to_string(i);
+			inputs.push_back("(A" + n + "+B" + n + ")*2.5-C" + n + "/(1+-D" + n + ")+" + n + "e-3");
+		}
+		return inputs;
+	}
+
+	// разобранные формулы сразу удаляются, так что alloc/cell здесь - выделения на одну формулу
+	template <typename ParseFunc>
+	void BenchParse(const std::string& name, const std::vector<std::string>& inputs, ParseFunc parse) {
+		Measure m(name);
+		for (const std::string& input : inputs) {
+			parse(input);
+		}
+		m.Report(inputs.size());
+	}
+
+	void BenchParseFormulas() {
+		const auto inputs = MakeParseInputs();
+		BenchParse("Parse 10000 formulas", inputs, [](const std::string& input) {
+			return ParseFormulaAST(input);
+		});
+#ifdef SPREADSHEET_WITH_ANTLR
+		BenchParse("Parse 10000 formulas (ANTLR)", inputs, [](const std::string& input) {
+			std::istringstream in(input);
+			return ParseFormulaASTWithAntlr(in);
+		});
+#endif
+	}
+
+	// формулы над импортированными числами, которые хранятся как текст
+	void BenchEvaluateNumericText() {
+		constexpr int FORMULAS = 10000;
+		constexpr int PASSES = 20;
+		Sheet sheet;
+		std::vector<std::unique_ptr<FormulaInterface>> formulas;
+		for (int row = 0; row < FORMULAS; ++row) {
+			const std::string n = std::to_string(row + 1);
+			sheet.SetCell({ row, 0 }, n + "25");
+			sheet.SetCell({ row, 1 }, "1234567890123456789" + n);
+			formulas.push_back(ParseFormula("A" + n + "*2+B" + n));
+		}
+		Measure m("Evaluate 10000 formulas over text x20");
+		const EvaluationContext context{ sheet };
+		double sum = 0;
+		for (int pass = 0; pass < PASSES; ++pass) {
+			for (const auto& formula : formulas) {
+				auto value = formula->Evaluate(context);
+				sum += std::holds_alternative<double>(value) ? std::get<double>(value) : 0.0;
+			}
+		}
+		m.Report(0);
+		if (sum == 0) {
+			std::cout << "unexpected sum" << std::endl;
+		}
+	}
+
+	// деление на пустые ячейки: каждая формула даёт #ARITHM!
+	void BenchEvaluateErrors() {
+		constexpr int FORMULAS = 10000;
+		constexpr int PASSES = 20;
+		Sheet sheet;
+		std::vector<std::unique_ptr<FormulaInterface>> formulas;
+		for (int row = 0; row < FORMULAS; ++row) {
+			const std::string n = std::to_string(row + 1);
+			formulas.push_back(ParseFormula("(A" + n + "+1)/B" + n + "*2"));
+		}
+		Measure m("Evaluate 10000 error formulas x20");
+		const EvaluationContext context{ sheet };
+		size_t errors = 0;
+		for (int pass = 0; pass < PASSES; ++pass) {
+			for (const auto& formula : formulas) {
+				errors += std::holds_alternative<FormulaError>(formula->Evaluate(context)) ? 1 : 0;
+			}
+		}
+		m.Report(0);
+		if (errors != size_t(FORMULAS) * PASSES) {
+			std::cout << "unexpected error count" << std::endl;
+		}
+	}
+
+	// одна функция над столбцом против той же суммы, записанной по ячейкам
+	void BenchRangeFunctions() {
+		constexpr int ROWS = 16000;
+		constexpr int TERMS = 1000;
+		constexpr int PASSES = 200;
+		Sheet sheet;
+		std::vector<std::pair<Position, std::string>> cells;
+		for (int row = 0; row < ROWS; ++row) {
+			cells.push_back({ Position{ row, 0 }, std::to_string(row % 97) + ".5" });
+		}
+		sheet.SetCells(std::move(cells));
+		std::string terms = "A1";
+		for (int row = 2; row <= TERMS; ++row) {
+			terms += "+A" + std::to_string(row);
+		}
+		const EvaluationContext context{ sheet };
+		const auto run = [&](const std::string& name, const std::string& expression, int passes) {
+			const auto formula = ParseFormula(expression);
+			Measure m(name);
+			double sum = 0;
+			for (int pass = 0; pass < passes; ++pass) {
+				const auto value = formula->Evaluate(context);
+				sum += std::holds_alternative<double>(value) ? std::get<double>(value) : 0.0;
+			}
+			m.Report(0);
+			if (sum == 0) {
+				std::cout << "unexpected sum" << std::endl;
+			}
+		};
+		run("A1+...+A1000 x200", terms, PASSES);
+		run("SUM(A1:A1000) x200", "SUM(A1:A1000)", PASSES);
+		run("SUM(A1:A16000) x200", "SUM(A1:A16000)", PASSES);
+		run("AVERAGE/MIN/MAX(A1:A16000) x200", "AVERAGE(A1:A16000)+MIN(A1:A16000)+MAX(A1:A16000)", PASSES);
+
+		std::vector<double> numbers(1 << 20);
+		for (size_t i = 0; i < numbers.size(); ++i) {
+			numbers[i] = static_cast<double>(i % 1000) * 0.5;
+		}
+		Measure kernel("SumKernel over 1M doubles x200");
+		double sum = 0;
+		for (int pass = 0; pass < PASSES; ++pass) {
+			sum += SumKernel(numbers.data(), numbers.size());
+		}
+		kernel.Report(0);
+		Measure loop("plain loop over 1M doubles x200");
+		double loop_sum = 0;
+		for (int pass = 0; pass < PASSES; ++pass) {
+			for (double number : numbers) {
+				loop_sum += number;
+			}
+		}
+		loop.Report(0);
+		if (sum != loop_sum) {
+			std::cout << "unexpected sum" << std::endl;
+		}
+	}
+
+	// Running totals C_r = SUM(A1:A_r) over a full column: 16000 ranges covering 128M
+	// cells in all, each kept once in the range index. An edit in A then finds the totals
+	// below it without any cell of the ranges having edges.
+	void BenchRangeDependencies() {
+		constexpr int ROWS = 16000;
+		constexpr int EDITS = 1000;
+		Sheet sheet;
+		std::vector<std::pair<Position, std::string>> cells;
+		for (int row = 0; row < ROWS; ++row) {
+			cells.push_back({ Position{ row, 0 }, std::to_string(row % 97) });
+		}
+		sheet.SetCells(std::move(cells));
+		{
+			Measure m("set 16000 running-total ranges");
+			for (int row = 0; row < ROWS; ++row) {
+				sheet.SetCell(Position{ row, 2 }, "=SUM(A1:A" + std::to_string(row + 1) + ")");
+			}
+			m.Report(0);
+		}
+		{
+			Measure m("1000 edits inside the ranges");
+			for (int edit = 0; edit < EDITS; ++edit) {
+				sheet.SetCell(Position{ ROWS - 1 - edit, 0 }, std::to_string(edit));
+			}
+			m.Report(0);
+		}
+		for (int row = 0; row < ROWS; ++row) {
+			sheet.ClearCell(Position{ row, 2 });
+		}
+		sheet.SetCell(Position{ 0, 4 }, "=SUM(A1:A16000)");
+		{
+			Measure m("1000 edits+reads under one SUM(A1:A16000)");
+			for (int edit = 0; edit < EDITS; ++edit) {
+				sheet.SetCell(Position{ edit, 0 }, std::to_string(edit));
+				if (sheet.GetValue(Position{ 0, 4 }) == CellInterface::Value(-1.0)) {
+					std::cout << "unexpected sum" << std::endl;
+				}
+			}
+			m.Report(0);
+		}
+		// the range keeps being there: a new reference must not search the whole chain
+		// depending on the edited cell
+		for (int row = 1; row < ROWS; ++row) {
+			sheet.SetCell(Position{ row, 6 }, "=G" + std::to_string(row) + "+1");
+		}
+		{
+			// a range is indexed once, not once per column it spans
+			Sheet wide;
+			Measure m("set 1000 row-wide ranges =SUM(Bn:XFDn)");
+			for (int row = 0; row < EDITS; ++row) {
+				const std::string n = std::to_string(row + 1);
+				wide.SetCell(Position{ row, 0 }, "=SUM(B" + n + ":XFD" + n + ")");
+			}
+			m.Report(0);
+		}
+		{
+			Measure m("1000 rewires of a 16000-chain head beside a range");
+			for (int edit = 0; edit < EDITS; ++edit) {
+				sheet.SetCell(Position{ 0, 6 }, "=B" + std::to_string(edit % 100 + 1) + "+B" + std::to_string(edit % 100 + 2));
+			}
+			m.Report(0);
+		}
+	}
+
+	// An outside consumer summing a column of 16000 cells (every tenth a formula), cell by
+	// cell through GetValue and segment by segment through GetValueSpan.
+	void BenchValueSpans() {
+		constexpr int ROWS = 16000;
+		constexpr int PASSES = 200;
+		Sheet sheet;
+		std::vector<std::pair<Position, std::string>> cells;
+		for (int row = 0; row < ROWS; ++row) {
+			cells.push_back({ Position{ row, 0 }, row % 10 == 0 ? "=" + std::to_string(row) + "/2" : std::to_string(row % 97) });
+		}
+		sheet.SetCells(std::move(cells));
+		sheet.RecalculateDirty();
+		double by_cell = 0;
+		{
+			Measure m("GetValue column sum x200");
+			for (int pass = 0; pass < PASSES; ++pass) {
+				for (int row = 0; row < ROWS; ++row) {
+					const CellInterface::Value value = sheet.GetValue(Position{ row, 0 });
+					if (const double* number = std::get_if<double>(&value)) {
+						by_cell += *number;
+					}
+					else if (const std::string* text = std::get_if<std::string>(&value)) {
+						by_cell += std::stod(*text);
+					}
+				}
+			}
+			m.Report(0);
+		}
+		double by_span = 0;
+		{
+			Measure m("GetValueSpan column sum x200");
+			for (int pass = 0; pass < PASSES; ++pass) {
+				for (int row = 0; row < ROWS; row += ValueSpan::SIZE) {
+					const ValueSpan span = sheet.GetValueSpan(Position{ row, 0 });
+					by_span += SumKernel(span.GetValues(), std::min(ValueSpan::SIZE, ROWS - row));
+				}
+			}
+			m.Report(0);
+		}
+		if (by_cell != by_span) {
+			std::cout << "unexpected sum" << std::endl;
+		}
+	}
+
+	// Export of a sparse 10000 x 1000 sheet (one cell in 50, every fourth a formula)
+	// and of a dense 2000 x 50 block of numbers.
+	void BenchPrint() {
+		Sheet sparse;
+		std::vector<std::pair<Position, std::string>> cells;
+		for (int row = 0; row < 10000; ++row) {
+			for (int col = row % 50; col < 1000; col += 50) {
+				cells.push_back({ Position{ row, col }, (row + col) % 4 == 0 ? "=" + std::to_string(row) + "/7" : std::to_string(row * 0.25) });
+			}
+		}
+		sparse.SetCells(std::move(cells));
+		Sheet dense;
+		for (int row = 0; row < 2000; ++row) {
+			for (int col = 0; col < 50; ++col) {
+				cells.push_back({ Position{ row, col }, std::to_string((row * 50 + col) / 3.0) });
+			}
+		}
+		dense.SetCells(std::move(cells));
+		const auto run = [](const std::string& name, const Sheet& sheet, bool values) {
+			std::ostringstream out;
+			Measure m(name);
+			if (values) {
+				sheet.PrintValues(out);
+			}
+			else {
+				sheet.PrintTexts(out);
+			}
+			m.Report(0);
+			if (out.str().empty()) {
+				std::cout << "unexpected output" << std::endl;
+			}
+		};
+		run("PrintValues sparse 10000x1000", sparse, true);
+		run("PrintTexts sparse 10000x1000", sparse, false);
+		run("PrintValues dense 2000x50", dense, true);
+		run("PrintTexts dense 2000x50", dense, false);
+	}
+
+	// A 16000 x 26 sheet of formulas over A1, edited before each export (not timed) so that
+	// every formula is dirty: the whole sheet against the window rows 5001-5100, columns A-Z.
+	void BenchWindowPrint() {
+		constexpr int ROWS = 16000;
+		Sheet sheet;
+		std::vector<std::pair<Position, std::string>> cells{ { Position{ 0, 0 }, "1" } };
+		for (int row = 0; row < ROWS; ++row) {
+			for (int col = row == 0 ? 1 : 0; col < 26; ++col) {
+				cells.push_back({ Position{ row, col }, "=A1*" + std::to_string(row) + "+" + std::to_string(col) });
+			}
+		}
+		sheet.SetCells(std::move(cells));
+		int edits = 0;
+		const auto run = [&sheet, &edits](const std::string& name, auto&& print) {
+			sheet.SetCell(Position{ 0, 0 }, std::to_string(++edits + 1));
+			std::ostringstream out;
+			Measure m(name);
+			print(out);
+			m.Report(0);
+			if (out.str().empty()) {
+				std::cout << "unexpected output" << std::endl;
+			}
+		};
+		run("PrintValues whole 16000x26", [&sheet](std::ostream& out) {
+			sheet.PrintValues(out);
+		});
+		run("PrintValues window 100x26", [&sheet](std::ostream& out) {
+			sheet.PrintValues(out, Position{ 5000, 0 }, Size{ 100, 26 });
+		});
+		run("GetValues window 100x26", [&sheet](std::ostream& out) {
+			out << sheet.GetValues(Position{ 5000, 0 }, Size{ 100, 26 }).size();
+		});
+	}
+
+	// PositionHash in a hash set of 1000 x 1000 positions
+	void BenchPositionHash() {
+		constexpr int SIDE = 1000;
+		std::unordered_set<Position, PositionHash> positions;
+		positions.reserve(SIDE * SIDE);
+		{
+			Measure m("PositionHash insert 1000x1000");
+			for (int row = 0; row < SIDE; ++row) {
+				for (int col = 0; col < SIDE; ++col) {
+					positions.insert(Position{ row, col });
+				}
+			}
+			m.Report(0);
+		}
+		size_t found = 0;
+		{
+			Measure m("PositionHash find 1000x1000");
+			for (int col = 0; col < SIDE; ++col) {
+				for (int row = 0; row < SIDE; ++row) {
+					found += positions.count(Position{ row, col });
+				}
+			}
+			m.Report(0);
+		}
+		if (found != static_cast<size_t>(SIDE) * SIDE) {
+			std::cout << "unexpected count" << std::endl;
+		}
+	}
+
+	// A1 references of every column A..XFD (one to three letters) with rows of one to
+	// five digits, written and read back
+	void BenchPositionStrings() {
+		constexpr int ROW_STEP = 997;
+		std::vector<Position> positions;
+		for (int col = 0; col < Position::MAX_COLS; ++col) {
+			for (int row = col % ROW_STEP; row < Position::MAX_ROWS; row += ROW_STEP) {
+				positions.push_back({ row, col });
+			}
+		}
+		std::vector<std::string> texts;
+		texts.reserve(positions.size());
+		{
+			Measure m("Position::ToString A1..XFD16384");
+			for (Position pos : positions) {
+				texts.push_back(pos.ToString());
+			}
+			m.Report(positions.size());
+		}
+		size_t length = 0;
+		{
+			Measure m("Position::ToChars A1..XFD16384");
+			char buffer[Position::MAX_STRING_LENGTH];
+			for (Position pos : positions) {
+				length += pos.ToChars(buffer, buffer + sizeof(buffer)).ptr - buffer;
+			}
+			m.Report(positions.size());
+		}
+		size_t matched = 0;
+		{
+			Measure m("Position::FromString A1..XFD16384");
+			for (size_t i = 0; i < texts.size(); ++i) {
+				matched += Position::FromString(texts[i]) == positions[i];
+			}
+			m.Report(positions.size());
+		}
+		if (matched != positions.size() || length == 0) {
+			std::cout << "unexpected mismatch" << std::endl;
+		}
+	}
+}// namespace
+
+int main() {
+	BenchSetNumbers();
+	BenchSetFormulas();
+	BenchRewireFormulas();
+	BenchLoadFormulas();
+	BenchLoadTexts();
+	BenchSaveRestore();
+	BenchRecalculate();
+	BenchBackgroundRecalc();
+	BenchConcurrentReaders();
+	BenchParseFormulas();
+	BenchEvaluateFormulas();
+	BenchEvaluateNumericText();
+	BenchEvaluateErrors();
+	BenchRangeFunctions();
+	BenchRangeDependencies();
+	BenchValueSpans();
+	BenchPrint();
+	BenchWindowPrint();
+	BenchPositionHash();
+	BenchPositionStrings();
+}
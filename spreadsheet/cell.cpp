@@ -1,162 +1,138 @@
 #include "cell.h"
 
-#include <cassert>
-#include <iostream>
-#include <string>
-
-#include <memory>
-#include <unordered_set>
+#include "evaluation_context.h"
+#include "sheet.h"
 
-#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <string>
 
 using namespace std::literals;
 
 
- Cell::Cell(Sheet* sheet)
-	: impl_(), owner_sheet_(sheet) 
+Cell::Cell(Sheet* sheet)
+	: impl_(), owner_sheet_(sheet)
 {
 }
 
-Cell& Cell::operator=(Cell&& rhs) {
-	if (this != &rhs) {
-		impl_ = std::move(rhs.impl_);
-		owner_sheet_ = std::move(rhs.owner_sheet_);
-	}
-	return *this;
-}
-
-Cell::Cell(Cell&& other)
-	: impl_(std::move(other.impl_)), owner_sheet_(std::move(other.owner_sheet_)) 
-{
-}
-
-void Cell::Set(std::string text) {
+void Cell::Set(std::string text, Position pos) {
 	if (text.empty()) {
-		EmptyImpl empty_cell = EmptyImpl{};
-		impl_ = std::make_unique<EmptyImpl>(std::move(empty_cell));
+		impl_.emplace<EmptyImpl>();
 		return;
 	}
 	if (text[0] == FORMULA_SIGN && text.size() != 1) {
-		FormulaImpl	formula_cell = FormulaImpl{};
+		// парсим до замены impl_, чтобы при ошибке ячейка не изменилась
+		std::shared_ptr<const SharedFormula> formula;
 		try {
-			formula_cell.SetData(std::string{ text.begin() + 1, text.end() });
+			formula = owner_sheet_->GetFormulaPool().Intern(std::string_view{ text }.substr(1), pos);
 		}
 		catch (const std::exception& exc) {
 			std::throw_with_nested(FormulaException(exc.what()));
 		}
-		impl_ = std::make_unique<FormulaImpl>(std::move(formula_cell));
+		SetFormula(std::move(formula), pos);
 	}
 	else {
-		TextImpl	text_cell = TextImpl{};
-		text_cell.SetData(std::move(text));
-		impl_ = std::make_unique<TextImpl>(std::move(text_cell));
+		impl_.emplace<TextImpl>(std::move(text));
 	}
 }
 
-void Cell::SetDependences(Position ref_pos) {
-	impl_->SetDependence(ref_pos);
+void Cell::SetFormula(std::shared_ptr<const SharedFormula> formula, Position pos) {
+	impl_.emplace<FormulaImpl>(std::move(formula), pos);
+}
+
+void Cell::SetText(std::string_view text) {
+	impl_.emplace<TextImpl>(std::string(text));
 }
 
 void Cell::Clear() {
-	impl_.reset();
+	impl_.emplace<EmptyImpl>();
 }
 
 
 Cell::Value Cell::GetValue() const {
-	if (!owner_sheet_) {
-		throw;
+	const Sheet& sheet = *owner_sheet_;
+	if (sheet.InBatch()) {
+		throw std::logic_error("cannot read values inside an open batch");
 	}
-	return impl_->GetValue(reinterpret_cast<const SheetInterface&>(*owner_sheet_));
+	return std::visit([&sheet](const auto& impl) { return impl.GetValue(sheet); }, impl_);
 }
+
 std::string Cell::GetText() const {
-	return impl_->GetText();
+	return std::visit([](const auto& impl) { return impl.GetText(); }, impl_);
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
-	return impl_->GetReferencedCells();
-}
-
-std::vector<Position> Cell::GetDependentCells() const {
-	return impl_->GetDependentCells();
+	return std::visit([](const auto& impl) { return impl.GetReferencedCells(); }, impl_);
 }
 
 void Cell::InvalidateCache(Position pos) {
-	impl_->InvalidateCache();
-}
-
-void Cell::DeleteDependence(Position pos) {
-	impl_->DeleteDependence(pos);
-}
-
-bool Cell::IsReferenced() const {
-	return !impl_->GetDependentCells().empty();
+	std::visit([](auto& impl) { impl.InvalidateCache(); }, impl_);
 }
 
 bool Cell::HasEmptyCache() const {
-	return impl_->HasEmptyCache();
+	return std::visit([](const auto& impl) { return impl.HasEmptyCache(); }, impl_);
 }
 
 
-void EmptyImpl::SetData(std::string&&) {
-	InvalidateCache();
-}
-
-void EmptyImpl::SetDependence(Position ref_pos) {
-	dependent_.push_back(ref_pos);
-}
-
-EmptyImpl::ImpValue EmptyImpl::GetValue(const SheetInterface&) const {
-	if (cache_.has_value()) {
-		return cache_.value();
-	}
-	cache_ = 0;
-	return cache_.value();
+EmptyImpl::ImpValue EmptyImpl::GetValue(const Sheet&) const {
+	return 0.0;
 }
 
 std::string EmptyImpl::GetText() const {
-	return empty_;
+	return {};
 }
 
 std::vector<Position> EmptyImpl::GetReferencedCells() const {
 	return {};
 }
 
-std::vector<Position> EmptyImpl::GetDependentCells() const {
-	return dependent_;
-}
-
 void EmptyImpl::InvalidateCache() {
-	if (cache_.has_value()) {
-		cache_.reset();
-	}
-}
-void EmptyImpl::DeleteDependence(Position pos) {
-	dependent_.erase(std::find(dependent_.begin(), dependent_.end(), pos));
 }
 
 bool EmptyImpl::HasEmptyCache() const {
-	return !cache_.has_value();
+	return true;
 }
 
 
 
-void TextImpl::SetData(std::string&& text) {
-	text_ = std::move(text);
-	InvalidateCache();
+TextImpl::TextImpl(std::string text)
+	: text_(std::move(text))
+{
+	const FormulaInterface::Value number = ToNumber(std::string_view{ text_ }.substr(text_[0] == ESCAPE_SIGN ? 1 : 0));
+	if (std::holds_alternative<double>(number)) {
+		number_ = std::get<double>(number);
+	}
+	else if (std::get<FormulaError>(number).GetCategory() == FormulaError::Category::Arithmetic) {
+		number_ = std::numeric_limits<double>::infinity();
+	}
+	else {
+		number_ = std::numeric_limits<double>::quiet_NaN();
+	}
 }
 
-void TextImpl::SetDependence(Position ref_pos) {
-	dependent_.push_back(ref_pos);
+FormulaInterface::Value TextImpl::ToNumber(std::string_view value) {
+	if (value.empty()) {
+		return 0.0;
+	}
+	double number = 0.0;
+	const auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), number);
+	if (error == std::errc::result_out_of_range) {
+		return FormulaError{ FormulaError::Category::Arithmetic };
+	}
+	// inf и nan from_chars тоже принимает, но числами их не считаем
+	if (error != std::errc{} || end != value.data() + value.size() || !std::isfinite(number)) {
+		return FormulaError{ FormulaError::Category::Value };
+	}
+	return number;
 }
 
 std::string TextImpl::GetText() const {
 	return text_;
 }
 
-TextImpl::ImpValue TextImpl::GetValue(const SheetInterface&) const {
-	if (cache_.has_value()) {
-		return cache_.value();
-	}
+TextImpl::ImpValue TextImpl::GetValue(const Sheet&) const {
 	if (text_[0] == ESCAPE_SIGN) {
 		return std::string{ text_.begin() + 1, text_.end() };
 	}
@@ -166,88 +142,89 @@ TextImpl::ImpValue TextImpl::GetValue(const SheetInterface&) const {
 std::vector<Position> TextImpl::GetReferencedCells() const {
 	return {};
 }
-std::vector<Position> TextImpl::GetDependentCells() const {
-	return dependent_;
-}
 
 void TextImpl::InvalidateCache() {
-	if (cache_.has_value()) {
-		cache_.reset();
-	}
-}
-
-void TextImpl::DeleteDependence(Position pos) {
-	dependent_.erase(std::find(dependent_.begin(), dependent_.end(), pos));
 }
 
 bool TextImpl::HasEmptyCache() const {
-	return !cache_.has_value();
+	return true;
 }
 
 
 
-FormulaImpl& FormulaImpl::operator=(FormulaImpl&& rhs) {
-	if (this != &rhs) {
-		formula_ = std::move(rhs.formula_);
-	}
-	return *this;
+FormulaImpl::FormulaImpl(std::shared_ptr<const SharedFormula> formula, Position anchor)
+	: formula_(std::move(formula))
+	, anchor_(anchor)
+{
 }
 
-FormulaImpl::FormulaImpl(FormulaImpl&& other)
-	:formula_(std::move(other.formula_))
+FormulaImpl::FormulaImpl(FormulaImpl&& other) noexcept
+	: formula_(std::move(other.formula_))
+	, anchor_(other.anchor_)
+	, cache_(other.cache_.load(std::memory_order_relaxed))
 {
 }
 
-void FormulaImpl::SetData(std::string&& expression) {
-	try {
-		formula_ = ParseFormula(std::move(expression));
-		InvalidateCache();
-	}
-	catch (const std::exception& exc) {
-		std::throw_with_nested(FormulaException(exc.what()));
-	}
+FormulaImpl& FormulaImpl::operator=(FormulaImpl&& other) noexcept {
+	formula_ = std::move(other.formula_);
+	anchor_ = other.anchor_;
+	cache_.store(other.cache_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	return *this;
 }
 
-void FormulaImpl::SetDependence(Position ref_pos) {
-	dependent_.push_back(ref_pos);
+FormulaImpl::ImpValue FormulaImpl::GetValue(const Sheet& sheet) const {
+	const FormulaInterface::Value value = GetNumber(sheet);
+	if (std::holds_alternative<double>(value)) {
+		return std::get<double>(value);
+	}
+	return std::get<FormulaError>(value);
 }
 
-FormulaImpl::ImpValue FormulaImpl::GetValue(const SheetInterface& link) const {
-	if (cache_.has_value()) {
-		return cache_.value();
-	}
-	auto res = formula_->Evaluate(link);
-	if (std::holds_alternative<double>(res)) {
-		cache_ = std::get<double>(res);
-		return cache_.value();
-	}
-	else {
-		return std::get<FormulaError>(res);
+std::optional<FormulaInterface::Value> FormulaImpl::GetCachedValue() const {
+	const uint64_t bits = cache_.load(std::memory_order_acquire);
+	if (bits == EMPTY_CACHE) {
+		return std::nullopt;
 	}
+	return Decode(bits);
 }
 
-std::string FormulaImpl::GetText() const {
-	return FORMULA_SIGN + formula_->GetExpression();
+void FormulaImpl::SetCachedValue(const FormulaInterface::Value& value) {
+	cache_.store(Encode(value), std::memory_order_release);
 }
 
-std::vector<Position> FormulaImpl::GetReferencedCells() const {
-	return formula_.get()->GetReferencedCells();
+uint64_t FormulaImpl::Encode(const FormulaInterface::Value& value) {
+	if (const double* number = std::get_if<double>(&value); number && std::isfinite(*number)) {
+		uint64_t bits;
+		std::memcpy(&bits, number, sizeof(bits));
+		return bits;
+	}
+	// бесконечность или NaN сюда попадают только из испорченных данных
+	const FormulaError::Category category = std::holds_alternative<FormulaError>(value)
+		? std::get<FormulaError>(value).GetCategory()
+		: FormulaError::Category::Arithmetic;
+	return ERROR_CACHE + static_cast<uint64_t>(category);
 }
 
-std::vector<Position> FormulaImpl::GetDependentCells() const {
-	return dependent_;
+// ошибка кэшируется так же, как число: она сбрасывается вместе с кэшем при изменении ссылок;
+// два потока могут вычислить одну формулу одновременно, но запишут одно и то же
+uint64_t FormulaImpl::Compute(const Sheet& sheet) const {
+	const uint64_t bits = Encode(formula_->Evaluate(EvaluationContext{ sheet }, anchor_));
+	cache_.store(bits, std::memory_order_release);
+	return bits;
 }
 
-void FormulaImpl::DeleteDependence(Position pos) {
-	dependent_.erase(std::find(dependent_.begin(), dependent_.end(), pos));
+std::string FormulaImpl::GetText() const {
+	return FORMULA_SIGN + formula_->GetExpression(anchor_);
+}
+
+std::vector<Position> FormulaImpl::GetReferencedCells() const {
+	return formula_->GetReferencedCells(anchor_);
 }
 
 void FormulaImpl::InvalidateCache() {
-	if (cache_.has_value()) {
-		cache_.reset();
-	}
+	cache_.store(EMPTY_CACHE, std::memory_order_relaxed);
 }
 
 bool FormulaImpl::HasEmptyCache() const {
-	return !cache_.has_value();
+	return cache_.load(std::memory_order_acquire) == EMPTY_CACHE;
 }
@@ -2,121 +2,184 @@
 
 #include "common.h"
 #include "formula.h"
+#include "formula_pool.h"
 
-#include <functional>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <optional>
-#include <unordered_set>
+#include <string_view>
+#include <variant>
 
-class Impl {
-public:
-	using ImpValue = std::variant<std::string, double, FormulaError>;
-
-	virtual ~Impl() = default;
-	virtual void SetData(std::string&&) = 0;
-	virtual void SetDependence(Position ref_pos) = 0;
-	virtual ImpValue GetValue(const SheetInterface& link) const = 0;
-	virtual std::string GetText() const = 0;
-	virtual std::vector<Position> GetReferencedCells() const = 0;
-	virtual std::vector<Position> GetDependentCells() const = 0;
-	virtual void DeleteDependence(Position pos) = 0;
-	virtual void InvalidateCache() = 0;
-	virtual bool HasEmptyCache() const = 0;
-};
+class Sheet;
 
-class Cell : public CellInterface {
+// Impl classes are plain value types kept inline in Cell::impl_ (no virtual dispatch, no
+// separate allocation). They share the same set of methods so Cell can std::visit them.
+class EmptyImpl {
 public:
-	Cell(Sheet* sheet);
-	Cell(Cell&&);
-	Cell& operator=(Cell&&);
-
-	Cell(const Cell&) = delete;
-	Cell& operator=(const Cell&) = delete;
-
-	~Cell() = default;
-
-	void Set(std::string text);
-	void SetDependences(Position ref_pos);
-	void Clear();
-
-	Value GetValue() const override;
-	std::string GetText() const override;
-
-	std::vector<Position> GetReferencedCells() const override;
-	std::vector<Position> GetDependentCells() const;
-	bool IsReferenced() const;
-	void DeleteDependence(Position pos);
-	void InvalidateCache(Position pos);
+	using ImpValue = CellInterface::Value;
+
+	ImpValue GetValue(const Sheet& sheet) const;
+	FormulaInterface::Value GetNumber(const Sheet&) const {
+		return 0.0;
+	}
+	std::string GetText() const;
+	std::vector<Position> GetReferencedCells() const;
+	void InvalidateCache();
 	bool HasEmptyCache() const;
-
-private:
-	std::unique_ptr<Impl> impl_;
-	Sheet* owner_sheet_;
 };
 
-class EmptyImpl : public Impl {
+class TextImpl {
 public:
-	EmptyImpl() = default;
-
-	void SetData(std::string&&) override;
-	void SetDependence(Position ref_pos);
-
-	ImpValue GetValue(const SheetInterface& link) const override;
-	std::string GetText() const override;
-	std::vector<Position> GetReferencedCells() const override;
-	std::vector<Position> GetDependentCells() const override;
-	void DeleteDependence(Position pos);
+	using ImpValue = CellInterface::Value;
+
+	explicit TextImpl(std::string text);
+
+	// Text that is a number in full (std::from_chars syntax, finite) reads as that number,
+	// empty text reads as zero, any other text is #VALUE!.
+	static FormulaInterface::Value ToNumber(std::string_view value);
+
+	ImpValue GetValue(const Sheet& sheet) const;
+	// classified once in the constructor, so reading it is a plain load
+	FormulaInterface::Value GetNumber(const Sheet&) const {
+		if (std::isfinite(number_)) {
+			return number_;
+		}
+		return FormulaError{ std::isnan(number_) ? FormulaError::Category::Value : FormulaError::Category::Arithmetic };
+	}
+	std::string GetText() const;
+	std::vector<Position> GetReferencedCells() const;
 	void InvalidateCache();
 	bool HasEmptyCache() const;
 
 private:
-	std::string empty_ = "";
-	mutable std::optional<double> cache_;
-	std::vector<Position> dependent_; // if few cells have reference to this cell
+	std::string text_;
+	// numbers are finite, so the other values name the error: NaN for #VALUE!,
+	// infinity for a number out of range (#ARITHM!); keeps the impl to one double
+	double number_;
 };
 
-class TextImpl : public Impl {
+class FormulaImpl {
 public:
-	TextImpl() = default;
-	void SetData(std::string&& text) override;
-	void SetDependence(Position ref_pos);
-
-	std::string GetText() const override;
-	ImpValue GetValue(const SheetInterface& link) const override;
-	std::vector<Position> GetReferencedCells() const override;
-	std::vector<Position> GetDependentCells() const override;
-	void DeleteDependence(Position pos);
+	using ImpValue = CellInterface::Value;
+
+	// anchor is the position of the cell, the shared formula is relative to it
+	FormulaImpl(std::shared_ptr<const SharedFormula> formula, Position anchor);
+	FormulaImpl(FormulaImpl&& other) noexcept;
+	FormulaImpl& operator=(FormulaImpl&& other) noexcept;
+
+	ImpValue GetValue(const Sheet& sheet) const;
+	// a cached value is returned without leaving the header
+	FormulaInterface::Value GetNumber(const Sheet& sheet) const {
+		uint64_t bits = cache_.load(std::memory_order_acquire);
+		if (bits == EMPTY_CACHE) {
+			bits = Compute(sheet);
+		}
+		return Decode(bits);
+	}
+	std::string GetText() const;
+	std::vector<Position> GetReferencedCells() const;
+	// see SharedFormula::GetSingleReferences
+	std::vector<Position> GetSingleReferences() const {
+		return formula_->GetSingleReferences(anchor_);
+	}
+	std::vector<RangeReference> GetRangeReferences() const {
+		return formula_->GetRangeReferences(anchor_);
+	}
 	void InvalidateCache();
 	bool HasEmptyCache() const;
 
+	const SharedFormula& GetFormula() const {
+		return *formula_;
+	}
+	// the computed value, if there is one
+	std::optional<FormulaInterface::Value> GetCachedValue() const;
+	void SetCachedValue(const FormulaInterface::Value& value);
+
 private:
-	std::string text_;
-	mutable std::optional<double> cache_;
-	std::vector<Position> dependent_; // if few cells have reference to this cell
+	// The cache is one word, so readers on other threads see either the old value or the
+	// new one in full. Computed numbers are finite, which leaves the NaN payloads free to
+	// mark an empty cache and the error categories.
+	static constexpr uint64_t EMPTY_CACHE = 0x7ff8'0000'0000'0001;
+	static constexpr uint64_t ERROR_CACHE = 0x7ff8'0000'0000'0100;  // + category
+
+	static uint64_t Encode(const FormulaInterface::Value& value);
+	static FormulaInterface::Value Decode(uint64_t bits) {
+		if ((bits & ~uint64_t{ 0xff }) == ERROR_CACHE) {
+			return FormulaError{ static_cast<FormulaError::Category>(bits & 0xff) };
+		}
+		double number;
+		std::memcpy(&number, &bits, sizeof(number));
+		return number;
+	}
+
+	// returns the encoded value it stored
+	uint64_t Compute(const Sheet& sheet) const;
+
+	std::shared_ptr<const SharedFormula> formula_;
+	Position anchor_;
+	mutable std::atomic<uint64_t> cache_{ EMPTY_CACHE };
 };
 
-class FormulaImpl : public Impl {
+// Cells live inline in the sheet's tile slots, so a populated cell costs no allocation
+// of its own beyond what its text or formula needs.
+class Cell : public CellInterface {
 public:
-	FormulaImpl() = default;
+	explicit Cell(Sheet* sheet);
+	Cell(Cell&&) = default;
+	Cell& operator=(Cell&&) = default;
 
-	FormulaImpl(const FormulaImpl&) = delete;
-	FormulaImpl& operator=(const FormulaImpl& rhs) = delete;
+	Cell(const Cell&) = delete;
+	Cell& operator=(const Cell&) = delete;
 
-	FormulaImpl(FormulaImpl&&);
-	FormulaImpl& operator=(FormulaImpl&& rhs);
+	~Cell() = default;
 
-	void SetData(std::string&& expression) override;
-	void SetDependence(Position ref_pos);
-	ImpValue GetValue(const SheetInterface& link) const override;
+	// pos is where the cell is in the sheet; formulas are stored relative to it
+	void Set(std::string text, Position pos);
+	// sets a formula that is already compiled
+	void SetFormula(std::shared_ptr<const SharedFormula> formula, Position pos);
+	// sets text the caller knows is neither empty nor a formula
+	void SetText(std::string_view text);
+	void Clear();
+
+	Value GetValue() const override;
 	std::string GetText() const override;
+	// Value of the cell as a formula operand: a number, or the error of the cell,
+	// or #VALUE! for text that is not a number.
+	FormulaInterface::Value GetNumber() const {
+		return std::visit([this](const auto& impl) { return impl.GetNumber(*owner_sheet_); }, impl_);
+	}
+	// Value of the cell inside a range given to a function: nothing for an empty cell and
+	// for text that is not a number, which functions skip; the error of a formula counts.
+	std::optional<FormulaInterface::Value> GetRangeOperand() const {
+		if (std::holds_alternative<EmptyImpl>(impl_)) {
+			return std::nullopt;
+		}
+		FormulaInterface::Value value = GetNumber();
+		if (std::holds_alternative<TextImpl>(impl_) && std::holds_alternative<FormulaError>(value)) {
+			return std::nullopt;
+		}
+		return value;
+	}
+
 	std::vector<Position> GetReferencedCells() const override;
-	std::vector<Position> GetDependentCells() const override;
-	void DeleteDependence(Position pos);
-	void InvalidateCache();
+	void InvalidateCache(Position pos);
 	bool HasEmptyCache() const;
+	// formula whose value has not been computed yet
+	bool NeedsEvaluation() const {
+		const auto* formula = std::get_if<FormulaImpl>(&impl_);
+		return formula && formula->HasEmptyCache();
+	}
+	// nullptr unless the cell holds a formula
+	const FormulaImpl* GetFormulaImpl() const {
+		return std::get_if<FormulaImpl>(&impl_);
+	}
+	FormulaImpl* GetFormulaImpl() {
+		return std::get_if<FormulaImpl>(&impl_);
+	}
 
 private:
-	std::unique_ptr<FormulaInterface> formula_;
-	mutable std::optional<double> cache_;
-	std::vector<Position> dependent_; // if few cells have reference to this cell
+	std::variant<EmptyImpl, TextImpl, FormulaImpl> impl_;
+	Sheet* owner_sheet_;
 };
-
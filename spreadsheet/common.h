@@ -1,5 +1,8 @@
 #pragma once
 
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
 #include <iosfwd>
 #include <memory>
 #include <stdexcept>
@@ -13,20 +16,86 @@ struct Position {
 	int row = 0;
 	int col = 0;
 
-	bool operator==(Position rhs) const;
-	bool operator<(Position rhs) const;
+	constexpr bool operator==(Position rhs) const {
+		return row == rhs.row && col == rhs.col;
+	}
+	//  :  ,  
+	constexpr bool operator<(Position rhs) const {
+		return row != rhs.row ? row < rhs.row : col < rhs.col;
+	}
 
 	bool IsValid() const;
 	std::string ToString() const;
-
-	static Position FromString(std::string_view str);
+	//  A1-   [first, last)   ,  std::to_chars:
+	//   ;     first  invalid_argument, 
+	//     last  value_too_large.  MAX_STRING_LENGTH .
+	std::to_chars_result ToChars(char* first, char* last) const;
+
+	//   :   ,     ( 
+	//  ),         .
+	constexpr uint32_t ToKey() const {
+		return static_cast<uint32_t>(row) << KEY_COL_BITS | static_cast<uint32_t>(col);
+	}
+	static constexpr Position FromKey(uint32_t key) {
+		return { static_cast<int>(key >> KEY_COL_BITS), static_cast<int>(key & ((1u << KEY_COL_BITS) - 1)) };
+	}
+
+	//  A1-;        , 
+	//   (NONE).     .
+	static constexpr Position FromString(std::string_view str);
 
 	static const int MAX_ROWS = 16384;
 	static const int MAX_COLS = 16384;
+	static const int KEY_COL_BITS = 14;
+	static const size_t MAX_STRING_LENGTH = 8;  // "XFD16384"
 	static const Position NONE;
 };
+
+constexpr Position Position::FromString(std::string_view str) {
+	// NONE   :     
+	constexpr Position invalid{ -1, -1 };
+	if (str.empty() || str.size() > MAX_STRING_LENGTH) {
+		return invalid;
+	}
+	//       ,    
+	size_t i = 0;
+	int col = 0;  //       26: A = 1, Z = 26, AA = 27
+	for (; i < str.size() && str[i] >= 'A' && str[i] <= 'Z'; ++i) {
+		col = col * 26 + (str[i] - 'A' + 1);
+		if (col > MAX_COLS) {
+			return invalid;
+		}
+	}
+	if (i == 0 || i == str.size()) {
+		return invalid;
+	}
+	int row = 0;
+	for (; i < str.size(); ++i) {
+		if (str[i] < '0' || str[i] > '9') {
+			return invalid;
+		}
+		row = row * 10 + (str[i] - '0');
+		if (row > MAX_ROWS) {
+			return invalid;
+		}
+	}
+	if (row == 0) {
+		return invalid;
+	}
+	return { row - 1, col - 1 };
+}
+static_assert(Position::MAX_COLS == 1 << Position::KEY_COL_BITS, "a column fills its key bits");
+static_assert(static_cast<uint64_t>(Position::MAX_ROWS) << Position::KEY_COL_BITS <= uint64_t{ 1 } << 32, "a key fits in 32 bits");
+
+//    ,       :  
+//    64-    ( splitmix64).
 struct PositionHash {
-	size_t operator()(Position pos) const;
+	size_t operator()(Position pos) const {
+		uint64_t x = static_cast<uint64_t>(static_cast<uint32_t>(pos.row)) << 32 | static_cast<uint32_t>(pos.col);
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+		return static_cast<size_t>(x ^ (x >> 31));
+	}
 };
 
 struct Size {
@@ -0,0 +1,372 @@
+#include "dependency_graph.h"
+
+#include <algorithm>
+#include <cassert>
+
+bool DependencyGraph::AddEdge(Position from, Position to) {
+	// оба узла создаются до взятия ссылок: nodes_ может переаллоцироваться
+	const uint32_t from_index = GetDependentIndex(from);
+	const uint32_t to_index = GetNodeIndex(to, false);
+	if (from_index == to_index || (nodes_[to_index].order > nodes_[from_index].order && !Reorder(from_index, to_index))) {
+		ReleaseIfUnused(to_index);
+		if (from_index != to_index) {
+			ReleaseIfUnused(from_index);
+		}
+		return false;
+	}
+	Node& from_node = nodes_[from_index];
+	Node& to_node = nodes_[to_index];
+	from_node.out.push_back({ to_index, static_cast<uint32_t>(to_node.in.size()) });
+	to_node.in.push_back({ from_index, static_cast<uint32_t>(from_node.out.size() - 1) });
+	++edge_count_;
+	return true;
+}
+
+bool DependencyGraph::AddRange(Position from, Position top_left, Size size) {
+	const uint32_t from_index = GetDependentIndex(from);
+	bool cycle = from.row >= top_left.row && from.row < top_left.row + size.rows
+		&& from.col >= top_left.col && from.col < top_left.col + size.cols;
+	// диапазон — это рёбра ко всем узлам внутри него, и каждый должен стоять раньше from;
+	// последний в порядке узел проверять не нужно
+	if (!cycle && nodes_[from_index].order != highest_order_) {
+		index_.ForEachInRect(top_left, size, [this, from_index, &cycle](Position, uint32_t index) {
+			if (!cycle && nodes_[index].order > nodes_[from_index].order) {
+				cycle = !Reorder(from_index, index);
+			}
+		});
+	}
+	if (cycle) {
+		ReleaseIfUnused(from_index);
+		return false;
+	}
+	AddRangeUnchecked(from, top_left, size);
+	return true;
+}
+
+void DependencyGraph::RemoveOutEdges(Position from) {
+	const uint32_t* found = index_.Find(from);
+	if (!found) {
+		return;
+	}
+	const uint32_t from_index = *found;
+	// снимаем рёбра с конца, поэтому индексы оставшихся исходящих рёбер не меняются
+	for (uint32_t range : nodes_[from_index].ranges) {
+		range_index_.Erase(range, ranges_[range].top_left, ranges_[range].size);
+		free_ranges_.push_back(range);
+	}
+	nodes_[from_index].ranges.clear();
+	while (!nodes_[from_index].out.empty()) {
+		const Edge edge = nodes_[from_index].out.back();
+		nodes_[from_index].out.pop_back();
+
+		auto& in = nodes_[edge.node].in;
+		const Edge moved = in.back();
+		in[edge.twin] = moved;
+		in.pop_back();
+		if (edge.twin < in.size()) {
+			nodes_[moved.node].out[moved.twin].twin = edge.twin;
+		}
+		--edge_count_;
+		if (edge.node != from_index) {
+			ReleaseIfUnused(edge.node);
+		}
+	}
+	ReleaseIfUnused(from_index);
+}
+
+void DependencyGraph::AddEdgeUnchecked(Position from, Position to) {
+	const uint32_t from_index = GetNodeIndex(from, true);
+	const uint32_t to_index = GetNodeIndex(to, false);
+	Node& from_node = nodes_[from_index];
+	Node& to_node = nodes_[to_index];
+	from_node.out.push_back({ to_index, static_cast<uint32_t>(to_node.in.size()) });
+	to_node.in.push_back({ from_index, static_cast<uint32_t>(from_node.out.size() - 1) });
+	++edge_count_;
+}
+
+void DependencyGraph::AddRangeUnchecked(Position from, Position top_left, Size size) {
+	const uint32_t from_index = GetNodeIndex(from, true);
+	uint32_t range;
+	if (!free_ranges_.empty()) {
+		range = free_ranges_.back();
+		free_ranges_.pop_back();
+	}
+	else {
+		range = static_cast<uint32_t>(ranges_.size());
+		ranges_.emplace_back();
+	}
+	ranges_[range] = { top_left, size, from_index };
+	nodes_[from_index].ranges.push_back(range);
+	range_index_.Insert(range, top_left, size);
+}
+
+bool DependencyGraph::RebuildOrder() {
+	// узел получает номер, когда пронумерованы все, от кого он зависит; диапазоны здесь
+	// учитываются, так что проход находит и циклы через них.
+	// Свободные узлы пропускаются: у них нет ни позиции, ни связей
+	pending_precedents_.assign(nodes_.size(), 0);
+	for (uint32_t index = 0; index < nodes_.size(); ++index) {
+		if (!nodes_[index].IsFree()) {
+			ForEachDependentNode(nodes_[index].GetPos(), &nodes_[index], [this](uint32_t dependent) {
+				++pending_precedents_[dependent];
+			});
+		}
+	}
+	worklist_.clear();
+	for (uint32_t index = 0; index < nodes_.size(); ++index) {
+		if (!nodes_[index].IsFree() && pending_precedents_[index] == 0) {
+			worklist_.push_back(index);
+		}
+	}
+	int64_t next_order = 0;
+	while (!worklist_.empty()) {
+		const uint32_t current = worklist_.back();
+		worklist_.pop_back();
+		nodes_[current].order = next_order++;
+		ForEachDependentNode(nodes_[current].GetPos(), &nodes_[current], [this](uint32_t dependent) {
+			if (--pending_precedents_[dependent] == 0) {
+				worklist_.push_back(dependent);
+			}
+		});
+	}
+	lowest_order_ = 0;
+	highest_order_ = next_order - 1;
+	// на цикле счётчики не обнуляются, и часть узлов остаётся без номера
+	return next_order == static_cast<int64_t>(nodes_.size() - free_nodes_.size());
+}
+
+bool DependencyGraph::HasDependents(Position pos) const {
+	bool found = false;
+	ForEachDependentNode(pos, FindNode(pos), [&found](uint32_t) {
+		found = true;
+	});
+	return found;
+}
+
+size_t DependencyGraph::GetEdgeCount() const {
+	return edge_count_;
+}
+
+size_t DependencyGraph::GetRangeCount() const {
+	return range_index_.GetSize();
+}
+
+DependencyGraph::Node* DependencyGraph::FindNode(Position pos) {
+	const uint32_t* index = index_.Find(pos);
+	return index ? &nodes_[*index] : nullptr;
+}
+
+const DependencyGraph::Node* DependencyGraph::FindNode(Position pos) const {
+	const uint32_t* index = index_.Find(pos);
+	return index ? &nodes_[*index] : nullptr;
+}
+
+uint32_t DependencyGraph::GetNodeIndex(Position pos, bool as_dependent) {
+	if (const uint32_t* index = index_.Find(pos)) {
+		return *index;
+	}
+	uint32_t index;
+	if (!free_nodes_.empty()) {
+		index = free_nodes_.back();
+		free_nodes_.pop_back();
+	}
+	else {
+		index = static_cast<uint32_t>(nodes_.size());
+		nodes_.emplace_back();
+	}
+	nodes_[index].key = pos.ToKey();
+	nodes_[index].order = as_dependent ? ++highest_order_ : --lowest_order_;
+	index_.Emplace(pos, index);
+	return index;
+}
+
+uint32_t DependencyGraph::GetDependentIndex(Position pos) {
+	if (const uint32_t* index = index_.Find(pos)) {
+		return *index;
+	}
+	const uint32_t index = GetNodeIndex(pos, true);
+	// новый узел встал последним, а формулы диапазонов, в которые он попал, должны идти после
+	// него; предшественников у него нет, так что цикла здесь быть не может
+	range_owners_.clear();
+	range_index_.ForEachContaining(pos, [this](uint32_t range) {
+		range_owners_.push_back(ranges_[range].owner);
+	});
+	for (uint32_t owner : range_owners_) {
+		if (nodes_[index].order > nodes_[owner].order) {
+			[[maybe_unused]] const bool reordered = Reorder(owner, index);
+			assert(reordered);
+		}
+	}
+	return index;
+}
+
+void DependencyGraph::ReleaseIfUnused(uint32_t index) {
+	Node& node = nodes_[index];
+	if (node.out.empty() && node.in.empty() && node.ranges.empty()) {
+		index_.Erase(node.GetPos());
+		// освобождаем кучу узла, если рёбер было больше, чем помещается внутри
+		node = Node{};
+		free_nodes_.push_back(index);
+	}
+}
+
+bool DependencyGraph::Reorder(uint32_t from, uint32_t to) {
+	const int64_t lower = nodes_[from].order;
+	const int64_t upper = nodes_[to].order;
+	const uint32_t epoch = NextEpoch();
+
+	// зависимые от from, которые сейчас стоят не позже to; формула диапазона зависит от
+	// каждого узла внутри него
+	affected_dependents_.clear();
+	worklist_.clear();
+	worklist_.push_back(from);
+	nodes_[from].mark = epoch;
+	bool cycle = false;
+	while (!worklist_.empty() && !cycle) {
+		const uint32_t current = worklist_.back();
+		worklist_.pop_back();
+		affected_dependents_.push_back(current);
+		ForEachDependentNode(nodes_[current].GetPos(), &nodes_[current], [this, to, upper, epoch, &cycle](uint32_t index) {
+			Node& node = nodes_[index];
+			if (index == to) {
+				cycle = true;
+			}
+			else if (node.mark != epoch && node.order <= upper) {
+				node.mark = epoch;
+				worklist_.push_back(index);
+			}
+		});
+	}
+	if (cycle) {
+		return false;
+	}
+
+	// то, от чего зависит to, и что сейчас стоит не раньше from
+	affected_precedents_.clear();
+	worklist_.push_back(to);
+	nodes_[to].mark = epoch;
+	while (!worklist_.empty()) {
+		const uint32_t current = worklist_.back();
+		worklist_.pop_back();
+		affected_precedents_.push_back(current);
+		const auto visit = [this, lower, epoch](uint32_t index) {
+			Node& node = nodes_[index];
+			if (node.mark != epoch && node.order >= lower) {
+				node.mark = epoch;
+				worklist_.push_back(index);
+			}
+		};
+		for (const Edge& edge : nodes_[current].out) {
+			visit(edge.node);
+		}
+		for (uint32_t range : nodes_[current].ranges) {
+			index_.ForEachInRect(ranges_[range].top_left, ranges_[range].size, [&visit](Position, uint32_t index) {
+				visit(index);
+			});
+		}
+	}
+
+	// те же номера раздаются заново: сначала предшественники, затем зависимые
+	SortByOrder(affected_dependents_);
+	SortByOrder(affected_precedents_);
+	free_orders_.clear();
+	for (uint32_t node : affected_precedents_) {
+		free_orders_.push_back(nodes_[node].order);
+	}
+	for (uint32_t node : affected_dependents_) {
+		free_orders_.push_back(nodes_[node].order);
+	}
+	std::sort(free_orders_.begin(), free_orders_.end());
+	size_t next = 0;
+	for (uint32_t node : affected_precedents_) {
+		nodes_[node].order = free_orders_[next++];
+	}
+	for (uint32_t node : affected_dependents_) {
+		nodes_[node].order = free_orders_[next++];
+	}
+	return true;
+}
+
+std::vector<std::vector<Position>> DependencyGraph::Levelize(const std::vector<Position>& cells) {
+	if (cells.empty()) {
+		return {};
+	}
+	std::vector<std::vector<Position>> levels(1);
+	const uint32_t epoch = NextEpoch();
+	std::vector<uint32_t> members;
+	for (Position pos : cells) {
+		if (const uint32_t* index = index_.Find(pos)) {
+			nodes_[*index].mark = epoch;
+			members.push_back(*index);
+		}
+		else {
+			// ячейки без связей; от них ещё могут зависеть формулы с диапазонами
+			levels[0].push_back(pos);
+		}
+	}
+	const size_t unlinked = levels[0].size();
+
+	// Kahn по волнам: узел попадает в следующую волну, когда обработаны все его
+	// предшественники из cells, так что номер волны и есть его уровень
+	pending_precedents_.resize(nodes_.size());
+	for (uint32_t index : members) {
+		pending_precedents_[index] = 0;
+	}
+	const auto count = [this, epoch](uint32_t dependent) {
+		if (nodes_[dependent].mark == epoch) {
+			++pending_precedents_[dependent];
+		}
+	};
+	for (size_t i = 0; i < unlinked; ++i) {
+		ForEachDependentNode(levels[0][i], nullptr, count);
+	}
+	for (uint32_t index : members) {
+		ForEachDependentNode(nodes_[index].GetPos(), &nodes_[index], count);
+	}
+	std::vector<uint32_t> wave;
+	for (uint32_t index : members) {
+		if (pending_precedents_[index] == 0) {
+			wave.push_back(index);
+		}
+	}
+	std::vector<uint32_t> next_wave;
+	const auto release = [this, epoch, &next_wave](uint32_t dependent) {
+		if (nodes_[dependent].mark == epoch && --pending_precedents_[dependent] == 0) {
+			next_wave.push_back(dependent);
+		}
+	};
+	for (size_t level = 0; level == 0 || !wave.empty(); ++level) {
+		if (level == levels.size()) {
+			levels.emplace_back();
+		}
+		next_wave.clear();
+		if (level == 0) {
+			for (size_t i = 0; i < unlinked; ++i) {
+				ForEachDependentNode(levels[0][i], nullptr, release);
+			}
+		}
+		for (uint32_t index : wave) {
+			levels[level].push_back(nodes_[index].GetPos());
+			ForEachDependentNode(nodes_[index].GetPos(), &nodes_[index], release);
+		}
+		wave.swap(next_wave);
+	}
+	return levels;
+}
+
+void DependencyGraph::SortByOrder(std::vector<uint32_t>& nodes) const {
+	std::sort(nodes.begin(), nodes.end(), [this](uint32_t lhs, uint32_t rhs) {
+		return nodes_[lhs].order < nodes_[rhs].order;
+	});
+}
+
+uint32_t DependencyGraph::NextEpoch() {
+	if (++epoch_ == 0) {
+		// счётчик переполнился: старые метки могут совпасть с новыми
+		for (Node& node : nodes_) {
+			node.mark = 0;
+		}
+		epoch_ = 1;
+	}
+	return epoch_;
+}
@@ -0,0 +1,213 @@
+#pragma once
+
+#include "common.h"
+#include "range_index.h"
+#include "small_vector.h"
+#include "tiled_grid.h"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Dependencies between cells, owned by the sheet.
+// An edge from -> to means that the formula in `from` references `to`. Every edge is stored
+// twice: in the precedent list of `from` and in the dependent list of `to`, and each copy
+// remembers the index of its twin, so removing an edge is a swap-and-pop on both sides.
+// Lists keep up to four edges inline, which covers the usual fan-out without allocating.
+// Nodes are packed in one vector; the tiled grid only maps a position to its node index.
+//
+// The graph also maintains a topological order (precedents before dependents) with the
+// Pearce-Kelly dynamic algorithm: an edge that agrees with the current order is added in O(1),
+// otherwise only the nodes whose order lies between the two ends are searched and renumbered,
+// and that same search detects cycles.
+//
+// A range reference is not split into edges: the formula depends on every cell of the
+// rectangle, but the rectangle is stored once, in a RangeIndex that finds the ranges
+// containing a cell in O(log MAX_COLS * log MAX_ROWS + k). The cells of a range get neither edges nor nodes, so
+// an edit inside a large referenced range costs the same as anywhere else. The order
+// counts a range as edges from its formula to the nodes inside it, so the same search finds
+// cycles through ranges. The nodes inside a rectangle are not indexed by order, though:
+// wherever the search meets a range, it visits every node of the rectangle (see AddRange).
+class DependencyGraph {
+public:
+	// Returns false and leaves the graph unchanged if the edge would close a cycle.
+	bool AddEdge(Position from, Position to);
+	// The formula in `from` depends on every cell of the rectangle. Returns false and leaves
+	// the graph unchanged if that would close a cycle.
+	// Costs O(nodes inside the rectangle) unless `from` is last in the order, which a new
+	// formula usually is; empty tiles of the rectangle are skipped whole. The search of
+	// AddEdge pays the same for every range whose formula it reaches from below.
+	bool AddRange(Position from, Position top_left, Size size);
+	// removes every edge and range leaving `from`
+	void RemoveOutEdges(Position from);
+
+	// Bulk edits: edges are added without keeping the order or looking for cycles, then
+	// RebuildOrder() orders the whole graph once (Kahn's algorithm). It returns false if
+	// the graph has a cycle; AddEdge must not be used until the offending edges are
+	// removed and RebuildOrder() succeeds.
+	void AddEdgeUnchecked(Position from, Position to);
+	void AddRangeUnchecked(Position from, Position top_left, Size size);
+	bool RebuildOrder();
+
+	// Splits cells into dependency levels: a cell is one level above the highest of its
+	// precedents among cells, level 0 if it has none there. Cells of one level never depend
+	// on each other, and each level depends only on lower ones. Returns the cells grouped
+	// by level, lowest first; cells must not repeat.
+	std::vector<std::vector<Position>> Levelize(const std::vector<Position>& cells);
+
+	bool HasDependents(Position pos) const;
+	size_t GetEdgeCount() const;
+	size_t GetRangeCount() const;
+
+	// func(Position) for every cell whose formula references pos, alone or in a range;
+	// a formula referencing pos several times is reported as many times
+	template <typename Func>
+	void ForEachDependent(Position pos, Func&& func) const {
+		ForEachDependentNode(pos, FindNode(pos), [this, &func](uint32_t index) {
+			func(nodes_[index].GetPos());
+		});
+	}
+
+	// func(Position) for every cell referenced by the formula in pos on its own;
+	// the ranges it references are listed by ForEachRange
+	template <typename Func>
+	void ForEachPrecedent(Position pos, Func&& func) const {
+		if (const Node* node = FindNode(pos)) {
+			for (const Edge& edge : node->out) {
+				func(nodes_[edge.node].GetPos());
+			}
+		}
+	}
+
+	// func(Position top_left, Size size) for every range referenced by the formula in pos
+	template <typename Func>
+	void ForEachRange(Position pos, Func&& func) const {
+		if (const Node* node = FindNode(pos)) {
+			for (uint32_t range : node->ranges) {
+				func(ranges_[range].top_left, ranges_[range].size);
+			}
+		}
+	}
+
+	// func(Position) once for every cell that depends on pos directly or transitively.
+	// Iterative worklist pass; nodes are marked with the pass number instead of being put into
+	// a visited set, so deep chains need neither recursion nor per-call allocations.
+	template <typename Func>
+	void ForEachTransitiveDependent(Position pos, Func&& func) {
+		const Position seeds[] = { pos };
+		ForEachTransitiveDependent(seeds, std::forward<Func>(func));
+	}
+
+	// the same for several starting cells in one pass; the starting cells themselves are skipped
+	template <typename Positions, typename Func>
+	void ForEachTransitiveDependent(const Positions& seeds, Func&& func) {
+		const uint32_t epoch = NextEpoch();
+		worklist_.clear();
+		for (Position pos : seeds) {
+			if (const uint32_t* start = index_.Find(pos)) {
+				nodes_[*start].mark = epoch;
+				worklist_.push_back(*start);
+			}
+		}
+		const auto visit = [this, epoch, &func](uint32_t index) {
+			Node& dependent = nodes_[index];
+			if (dependent.mark != epoch) {
+				dependent.mark = epoch;
+				worklist_.push_back(index);
+				func(dependent.GetPos());
+			}
+		};
+		// у ячейки без узла зависимые могут быть только через диапазоны
+		if (!range_index_.Empty()) {
+			for (Position pos : seeds) {
+				if (!index_.Contains(pos)) {
+					ForEachDependentNode(pos, nullptr, visit);
+				}
+			}
+		}
+		while (!worklist_.empty()) {
+			const uint32_t current = worklist_.back();
+			worklist_.pop_back();
+			ForEachDependentNode(nodes_[current].GetPos(), &nodes_[current], visit);
+		}
+	}
+
+private:
+	static constexpr size_t INLINE_EDGES = 4;
+
+	struct Edge {
+		uint32_t node;  // the other end
+		uint32_t twin;  // index of the same edge in the other end's list
+	};
+
+	struct Node {
+		Position GetPos() const {
+			return Position::FromKey(key);
+		}
+
+		// free nodes hold FREE_KEY, which decodes to no valid position
+		static constexpr uint32_t FREE_KEY = UINT32_MAX;
+
+		bool IsFree() const {
+			return key == FREE_KEY;
+		}
+
+		uint32_t key = FREE_KEY;  // Position::ToKey() of the cell
+		uint32_t mark = 0;
+		int64_t order = 0;  // precedents have smaller order than their dependents
+		SmallVector<Edge, INLINE_EDGES> out;  // precedents
+		SmallVector<Edge, INLINE_EDGES> in;   // dependents
+		SmallVector<uint32_t, 1> ranges;      // referenced ranges, indices into ranges_
+	};
+
+	struct Range {
+		Position top_left;
+		Size size;
+		uint32_t owner;  // node of the formula referencing it
+	};
+
+	// func(uint32_t) for the node of every formula referencing pos, through an edge or a
+	// range; node is the node of pos, if it has one
+	template <typename Func>
+	void ForEachDependentNode(Position pos, const Node* node, Func&& func) const {
+		if (node) {
+			for (const Edge& edge : node->in) {
+				func(edge.node);
+			}
+		}
+		range_index_.ForEachContaining(pos, [this, &func](uint32_t range) {
+			func(ranges_[range].owner);
+		});
+	}
+
+	Node* FindNode(Position pos);
+	const Node* FindNode(Position pos) const;
+	// new nodes are ordered after every existing one if they are about to get a precedent
+	// and before every existing one otherwise; either way the order stays valid
+	uint32_t GetNodeIndex(Position pos, bool as_dependent);
+	// the node for a cell about to get precedents while the order is kept: a new one is
+	// ordered after every existing node, then before the formulas of ranges containing it
+	uint32_t GetDependentIndex(Position pos);
+	void ReleaseIfUnused(uint32_t index);
+	uint32_t NextEpoch();
+	// makes room for the edge from -> to when order[to] > order[from]; false on a cycle
+	bool Reorder(uint32_t from, uint32_t to);
+	void SortByOrder(std::vector<uint32_t>& nodes) const;
+
+	TiledGrid<uint32_t> index_;
+	std::vector<Node> nodes_;
+	std::vector<uint32_t> free_nodes_;
+	std::vector<Range> ranges_;
+	std::vector<uint32_t> free_ranges_;
+	RangeIndex range_index_;
+	std::vector<uint32_t> worklist_;
+	std::vector<uint32_t> affected_dependents_;
+	std::vector<uint32_t> affected_precedents_;
+	std::vector<uint32_t> range_owners_;
+	std::vector<int64_t> free_orders_;
+	std::vector<uint32_t> pending_precedents_;  // RebuildOrder scratch
+	uint32_t epoch_ = 0;
+	int64_t lowest_order_ = 0;
+	int64_t highest_order_ = 0;
+	size_t edge_count_ = 0;
+};
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+#include "sheet.h"
+#include "value_columns.h"
+
+// What the formula interpreter needs from the sheet: the numeric value of a referenced cell.
+// The interpreter is instantiated for this class directly, so reading an operand is one tile
+// lookup plus a non-virtual call into the cell; no CellInterface::Value is built on the way
+// and text cells are read in place.
+class EvaluationContext {
+public:
+	explicit EvaluationContext(const Sheet& sheet)
+		: sheet_(sheet)
+	{
+	}
+
+	// the cell as a number, or the error that keeps it from being one
+	FormulaInterface::Value GetNumber(Position pos) const {
+		if (!pos.IsValid()) {
+			return FormulaError{ FormulaError::Category::Ref };
+		}
+		const Cell* cell = sheet_.FindCell(pos);
+		if (!cell) {
+			return 0.0;
+		}
+		if (cell->NeedsEvaluation()) {
+			sheet_.EvaluateFormulas(pos);
+		}
+		return cell->GetNumber();
+	}
+
+	// cells of a range, straight from the sheet's column cache: the segment holding pos,
+	// with rows [pos.row, end_row) of it read; pos is valid
+	ValueSpan GetValueSpan(Position pos, int end_row) const {
+		return sheet_.ReadValueSpan(pos, end_row, scratch_);
+	}
+
+private:
+	const Sheet& sheet_;
+	mutable ValueSegment scratch_;  // for segments the sheet cannot cache yet
+};
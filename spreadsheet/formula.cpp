@@ -1,50 +1,43 @@
 #include "formula.h"
 
 #include "FormulaAST.h"
+#include "formula_pool.h"
 
-#include <algorithm>
 #include <cassert>
-#include <cctype>
-#include <sstream>
 
 using namespace std::literals;
 
 namespace {
+	// отдельная формула вне листа: ссылки считаются от A1, то есть абсолютные
 	class Formula : public FormulaInterface {
 	public:
 		explicit Formula(std::string expression) try
-			:ast_(ParseFormulaAST(reinterpret_cast<const std::string&>(expression))) {
+			:formula_(ParseFormulaAST(expression)) {
 		}
 		catch (const std::exception& exc) {
 			std::throw_with_nested(FormulaException(exc.what()));
 		}
 
 		Value Evaluate(const SheetInterface& sheet) const override {
-			auto func = [&](Position pos) {return (sheet.GetCell(pos)) ? sheet.GetCell(pos)->GetValue() : CellInterface::Value{0.0}; };
-			try {
-				return ast_.Execute(func);
-			}
-			catch (const FormulaError& exp) {
-				return FormulaError(exp.GetCategory());
-			}
+			return formula_.Evaluate(sheet, ANCHOR);
+		}
+
+		Value Evaluate(const EvaluationContext& context) const override {
+			return formula_.Evaluate(context, ANCHOR);
 		}
 
 		std::string GetExpression() const override {
-			std::ostringstream os;
-			ast_.PrintFormula(os);
-			return os.str();
+			return formula_.GetExpression(ANCHOR);
 		}
 
 		std::vector<Position> GetReferencedCells() const override {
-			auto cells = ast_.GetCells();
-			std::vector<Position> sorted{ std::move_iterator(cells.begin()), std::move_iterator(cells.end()) };
-			std::sort(sorted.begin(), sorted.end());
-			sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
-			return sorted;
+			return formula_.GetReferencedCells(ANCHOR);
 		}
 
 	private:
-		FormulaAST ast_;
+		static constexpr Position ANCHOR{ 0, 0 };
+
+		SharedFormula formula_;
 	};
 }// namespace
 
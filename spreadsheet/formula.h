@@ -6,11 +6,14 @@
 #include <vector>
 #include <forward_list>
 
+class EvaluationContext;
 
 // ,      .
 //  :
 // *     , : 1+2*3, 2.5*(2+3.5/7)
 // *     : A1+B2*C3
+// *  SUM, AVERAGE, MIN, MAX, COUNT    : SUM(A1:B3,C4*2).
+//      ,   ,   .
 // ,   ,    ,   .  
 // ,    ,      . 
 //          .
@@ -28,6 +31,10 @@ public:
     // .
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
 
+    //   ,       , 
+    //  CellInterface::Value   .
+    virtual Value Evaluate(const EvaluationContext& context) const = 0;
+
     //  ,   .
     //      .
     virtual std::string GetExpression() const = 0;
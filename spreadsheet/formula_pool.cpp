@@ -0,0 +1,185 @@
+#include "formula_pool.h"
+
+#include "evaluation_context.h"
+
+#include <algorithm>
+#include <charconv>
+#include <sstream>
+
+namespace {
+	// Ключ формы по скомпилированной программе: постфиксная запись с точными числами.
+	// Ключи из текста (MakeFormulaKey) никогда не начинаются с '#', так что они не пересекаются.
+	void MakeProgramKey(const std::vector<ASTImpl::Instruction>& program, std::string& key) {
+		key.assign(1, '#');
+		char number[32];
+		for (const ASTImpl::Instruction& instruction : program) {
+			switch (instruction.code) {
+			case ASTImpl::OpCode::Number: {
+				const auto result = std::to_chars(number, number + sizeof(number), instruction.number);
+				key.append(number, result.ptr);
+				break;
+			}
+			case ASTImpl::OpCode::Cell:
+				key += 'R';
+				key += std::to_string(instruction.cell.row);
+				key += 'C';
+				key += std::to_string(instruction.cell.col);
+				break;
+			case ASTImpl::OpCode::Range:
+				key += ASTImpl::GetFunctionName(instruction.function);
+				key += 'R';
+				key += std::to_string(instruction.range.row);
+				key += 'C';
+				key += std::to_string(instruction.range.col);
+				key += ':';
+				key += std::to_string(instruction.range.rows);
+				key += 'x';
+				key += std::to_string(instruction.range.cols);
+				break;
+			case ASTImpl::OpCode::Argument:
+				key += ASTImpl::GetFunctionName(instruction.function);
+				break;
+			case ASTImpl::OpCode::Call:
+				key += ASTImpl::GetFunctionName(instruction.function);
+				key += '(';
+				key += std::to_string(instruction.arg_count);
+				break;
+			default:
+				key += static_cast<char>('a' + static_cast<int>(instruction.code));
+				break;
+			}
+			key += ' ';
+		}
+	}
+}// namespace
+
+SharedFormula::SharedFormula(FormulaAST ast)
+	: ast_(std::move(ast))
+{
+}
+
+FormulaInterface::Value SharedFormula::Evaluate(const EvaluationContext& context, Position anchor) const {
+	return ast_.Execute(context, anchor);
+}
+
+FormulaInterface::Value SharedFormula::Evaluate(const SheetInterface& sheet, Position anchor) const {
+	// пустая ячейка читается как пустой текст: число из неё 0, а диапазон её пропускает
+	auto func = [&](Position pos) {
+		const CellInterface* cell = sheet.GetCell(pos);
+		if (!cell) {
+			return CellInterface::Value{ std::string() };
+		}
+		CellInterface::Value value = cell->GetValue();
+		if (const double* number = std::get_if<double>(&value); number && *number == 0 && cell->GetText().empty()) {
+			return CellInterface::Value{ std::string() };
+		}
+		return value;
+	};
+	return ast_.Execute(func, anchor);
+}
+
+std::string SharedFormula::GetExpression(Position anchor) const {
+	std::ostringstream os;
+	ast_.PrintFormula(os, anchor);
+	return os.str();
+}
+
+std::vector<Position> SharedFormula::GetReferencedCells(Position anchor) const {
+	std::vector<Position> cells = GetSingleReferences(anchor);
+	// каждая ячейка диапазона — отдельная зависимость
+	for (const RangeReference& range : ast_.GetRanges()) {
+		for (int row = 0; row < range.size.rows; ++row) {
+			for (int col = 0; col < range.size.cols; ++col) {
+				cells.push_back({ anchor.row + range.top_left.row + row, anchor.col + range.top_left.col + col });
+			}
+		}
+	}
+	// в построчном порядке; с диапазонами повторы ячеек обычны
+	std::sort(cells.begin(), cells.end());
+	cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+	return cells;
+}
+
+std::vector<Position> SharedFormula::GetSingleReferences(Position anchor) const {
+	std::vector<Position> cells;
+	for (Position offset : ast_.GetCells()) {
+		cells.push_back({ anchor.row + offset.row, anchor.col + offset.col });
+	}
+	return cells;
+}
+
+std::vector<RangeReference> SharedFormula::GetRangeReferences(Position anchor) const {
+	std::vector<RangeReference> ranges;
+	for (const RangeReference& range : ast_.GetRanges()) {
+		ranges.push_back({ { anchor.row + range.top_left.row, anchor.col + range.top_left.col }, range.size });
+	}
+	return ranges;
+}
+
+std::shared_ptr<const SharedFormula> FormulaPool::Intern(std::string_view expression, Position anchor) {
+	if (!MakeFormulaKey(expression, anchor, key_)) {
+		// парсер сообщит об ошибке
+		return std::make_shared<const SharedFormula>(ParseFormulaAST(expression, anchor));
+	}
+	std::weak_ptr<const SharedFormula>& entry = formulas_[key_];
+	if (auto formula = entry.lock()) {
+		return formula;
+	}
+	std::shared_ptr<const SharedFormula> formula;
+	try {
+		formula = std::make_shared<const SharedFormula>(ParseFormulaAST(expression, anchor));
+	}
+	catch (...) {
+		formulas_.erase(key_);
+		throw;
+	}
+	entry = formula;
+	if (formulas_.size() >= sweep_size_) {
+		Sweep();
+	}
+	return formula;
+}
+
+std::shared_ptr<const SharedFormula> FormulaPool::Adopt(FormulaAST ast, Position anchor) {
+	for (Position offset : ast.GetCells()) {
+		if (!Position{ anchor.row + offset.row, anchor.col + offset.col }.IsValid()) {
+			throw FormulaException("Invalid position in formula");
+		}
+	}
+	for (const RangeReference& range : ast.GetRanges()) {
+		const Position top_left{ anchor.row + range.top_left.row, anchor.col + range.top_left.col };
+		if (!top_left.IsValid() || !Position{ top_left.row + range.size.rows - 1, top_left.col + range.size.cols - 1 }.IsValid()) {
+			throw FormulaException("Invalid position in formula");
+		}
+	}
+	MakeProgramKey(ast.GetProgram(), key_);
+	std::weak_ptr<const SharedFormula>& entry = formulas_[key_];
+	if (auto formula = entry.lock()) {
+		return formula;
+	}
+	auto formula = std::make_shared<const SharedFormula>(std::move(ast));
+	entry = formula;
+	if (formulas_.size() >= sweep_size_) {
+		Sweep();
+	}
+	return formula;
+}
+
+size_t FormulaPool::GetSize() const {
+	return std::count_if(formulas_.begin(), formulas_.end(), [](const auto& entry) {
+		return !entry.second.expired();
+	});
+}
+
+void FormulaPool::Sweep() {
+	for (auto it = formulas_.begin(); it != formulas_.end();) {
+		if (it->second.expired()) {
+			it = formulas_.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+	// следующая чистка - когда таблица снова вырастет вдвое
+	sweep_size_ = std::max(MIN_SWEEP_SIZE, formulas_.size() * 2);
+}
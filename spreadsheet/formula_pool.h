@@ -0,0 +1,66 @@
+#pragma once
+
+#include "FormulaAST.h"
+#include "common.h"
+#include "formula.h"
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class EvaluationContext;
+
+// Compiled formula whose cell references are offsets from the cell holding it (R1C1 style).
+// The cell passes its own position as the anchor, so one object serves every cell where
+// the formula has the same shape: =A1*B1 in C1 and =A2*B2 in C2 share it.
+class SharedFormula {
+public:
+	explicit SharedFormula(FormulaAST ast);
+
+	FormulaInterface::Value Evaluate(const EvaluationContext& context, Position anchor) const;
+	FormulaInterface::Value Evaluate(const SheetInterface& sheet, Position anchor) const;
+	std::string GetExpression(Position anchor) const;
+	// sorted, without duplicates; the cells of ranges are listed one by one
+	std::vector<Position> GetReferencedCells(Position anchor) const;
+	// The references as the sheet links them: cells referenced on their own, sorted, and
+	// the ranges in the order of the formula, not expanded.
+	std::vector<Position> GetSingleReferences(Position anchor) const;
+	std::vector<RangeReference> GetRangeReferences(Position anchor) const;
+
+	const FormulaAST& GetAST() const {
+		return ast_;
+	}
+
+private:
+	FormulaAST ast_;
+};
+
+// Sheet-wide intern table of compiled formulas keyed by their relative shape
+// (see MakeFormulaKey). A fill-down column of the same formula is parsed once; every
+// further cell only looks the key up and keeps a reference plus its own position.
+// The table holds weak references, so a shape is freed with the last cell using it.
+class FormulaPool {
+public:
+	// Throws ParsingError or FormulaException if expression is not a valid formula.
+	std::shared_ptr<const SharedFormula> Intern(std::string_view expression, Position anchor);
+	// Registers an already compiled formula (e.g. one restored from a snapshot), or returns
+	// the equal one that is already there. Such shapes are keyed by their program, so they
+	// are not shared with shapes interned from text.
+	// Throws FormulaException if a reference falls outside the sheet at anchor.
+	std::shared_ptr<const SharedFormula> Adopt(FormulaAST ast, Position anchor);
+
+	// number of distinct formula shapes in use
+	size_t GetSize() const;
+
+private:
+	static constexpr size_t MIN_SWEEP_SIZE = 64;
+
+	// drops entries of shapes nobody uses any more
+	void Sweep();
+
+	std::unordered_map<std::string, std::weak_ptr<const SharedFormula>> formulas_;
+	std::string key_;  // reused, so a hit allocates nothing
+	size_t sweep_size_ = MIN_SWEEP_SIZE;
+};
@@ -1,15 +1,26 @@
-﻿#include <limits>
-
+﻿#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <limits>
+#include <thread>
+#include <unordered_set>
+
+#include "aggregate_kernels.h"
+#include "cell.h"
 #include "common.h"
 #include "formula.h"
+#include "range_index.h"
+#include "sheet.h"
 #include "test_runner_p.h"
+#include "thread_pool.h"
+#include "value_columns.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
 }
 
-inline Position operator"" _pos(const char* str, std::size_t) {
-    return Position::FromString(str);
+constexpr Position operator"" _pos(const char* str, std::size_t size) {
+    return Position::FromString({ str, size });
 }
 
 inline std::ostream& operator<<(std::ostream& output, Size size) {
@@ -432,6 +443,1423 @@ namespace {
         };
         ASSERT_EQUAL(values_out.str(), values_expected.str());
     }
+
+    void TestTiledStorage() {
+        auto sheet = CreateSheet();
+        // ячейки по обе стороны границы тайла и в дальнем углу
+        sheet->SetCell(Position{ 63, 63 }, "a");
+        sheet->SetCell(Position{ 64, 64 }, "b");
+        sheet->SetCell(Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 }, "c");
+        ASSERT_EQUAL(sheet->GetCell(Position{ 63, 63 })->GetText(), "a");
+        ASSERT_EQUAL(sheet->GetCell(Position{ 64, 64 })->GetText(), "b");
+        ASSERT(sheet->GetCell(Position{ 63, 64 }) == nullptr);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ Position::MAX_ROWS, Position::MAX_COLS }));
+
+        sheet->ClearCell(Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 });
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 65, 65 }));
+
+        for (int i = 0; i < 200; ++i) {
+            sheet->SetCell(Position{ i, 2 * i }, std::to_string(i));
+        }
+        for (int i = 0; i < 200; ++i) {
+            sheet->ClearCell(Position{ i, 2 * i });
+        }
+        ASSERT(sheet->GetCell(Position{ 10, 20 }) == nullptr);
+        ASSERT_EQUAL(sheet->GetCell(Position{ 64, 64 })->GetText(), "b");
+    }
+
+    void TestPrintableSizeTracking() {
+        auto sheet = CreateSheet();
+        for (int i = 0; i < 1000; ++i) {
+            sheet->SetCell(Position{ i, i % 10 }, "x");
+        }
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 1000, 10 }));
+
+        // повторная запись не меняет размер
+        sheet->SetCell(Position{ 999, 9 }, "y");
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 1000, 10 }));
+
+        sheet->ClearCell(Position{ 999, 9 });
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 999, 10 }));
+        sheet->ClearCell(Position{ 989, 9 });
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 999, 10 }));
+
+        for (int i = 999; i >= 10; --i) {
+            sheet->ClearCell(Position{ i, i % 10 });
+        }
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 10, 10 }));
+        sheet->ClearCell(Position{ 9, 9 });
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{ 9, 9 }));
+    }
+
+    void TestDependencyUpdates() {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        sheet->SetCell("B1"_pos, "=A1+1");
+        sheet->SetCell("C1"_pos, "=A1*2");
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        // перезапись ячейки сохраняет ссылки на неё
+        sheet->SetCell("A1"_pos, "=5");
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(10.0));
+
+        // много ячеек ссылается на одну
+        for (int row = 1; row <= 100; ++row) {
+            sheet->SetCell(Position{ row, 0 }, "=A1+" + std::to_string(row));
+        }
+        for (int row = 1; row <= 100; row += 2) {
+            sheet->ClearCell(Position{ row, 0 });
+        }
+        sheet->SetCell("A1"_pos, "=7");
+        ASSERT_EQUAL(sheet->GetCell(Position{ 2, 0 })->GetValue(), CellInterface::Value(9.0));
+        ASSERT_EQUAL(sheet->GetCell(Position{ 100, 0 })->GetValue(), CellInterface::Value(107.0));
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(8.0));
+
+        sheet->SetCell("B1"_pos, "=C1");
+        sheet->SetCell("A1"_pos, "=1");
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+    }
+
+    void TestInvalidationPass() {
+        Sheet sheet;
+        // у A1 два зависимых: B1 ещё не вычислена, C1 и D1 закэшированы
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1");
+        sheet.SetCell("C1"_pos, "=A1");
+        sheet.SetCell("D1"_pos, "=C1");
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(1.0));
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        sheet.SetCell("E1"_pos, "=D1*2");
+        ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(4.0));
+        ASSERT_EQUAL(sheet.InvalidateDependentCells("A1"_pos), 4u);
+        ASSERT_EQUAL(sheet.InvalidateDependentCells("A1"_pos), 0u);
+
+        constexpr int chain = 2000;
+        sheet.SetCell(Position{ 0, 6 }, "1");
+        for (int row = 1; row < chain; ++row) {
+            sheet.SetCell(Position{ row, 6 }, "=G" + std::to_string(row) + "+1");
+        }
+        ASSERT_EQUAL(sheet.GetCell(Position{ chain - 1, 6 })->GetValue(), CellInterface::Value(double(chain)));
+        ASSERT_EQUAL(sheet.InvalidateDependentCells(Position{ 0, 6 }), size_t(chain - 1));
+    }
+
+    void TestIncrementalCycleDetection() {
+        Sheet sheet;
+        // ромб не является циклом
+        sheet.SetCell("A1"_pos, "=B1+C1");
+        sheet.SetCell("B1"_pos, "=D1");
+        sheet.SetCell("C1"_pos, "=D1");
+        sheet.SetCell("D1"_pos, "1");
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        auto is_cycle = [&sheet](Position pos, std::string text) {
+            try {
+                sheet.SetCell(pos, std::move(text));
+            }
+            catch (const CircularDependencyException&) {
+                return true;
+            }
+            return false;
+        };
+        ASSERT(is_cycle("E1"_pos, "=E1"));
+        ASSERT(sheet.GetCell("E1"_pos) == nullptr);
+        ASSERT(is_cycle("D1"_pos, "=A1"));
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "1");
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        // длинная цепочка: каждая новая ячейка ссылается на предыдущую
+        constexpr int chain = Position::MAX_ROWS;
+        for (int row = 1; row < chain; ++row) {
+            sheet.SetCell(Position{ row, 7 }, "=H" + std::to_string(row) + "+1");
+        }
+        ASSERT(is_cycle("H1"_pos, "=H" + std::to_string(chain)));
+        sheet.SetCell("H1"_pos, "=D1");
+        ASSERT_EQUAL(sheet.GetCell(Position{ chain - 1, 7 })->GetValue(), CellInterface::Value(double(chain)));
+
+        // случайные правки на маленьком поле сверяются с полным обходом
+        constexpr int side = 5;
+        std::vector<std::vector<Position>> refs(side * side);
+        auto reaches = [&refs](Position from, Position target) {
+            std::vector<Position> stack{ from };
+            std::vector<bool> seen(side * side);
+            while (!stack.empty()) {
+                Position cur = stack.back();
+                stack.pop_back();
+                if (cur == target) {
+                    return true;
+                }
+                if (!seen[cur.row * side + cur.col]) {
+                    seen[cur.row * side + cur.col] = true;
+                    for (Position next : refs[cur.row * side + cur.col]) {
+                        stack.push_back(next);
+                    }
+                }
+            }
+            return false;
+        };
+        Sheet random_sheet;
+        unsigned seed = 12345;
+        auto next_random = [&seed](int bound) {
+            seed = seed * 1103515245 + 12345;
+            return static_cast<int>((seed >> 16) % bound);
+        };
+        // каждая третья правка ссылается на диапазон, который порядок тоже учитывает
+        for (int step = 0; step < 3000; ++step) {
+            Position pos{ next_random(side), next_random(side) };
+            Position a{ next_random(side), next_random(side) };
+            Position b{ next_random(side), next_random(side) };
+            std::vector<Position> targets{ a, b };
+            std::string text = "=" + a.ToString() + "+" + b.ToString();
+            if (step % 3 == 0) {
+                const Position top_left{ std::min(a.row, b.row), std::min(a.col, b.col) };
+                const Position bottom_right{ std::max(a.row, b.row), std::max(a.col, b.col) };
+                targets.clear();
+                for (int row = top_left.row; row <= bottom_right.row; ++row) {
+                    for (int col = top_left.col; col <= bottom_right.col; ++col) {
+                        targets.push_back({ row, col });
+                    }
+                }
+                text = "=SUM(" + top_left.ToString() + ":" + bottom_right.ToString() + ")";
+            }
+            const bool expected_cycle = std::any_of(targets.begin(), targets.end(), [&](Position target) {
+                return reaches(target, pos);
+            });
+            bool cycle = false;
+            try {
+                random_sheet.SetCell(pos, text);
+            }
+            catch (const CircularDependencyException&) {
+                cycle = true;
+            }
+            ASSERT_EQUAL(cycle, expected_cycle);
+            if (!cycle) {
+                refs[pos.row * side + pos.col] = std::move(targets);
+            }
+        }
+    }
+
+    void TestEvaluationContext() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "'12");
+        sheet.SetCell("A2"_pos, "3.5");
+        sheet.SetCell("A3"_pos, "=1/0");
+        sheet.SetCell("A4"_pos, "'");
+        sheet.SetCell("B1"_pos, "=A1*2");
+        sheet.SetCell("B2"_pos, "=A2");
+        sheet.SetCell("B3"_pos, "=A3+1");
+        sheet.SetCell("B4"_pos, "=A4+C9+1");
+        sheet.SetCell("B5"_pos, "=B1+B4");
+
+        // чтение через лист и через SheetInterface даёт одинаковый результат
+        const SheetInterface& link = sheet;
+        for (int row = 0; row < 5; ++row) {
+            const Position pos{ row, 1 };
+            auto formula = ParseFormula(sheet.GetCell(pos)->GetText().substr(1));
+            const auto expected = formula->Evaluate(link);
+            const auto actual = sheet.GetCell(pos)->GetValue();
+            if (std::holds_alternative<double>(expected)) {
+                ASSERT_EQUAL(actual, CellInterface::Value(std::get<double>(expected)));
+            }
+            else {
+                ASSERT_EQUAL(actual, CellInterface::Value(std::get<FormulaError>(expected)));
+            }
+        }
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(24.0));
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(3.5));
+        ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+        ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetValue(), CellInterface::Value(25.0));
+
+        // длинная цепочка с ошибкой внизу вычисляется без глубокой рекурсии
+        constexpr int chain = Position::MAX_ROWS;
+        sheet.SetCell(Position{ 0, 3 }, "=1/0");
+        for (int row = 1; row < chain; ++row) {
+            sheet.SetCell(Position{ row, 3 }, "=D" + std::to_string(row) + "+1");
+        }
+        ASSERT_EQUAL(sheet.GetCell(Position{ chain - 1, 3 })->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Arithmetic)));
+        sheet.SetCell(Position{ 0, 3 }, "1");
+        ASSERT_EQUAL(sheet.GetCell(Position{ chain - 1, 3 })->GetValue(), CellInterface::Value(double(chain)));
+    }
+
+    void TestNumericTextCells() {
+        auto sheet = CreateSheet();
+        auto read = [&sheet](std::string text) {
+            sheet->SetCell("A1"_pos, std::move(text));
+            sheet->SetCell("B1"_pos, "=A1");
+            return sheet->GetCell("B1"_pos)->GetValue();
+        };
+        ASSERT_EQUAL(read("42"), CellInterface::Value(42.0));
+        ASSERT_EQUAL(read("'42"), CellInterface::Value(42.0));
+        ASSERT_EQUAL(read("-2.5"), CellInterface::Value(-2.5));
+        ASSERT_EQUAL(read("1e3"), CellInterface::Value(1000.0));
+        ASSERT_EQUAL(read("'"), CellInterface::Value(0.0));
+        ASSERT_EQUAL(read("3D"), CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(read(" 5"), CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(read("inf"), CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(read("nan"), CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(read("1e400"), CellInterface::Value(FormulaError::Category::Arithmetic));
+
+        // текст и значение ячейки остаются строками
+        sheet->SetCell("A1"_pos, "1.50");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "1.50");
+        ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(std::string("1.50")));
+        ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(1.5));
+
+        // через SheetInterface число из текста читается так же
+        auto formula = ParseFormula("A1*2");
+        ASSERT_EQUAL(std::get<double>(formula->Evaluate(*sheet)), 3.0);
+    }
+
+    void TestFormulaParser() {
+        auto evaluate = [](std::string expr) {
+            return std::get<double>(ParseFormula(std::move(expr))->Evaluate(*CreateSheet()));
+        };
+        auto reformat = [](std::string expr) {
+            return ParseFormula(std::move(expr))->GetExpression();
+        };
+        auto is_incorrect = [](std::string expr) {
+            try {
+                ParseFormula(std::move(expr));
+            }
+            catch (const FormulaException&) {
+                return true;
+            }
+            return false;
+        };
+
+        // унарный знак связывается сильнее умножения, бинарные операции левоассоциативны
+        ASSERT_EQUAL(evaluate("1-2-3"), -4.0);
+        ASSERT_EQUAL(evaluate("8/4/2"), 1.0);
+        ASSERT_EQUAL(evaluate("2+3*4-1"), 13.0);
+        ASSERT_EQUAL(evaluate("-2*-3"), 6.0);
+        ASSERT_EQUAL(evaluate("--+1"), 1.0);
+        ASSERT_EQUAL(reformat("-(1+2)*3"), "-(1+2)*3");
+        ASSERT_EQUAL(reformat("1-(2-3)"), "1-(2-3)");
+        ASSERT_EQUAL(reformat("\t1\n+\r(A1 )"), "1+A1");
+
+        ASSERT_EQUAL(evaluate("1e3+.5+2.25E-2+1e+1"), 1010.5225);
+        ASSERT_EQUAL(evaluate("1e-400"), 0.0);
+        ASSERT(is_incorrect("1e400"));
+        ASSERT(is_incorrect("1."));
+        ASSERT(is_incorrect("."));
+        ASSERT(is_incorrect("1e"));
+        ASSERT(is_incorrect("1.5.5"));
+
+        ASSERT(is_incorrect(""));
+        ASSERT(is_incorrect("  "));
+        ASSERT(is_incorrect("()"));
+        ASSERT(is_incorrect("1 2"));
+        ASSERT(is_incorrect("(1))"));
+        ASSERT(is_incorrect("a1"));
+        ASSERT(is_incorrect("A"));
+        ASSERT(is_incorrect("A1B2"));
+        ASSERT(is_incorrect("1%2"));
+        ASSERT(is_incorrect("ZZZZ1"));
+        ASSERT(is_incorrect("A99999"));
+
+        auto formula = ParseFormula("B2+A1*B2-AB10");
+        ASSERT_EQUAL(formula->GetReferencedCells(), (std::vector{ "A1"_pos, "B2"_pos, "AB10"_pos }));
+    }
+
+    void TestFormulaSharing() {
+        Sheet sheet;
+        constexpr int rows = 100;
+        for (int row = 0; row < rows; ++row) {
+            const std::string n = std::to_string(row + 1);
+            sheet.SetCell(Position{ row, 0 }, n);
+            sheet.SetCell(Position{ row, 1 }, "2");
+            sheet.SetCell(Position{ row, 2 }, "=A" + n + " * B" + n);
+        }
+        // одна форма на всю колонку, а текст и значения у каждой ячейки свои
+        ASSERT_EQUAL(sheet.GetFormulaPool().GetSize(), 1u);
+        ASSERT_EQUAL(sheet.GetCell("C7"_pos)->GetText(), "=A7*B7");
+        ASSERT_EQUAL(sheet.GetCell("C7"_pos)->GetValue(), CellInterface::Value(14.0));
+
+        // та же форма в другой колонке, другая форма в той же
+        sheet.SetCell("D3"_pos, "=B3*C3");
+        sheet.SetCell("E3"_pos, "=A3*B4");
+        ASSERT_EQUAL(sheet.GetFormulaPool().GetSize(), 2u);
+        ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetValue(), CellInterface::Value(12.0));
+        ASSERT_EQUAL(sheet.GetCell("E3"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(sheet.GetCell("E3"_pos)->GetReferencedCells(), (std::vector{ "A3"_pos, "B4"_pos }));
+
+        // некорректные формулы в таблицу не попадают
+        for (std::string bad : { "=A1*", "=A1 B1", "=ZZZZ1*B1", "=a1" }) {
+            try {
+                sheet.SetCell("F1"_pos, bad);
+                ASSERT(false);
+            }
+            catch (const FormulaException&) {
+            }
+        }
+        ASSERT_EQUAL(sheet.GetFormulaPool().GetSize(), 2u);
+        sheet.SetCell("F1"_pos, "=A1*B1");
+        ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        // форма освобождается вместе с последней ячейкой
+        sheet.ClearCell("D3"_pos);
+        sheet.ClearCell("E3"_pos);
+        sheet.ClearCell("F1"_pos);
+        ASSERT_EQUAL(sheet.GetFormulaPool().GetSize(), 1u);
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell(Position{ row, 2 }, "");
+        }
+        ASSERT_EQUAL(sheet.GetFormulaPool().GetSize(), 0u);
+    }
+
+    void TestBatchUpdates() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1+1");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        // изменения видны после Commit, кэш зависимых сброшен
+        sheet.SetCells({ { "A1"_pos, "10" }, { "C1"_pos, "=B1*2" }, { "D1"_pos, "=E5" } });
+        ASSERT(!sheet.InBatch());
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(11.0));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(22.0));
+        ASSERT(sheet.GetCell("E5"_pos) != nullptr);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 5, 5 }));
+
+        // цикл, замкнутый внутри пакета, откатывает весь пакет
+        try {
+            sheet.SetCells({ { "A1"_pos, "5" }, { "E5"_pos, "=F1" }, { "A1"_pos, "=C1" } });
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+        ASSERT(!sheet.InBatch());
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "10");
+        ASSERT_EQUAL(sheet.GetCell("E5"_pos)->GetText(), "");
+        ASSERT(sheet.GetCell("F1"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(22.0));
+        sheet.SetCell("A1"_pos, "0");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        // промежуточный цикл не ошибка, если к Commit он разорван
+        sheet.BeginBatch();
+        sheet.SetCell("A1"_pos, "=C1");
+        sheet.SetCell("A1"_pos, "3");
+        sheet.ClearCell("D1"_pos);
+        sheet.Commit();
+        ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(8.0));
+
+        // Rollback и ошибка разбора ничего не меняют
+        sheet.BeginBatch();
+        sheet.SetCell("A1"_pos, "100");
+        sheet.ClearCell("B1"_pos);
+        try {
+            sheet.SetCell("C1"_pos, "=A1+");
+            ASSERT(false);
+        }
+        catch (const FormulaException&) {
+        }
+        sheet.Rollback();
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1+1");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(8.0));
+        sheet.SetCell("A1"_pos, "4");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(10.0));
+
+        try {
+            sheet.Commit();
+            ASSERT(false);
+        }
+        catch (const std::logic_error&) {
+        }
+    }
+
+    void TestLoadTexts() {
+        Sheet source;
+        source.SetCell("A1"_pos, "=(1+2)*3");
+        source.SetCell("B1"_pos, "'=escaped");
+        source.SetCell("C2"_pos, "=A1+B3");
+        source.SetCell("B3"_pos, "2.5");
+        source.SetCell("D4"_pos, "text with spaces");
+        std::ostringstream printed;
+        source.PrintTexts(printed);
+
+        Sheet loaded;
+        std::istringstream input(printed.str());
+        loaded.LoadTexts(input);
+        std::ostringstream reprinted;
+        loaded.PrintTexts(reprinted);
+        ASSERT_EQUAL(reprinted.str(), printed.str());
+        ASSERT_EQUAL(loaded.GetCell("C2"_pos)->GetValue(), CellInterface::Value(11.5));
+        ASSERT_EQUAL(loaded.GetCell("B1"_pos)->GetValue(), CellInterface::Value(std::string("=escaped")));
+
+        // CSV с переводами строк \r\n и без завершающего перевода строки
+        Sheet csv;
+        std::istringstream csv_input("1,2\r\n,=A1+B1\r\n=B2*2");
+        csv.LoadTexts(csv_input, ',');
+        ASSERT_EQUAL(csv.GetCell("A3"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT(csv.GetCell("A2"_pos) == nullptr);
+
+        // ошибка указывает строку и поле, таблица не меняется
+        std::istringstream bad("1\t2\n3\t=A1+\n");
+        try {
+            csv.LoadTexts(bad);
+            ASSERT(false);
+        }
+        catch (const TextLoadException& exc) {
+            ASSERT_EQUAL(exc.GetLine(), 2);
+            ASSERT_EQUAL(exc.GetField(), 2);
+        }
+        ASSERT_EQUAL(csv.GetCell("A1"_pos)->GetText(), "1");
+        ASSERT_EQUAL(csv.GetCell("A3"_pos)->GetValue(), CellInterface::Value(6.0));
+
+        // в открытом пакете неудачная загрузка отменяет только свои правки
+        Sheet batched;
+        batched.SetCell("A1"_pos, "1");
+        batched.SetCell("C1"_pos, "=A1*2");
+        batched.BeginBatch();
+        batched.SetCell("A1"_pos, "5");
+        batched.SetCell("B1"_pos, "=A1+1");
+        std::istringstream partial("7\tkept\n8\t=A1+\n");
+        try {
+            batched.LoadTexts(partial);
+            ASSERT(false);
+        }
+        catch (const TextLoadException&) {
+        }
+        ASSERT_EQUAL(batched.GetCell("A1"_pos)->GetText(), "5");
+        ASSERT_EQUAL(batched.GetCell("B1"_pos)->GetText(), "=A1+1");
+        ASSERT(batched.GetCell("A2"_pos) == nullptr);
+        std::istringstream joined("\t\tloaded\n=B1*10");
+        batched.LoadTexts(joined);
+        batched.Commit();
+        ASSERT_EQUAL(batched.GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.0));
+        ASSERT_EQUAL(batched.GetCell("C1"_pos)->GetText(), "loaded");
+        ASSERT_EQUAL(batched.GetCell("A2"_pos)->GetValue(), CellInterface::Value(60.0));
+
+        batched.BeginBatch();
+        std::istringstream failing("9\n=A1+\n");
+        try {
+            batched.LoadTexts(failing);
+            ASSERT(false);
+        }
+        catch (const TextLoadException&) {
+        }
+        ASSERT_EQUAL(batched.GetCell("A1"_pos)->GetText(), "5");
+        batched.Rollback();
+        ASSERT_EQUAL(batched.GetCell("A1"_pos)->GetText(), "5");
+        ASSERT_EQUAL(batched.GetCell("A2"_pos)->GetValue(), CellInterface::Value(60.0));
+
+        // строки на стыке блоков чтения и строка длиннее блока
+        constexpr int rows = 16000;
+        std::string big;
+        for (int row = 0; row < rows; ++row) {
+            const std::string n = std::to_string(row + 1);
+            for (int col = 0; col < 10; ++col) {
+                big += std::to_string(row * 10 + col) + "\t";
+            }
+            big += "=A" + n + "+J" + n + "\n";
+        }
+        const std::string long_text(3 << 20, 'x');
+        big += long_text;
+        Sheet large;
+        std::istringstream big_input(std::move(big));
+        large.LoadTexts(big_input);
+        ASSERT_EQUAL(large.GetPrintableSize(), (Size{ rows + 1, 11 }));
+        ASSERT_EQUAL(large.GetCell(Position{ rows, 0 })->GetText(), long_text);
+        ASSERT_EQUAL(large.GetCell(Position{ 12345, 10 })->GetText(), "=A12346+J12346");
+        ASSERT_EQUAL(large.GetCell(Position{ 12345, 10 })->GetValue(), CellInterface::Value(246909.0));
+    }
+
+    void TestSnapshot() {
+        Sheet source;
+        source.SetCell("A1"_pos, "2");
+        source.SetCell("E1"_pos, "'=text");
+        source.SetCell("F1"_pos, "=");
+        for (int row = 1; row < 10; ++row) {
+            const std::string n = std::to_string(row);
+            source.SetCell(Position{ row, 0 }, "=A" + n + "*1.000001");
+            source.SetCell(Position{ row, 1 }, "=A" + n + "+B" + n);
+        }
+        source.SetCell("D1"_pos, "=1/0+E7");
+        source.SetCell("D2"_pos, "=A10/3");
+        std::ostringstream values;
+        source.PrintValues(values);
+        std::ostringstream texts;
+        source.PrintTexts(texts);
+
+        for (bool with_values : { false, true }) {
+            std::ostringstream saved;
+            source.SaveSnapshot(saved, with_values);
+            Sheet restored;
+            restored.SetCell("Z9"_pos, "old");
+            std::istringstream input(saved.str());
+            restored.LoadSnapshot(input);
+
+            std::ostringstream restored_texts;
+            restored.PrintTexts(restored_texts);
+            ASSERT_EQUAL(restored_texts.str(), texts.str());
+            ASSERT_EQUAL(restored.GetFormulaPool().GetSize(), 4u);
+            ASSERT(restored.GetCell("E7"_pos) != nullptr);
+            ASSERT_EQUAL(restored.GetCell("D1"_pos)->GetReferencedCells(), (std::vector{ "E7"_pos }));
+            std::ostringstream restored_values;
+            restored.PrintValues(restored_values);
+            ASSERT_EQUAL(restored_values.str(), values.str());
+
+            // связи восстановлены: изменение доходит до зависимых ячеек
+            restored.SetCell("A1"_pos, "0");
+            ASSERT_EQUAL(restored.GetCell("B10"_pos)->GetValue(), CellInterface::Value(0.0));
+            try {
+                restored.SetCell("A1"_pos, "=B10");
+                ASSERT(false);
+            }
+            catch (const CircularDependencyException&) {
+            }
+        }
+
+        // повреждённые данные отвергаются, таблица остаётся пустой
+        std::ostringstream saved;
+        source.SaveSnapshot(saved);
+        const std::string data = saved.str();
+        for (std::string bad : { data.substr(0, data.size() - 1), "XXXX" + data.substr(4), data + "!" }) {
+            Sheet restored;
+            restored.SetCell("A1"_pos, "1");
+            std::istringstream input(bad);
+            try {
+                restored.LoadSnapshot(input);
+                ASSERT(false);
+            }
+            catch (const SnapshotException&) {
+            }
+            ASSERT_EQUAL(restored.GetPrintableSize(), (Size{ 0, 0 }));
+        }
+    }
+
+    void TestRecalculate() {
+        // уровни разной ширины: числа, формулы над ними, цепочка и формулы без ссылок
+        Sheet eager;
+        Sheet lazy;
+        for (Sheet* sheet : { &eager, &lazy }) {
+            for (int col = 0; col < 600; ++col) {
+                const std::string name = Position{ 0, col }.ToString();
+                sheet->SetCell(Position{ 0, col }, std::to_string(col));
+                sheet->SetCell(Position{ 1, col }, "=" + name + "*2");
+                sheet->SetCell(Position{ 2, col }, "=" + Position{ 1, col }.ToString() + "+" + Position{ 1, 599 - col }.ToString());
+            }
+            sheet->SetCell("A4"_pos, "=A3");
+            for (int row = 4; row < 50; ++row) {
+                sheet->SetCell(Position{ row, 0 }, "=A" + std::to_string(row) + "+1");
+            }
+            sheet->SetCell("B5"_pos, "=1/0");
+        }
+        ASSERT_EQUAL(eager.RecalculateDirty(), 600u * 2 + 48);
+        ASSERT(!static_cast<const Cell*>(eager.GetCell("A50"_pos))->NeedsEvaluation());
+        ASSERT(!static_cast<const Cell*>(eager.GetCell("WB3"_pos))->NeedsEvaluation());
+        std::ostringstream eager_values;
+        eager.PrintValues(eager_values);
+        std::ostringstream lazy_values;
+        lazy.PrintValues(lazy_values);
+        ASSERT_EQUAL(eager_values.str(), lazy_values.str());
+        ASSERT_EQUAL(eager.GetCell("A50"_pos)->GetValue(), CellInterface::Value(1198.0 + 46));
+        ASSERT_EQUAL(eager.RecalculateDirty(), 0u);
+
+        // пересчитываются только сброшенные ячейки
+        eager.SetCell("WB1"_pos, "10");
+        ASSERT_EQUAL(eager.RecalculateDirty(), 3u + 47);
+        ASSERT_EQUAL(eager.GetCell("A50"_pos)->GetValue(), CellInterface::Value(20.0 + 46));
+        ASSERT_EQUAL(eager.RecalculateAll(), 600u * 2 + 48);
+
+        ThreadPool pool(4);
+        std::vector<int> hits(10000);
+        pool.ParallelFor(hits.size(), 7, [&hits](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                ++hits[i];
+            }
+        });
+        ASSERT(std::all_of(hits.begin(), hits.end(), [](int hit) { return hit == 1; }));
+        try {
+            pool.ParallelFor(100, 1, [](size_t begin, size_t) {
+                if (begin == 50) {
+                    throw std::runtime_error("chunk failed");
+                }
+            });
+            ASSERT(false);
+        }
+        catch (const std::runtime_error&) {
+        }
+    }
+
+    void TestBackgroundRecalc() {
+        Sheet sheet;
+        sheet.SetBackgroundRecalc(true);
+        ASSERT(sheet.IsBackgroundRecalc());
+        constexpr int rows = 3000;
+        sheet.SetCell("A1"_pos, "1");
+        for (int row = 1; row < rows; ++row) {
+            const std::string n = std::to_string(row);
+            sheet.SetCell(Position{ row, 0 }, "=A" + n + "+1");
+            sheet.SetCell(Position{ row, 1 }, "=A" + n + "*2");
+        }
+        sheet.WaitRecalcIdle();
+        const auto* last = static_cast<const Cell*>(sheet.GetCell(Position{ rows - 1, 0 }));
+        ASSERT(!last->NeedsEvaluation());
+        ASSERT_EQUAL(sheet.GetValue(Position{ rows - 1, 0 }), CellInterface::Value(double(rows)));
+
+        // правки вперемешку с чтением, пока рабочий поток пересчитывает
+        for (int i = 2; i < 50; ++i) {
+            sheet.SetCell("A1"_pos, std::to_string(i));
+            const auto policy = i % 2 ? Sheet::ReadPolicy::Wait : Sheet::ReadPolicy::Compute;
+            ASSERT_EQUAL(sheet.GetValue(Position{ rows - 1, 1 }, policy), CellInterface::Value(2.0 * (i + rows - 2)));
+            ASSERT_EQUAL(sheet.GetValue(Position{ i, 0 }, policy), CellInterface::Value(double(i + i)));
+        }
+        ASSERT_EQUAL(sheet.GetValue("C1"_pos), CellInterface::Value(0.0));
+
+        // внутри пакета рабочий поток стоит, а чтение значений и ожидание отвергаются;
+        // тексты читать можно. Чтение после Commit видит новые значения
+        auto throws_logic_error = [](const std::function<void()>& call) {
+            try {
+                call();
+            }
+            catch (const std::logic_error&) {
+                return true;
+            }
+            return false;
+        };
+        sheet.BeginBatch();
+        sheet.SetCell("A1"_pos, "100");
+        std::ostringstream output;
+        ASSERT(throws_logic_error([&] { sheet.WaitRecalcIdle(); }));
+        ASSERT(throws_logic_error([&] { sheet.GetValue(Position{ rows - 1, 0 }, Sheet::ReadPolicy::Wait); }));
+        ASSERT(throws_logic_error([&] { sheet.GetValue(Position{ rows - 1, 0 }); }));
+        ASSERT(throws_logic_error([&] { sheet.GetValues("A1"_pos, { 2, 2 }); }));
+        ASSERT(throws_logic_error([&] { sheet.GetValueSpan("A1"_pos); }));
+        ASSERT(throws_logic_error([&] { sheet.PrintValues(output); }));
+        ASSERT(throws_logic_error([&] { sheet.PrintValues(output, "A1"_pos, { 2, 2 }); }));
+        ASSERT(throws_logic_error([&] { sheet.SaveSnapshot(output, true); }));
+        ASSERT(throws_logic_error([&] { sheet.GetCell(Position{ rows - 1, 0 })->GetValue(); }));
+        ASSERT(output.str().empty());
+        sheet.PrintTexts(output, "A1"_pos, { 1, 1 });
+        ASSERT_EQUAL(output.str(), "100\n");
+        sheet.SaveSnapshot(output);
+        sheet.Commit();
+        ASSERT_EQUAL(sheet.GetValue(Position{ rows - 1, 0 }, Sheet::ReadPolicy::Wait), CellInterface::Value(100.0 + rows - 1));
+        std::ostringstream values;
+        sheet.PrintValues(values);
+
+        sheet.SetBackgroundRecalc(false);
+        ASSERT(!sheet.IsBackgroundRecalc());
+        std::ostringstream lazy_values;
+        sheet.RecalculateAll();
+        sheet.PrintValues(lazy_values);
+        ASSERT_EQUAL(values.str(), lazy_values.str());
+
+        // чтение в пакете отвергается до вычисления, и после отката не остаётся значения из пакета
+        Sheet rolled;
+        rolled.SetCell("A1"_pos, "1");
+        rolled.SetCell("B1"_pos, "=A1+1");
+        rolled.BeginBatch();
+        rolled.SetBackgroundRecalc(true);
+        rolled.SetCell("A1"_pos, "10");
+        try {
+            rolled.GetValue("B1"_pos, Sheet::ReadPolicy::Wait);
+            ASSERT(false);
+        }
+        catch (const std::logic_error&) {
+        }
+        rolled.Rollback();
+        ASSERT_EQUAL(rolled.GetValue("B1"_pos, Sheet::ReadPolicy::Wait), CellInterface::Value(2.0));
+    }
+
+    void TestConcurrentReaders() {
+        constexpr int rows = 2000;
+        constexpr int edits = 200;
+        for (bool background : { false, true }) {
+            Sheet sheet;
+            sheet.SetBackgroundRecalc(background);
+            sheet.SetCell("A1"_pos, "0");
+            for (int row = 1; row < rows; ++row) {
+                const std::string n = std::to_string(row);
+                sheet.SetCell(Position{ row, 0 }, "=A" + n + "+1");
+                sheet.SetCell(Position{ row, 1 }, "=A" + n + "*2");
+            }
+
+            // каждое чтение видит таблицу до или после правки, но не посередине
+            std::atomic<bool> done = false;
+            std::atomic<int> bad_reads = 0;
+            const auto read = [&](Sheet::ReadPolicy policy) {
+                while (!done) {
+                    const auto value = sheet.GetValue(Position{ rows - 1, 0 }, policy);
+                    const double first = std::get<double>(value) - (rows - 1);
+                    if (first < 0 || first > edits || first != static_cast<int>(first)) {
+                        ++bad_reads;
+                    }
+                    std::ostringstream values;
+                    sheet.PrintValues(values);
+                    const std::string text = values.str();
+                if (std::count(text.begin(), text.end(), '\n') != rows) {
+                        ++bad_reads;
+                    }
+                }
+            };
+            std::vector<std::thread> readers;
+            readers.emplace_back(read, Sheet::ReadPolicy::Compute);
+            readers.emplace_back(read, Sheet::ReadPolicy::Compute);
+            readers.emplace_back(read, Sheet::ReadPolicy::Wait);
+            for (int i = 1; i <= edits; ++i) {
+                sheet.SetCell("A1"_pos, std::to_string(i));
+                if (i % 50 == 0) {
+                    sheet.SetCells({ { "C1"_pos, "=A1" }, { "C2"_pos, "=C1+B2" } });
+                }
+            }
+            done = true;
+            for (std::thread& reader : readers) {
+                reader.join();
+            }
+            ASSERT_EQUAL(bad_reads.load(), 0);
+            ASSERT_EQUAL(sheet.GetValue(Position{ rows - 1, 1 }), CellInterface::Value(2.0 * (edits + rows - 2)));
+            ASSERT_EQUAL(sheet.GetValue("C2"_pos), CellInterface::Value(3.0 * edits));
+        }
+    }
+
+    void TestRangeFunctions() {
+        auto reformat = [](std::string expr) {
+            return ParseFormula(std::move(expr))->GetExpression();
+        };
+        auto is_incorrect = [](std::string expr) {
+            try {
+                ParseFormula(std::move(expr));
+            }
+            catch (const FormulaException&) {
+                return true;
+            }
+            return false;
+        };
+        ASSERT_EQUAL(reformat("SUM( B3:A1 , 2*(C1) )"), "SUM(A1:B3,2*C1)");
+        ASSERT_EQUAL(reformat("MAX(A1)+-COUNT(A1+1,B2:B2)"), "MAX(A1)+-COUNT(A1+1,B2)");
+        ASSERT_EQUAL(reformat("AVERAGE(MIN(1,2),A1:A2)"), "AVERAGE(MIN(1,2),A1:A2)");
+        ASSERT(is_incorrect("SUM((A1:A2))"));
+        ASSERT(is_incorrect("SUM()"));
+        ASSERT(is_incorrect("SUM(A1:)"));
+        ASSERT(is_incorrect("SUM(A1:B2+1)"));
+        ASSERT(is_incorrect("SUM(1:2)"));
+        ASSERT(is_incorrect("SUM A1"));
+        ASSERT(is_incorrect("SUMA(1)"));
+        ASSERT(is_incorrect("A1:B2"));
+        ASSERT(is_incorrect("SUM(A1:XFE1)"));
+        {
+            auto formula = ParseFormula("SUM(B2:A1,A1,C3)");
+            const std::vector<Position> expected = { "A1"_pos, "B1"_pos, "A2"_pos, "B2"_pos, "C3"_pos };
+            ASSERT(formula->GetReferencedCells() == expected);
+        }
+
+        // пустые ячейки и нечисловой текст пропускаются, ошибки формул передаются дальше
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "2");
+        sheet.SetCell("A3"_pos, "abc");
+        sheet.SetCell("A5"_pos, "=A1*10");
+        auto value = [&sheet](std::string text) {
+            sheet.SetCell("H1"_pos, std::move(text));
+            return sheet.GetCell("H1"_pos)->GetValue();
+        };
+        ASSERT_EQUAL(value("=SUM(A1:A5)"), CellInterface::Value(13.0));
+        ASSERT_EQUAL(value("=COUNT(A1:A5)"), CellInterface::Value(3.0));
+        ASSERT_EQUAL(value("=AVERAGE(A5:A1)"), CellInterface::Value(13.0 / 3));
+        ASSERT_EQUAL(value("=MIN(A1:A5)"), CellInterface::Value(1.0));
+        ASSERT_EQUAL(value("=MAX(A1:A5,-1)"), CellInterface::Value(10.0));
+        ASSERT_EQUAL(value("=SUM(A1:A5,100,A3)"), CellInterface::Value(113.0));
+        ASSERT_EQUAL(value("=AVERAGE(A1:A2,A2*3)"), CellInterface::Value(3.0));
+        ASSERT_EQUAL(value("=COUNT(A1,A3,A4,7)"), CellInterface::Value(2.0));
+        ASSERT_EQUAL(value("=SUM(A3+1)"), CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(value("=MIN(C1:C3)+MAX(C1:C3)+COUNT(C1:C3)"), CellInterface::Value(0.0));
+        ASSERT_EQUAL(value("=AVERAGE(C1:C3)"), CellInterface::Value(FormulaError::Category::Arithmetic));
+        sheet.SetCell("A6"_pos, "=1/0");
+        ASSERT_EQUAL(value("=COUNT(A1:A6)"), CellInterface::Value(FormulaError::Category::Arithmetic));
+
+        // правка внутри диапазона сбрасывает кэш, диапазон, замыкающий цикл, отвергается
+        ASSERT_EQUAL(value("=SUM(A1:A5)"), CellInterface::Value(13.0));
+        sheet.SetCell("A4"_pos, "=A2*5");
+        ASSERT_EQUAL(sheet.GetCell("H1"_pos)->GetValue(), CellInterface::Value(23.0));
+        try {
+            sheet.SetCell("A4"_pos, "=MAX(H1:H2)");
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+
+        // диапазоны в общей формуле сдвигаются вместе с ячейкой
+        for (int row = 0; row < 1000; ++row) {
+            sheet.SetCell(Position{ row, 3 }, std::to_string(row + 1));
+            sheet.SetCell(Position{ row, 4 }, "=SUM(D1:D" + std::to_string(row + 1) + ")");
+        }
+        const size_t shapes = sheet.GetFormulaPool().GetSize();
+        for (int row = 0; row < 999; ++row) {
+            sheet.SetCell(Position{ row, 5 }, "=SUM(D" + std::to_string(row + 1) + ":D" + std::to_string(row + 2) + ")");
+        }
+        ASSERT_EQUAL(sheet.GetFormulaPool().GetSize(), shapes + 1);
+        ASSERT_EQUAL(sheet.GetValue(Position{ 998, 5 }), CellInterface::Value(1999.0));
+        ASSERT_EQUAL(sheet.GetValue(Position{ 999, 4 }), CellInterface::Value(500500.0));
+        ASSERT_EQUAL(value("=MAX(D1:D1000)-MIN(D1:D1000)+AVERAGE(D2:D1000)"), CellInterface::Value(999.0 + 501));
+
+        std::stringstream snapshot;
+        sheet.SaveSnapshot(snapshot);
+        Sheet restored;
+        restored.LoadSnapshot(snapshot);
+        std::ostringstream expected_values, restored_values, expected_texts, restored_texts;
+        sheet.PrintValues(expected_values);
+        restored.PrintValues(restored_values);
+        sheet.PrintTexts(expected_texts);
+        restored.PrintTexts(restored_texts);
+        ASSERT_EQUAL(expected_values.str(), restored_values.str());
+        ASSERT_EQUAL(expected_texts.str(), restored_texts.str());
+
+        // векторные ядра совпадают с простым циклом на хвостах любой длины
+        std::vector<double> numbers;
+        for (int count = 0; count < 11; ++count) {
+            double sum = 0;
+            for (double number : numbers) {
+                sum += number;
+            }
+            ASSERT_EQUAL(SumKernel(numbers.data(), numbers.size()), sum);
+            if (!numbers.empty()) {
+                ASSERT_EQUAL(MinKernel(numbers.data(), numbers.size()), *std::min_element(numbers.begin(), numbers.end()));
+                ASSERT_EQUAL(MaxKernel(numbers.data(), numbers.size()), *std::max_element(numbers.begin(), numbers.end()));
+            }
+            numbers.push_back(count % 3 == 0 ? -count * 1.5 : count * 0.25);
+        }
+        ASSERT(MinKernel(nullptr, 0) > 0 && MaxKernel(nullptr, 0) < 0);
+    }
+
+    void TestRangeDependencies() {
+        auto is_circular = [](Sheet& sheet, Position pos, std::string text) {
+            try {
+                sheet.SetCell(pos, std::move(text));
+            }
+            catch (const CircularDependencyException&) {
+                return true;
+            }
+            return false;
+        };
+
+        // ячейки диапазона не создаются и не получают рёбер
+        Sheet sheet;
+        sheet.SetCell("B1"_pos, "=SUM(A1:A16000)");
+        ASSERT(sheet.GetCell("A1"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 2 }));
+        ASSERT_EQUAL(sheet.GetValue("B1"_pos), CellInterface::Value(0.0));
+        sheet.SetCell("A8000"_pos, "7");
+        ASSERT_EQUAL(sheet.GetValue("B1"_pos), CellInterface::Value(7.0));
+        sheet.SetCell("C1"_pos, "5");
+        sheet.SetCell("A2"_pos, "=C1*2");
+        ASSERT_EQUAL(sheet.GetValue("B1"_pos), CellInterface::Value(17.0));
+        sheet.SetCell("C1"_pos, "1");
+        ASSERT_EQUAL(sheet.GetValue("B1"_pos), CellInterface::Value(9.0));
+        sheet.ClearCell("A8000"_pos);
+        ASSERT_EQUAL(sheet.GetValue("B1"_pos), CellInterface::Value(2.0));
+
+        // цикл через диапазон: прямой, через зависимую ячейку и через второй диапазон
+        ASSERT(is_circular(sheet, "B1"_pos, "=SUM(B1:B2)"));
+        ASSERT(is_circular(sheet, "A3"_pos, "=B1"));
+        sheet.SetCell("D1"_pos, "=B1+1");
+        ASSERT(is_circular(sheet, "A4"_pos, "=MAX(D1:E1)"));
+        ASSERT(is_circular(sheet, "C1"_pos, "=D1"));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "1");
+        ASSERT_EQUAL(sheet.GetValue("D1"_pos), CellInterface::Value(3.0));
+        // отвергнутая правка вернула старый диапазон, а заменённая формула его сняла
+        sheet.SetCell("A8000"_pos, "10");
+        ASSERT_EQUAL(sheet.GetValue("D1"_pos), CellInterface::Value(13.0));
+        sheet.SetCell("B1"_pos, "=SUM(C1:C2)");
+        sheet.SetCell("A3"_pos, "=B1");
+        ASSERT_EQUAL(sheet.GetValue("A3"_pos), CellInterface::Value(1.0));
+
+        // пакет и снимок связывают диапазоны одним проходом и находят циклы через них
+        try {
+            sheet.SetCells({ { "C2"_pos, "=F1" }, { "F1"_pos, "=COUNT(A1:A3)" } });
+            ASSERT(false);
+        }
+        catch (const CircularDependencyException&) {
+        }
+        ASSERT(sheet.GetCell("F1"_pos) == nullptr);
+        sheet.SetCells({ { "C2"_pos, "=F1" }, { "F1"_pos, "=COUNT(A1:A2)" } });
+        ASSERT_EQUAL(sheet.GetValue("A3"_pos), CellInterface::Value(2.0));
+        std::stringstream snapshot;
+        sheet.SaveSnapshot(snapshot);
+        Sheet restored;
+        restored.LoadSnapshot(snapshot);
+        ASSERT(is_circular(restored, "A1"_pos, "=A3"));
+        restored.SetCell("A1"_pos, "=C1");
+        ASSERT_EQUAL(restored.GetValue("A3"_pos), CellInterface::Value(3.0));
+
+        // освобождённые узлы графа не считаются ячейками A1 при перестройке порядка в Commit()
+        // (снимок строит граф заново, свободных узлов в нём нет)
+        Sheet freed;
+        freed.SetCell("B1"_pos, "=C1+C2+C3+C4+C5+C6+C7+C8");
+        freed.ClearCell("B1"_pos);
+        freed.SetCell("D1"_pos, "=SUM(A1:A3)");
+        freed.SetCell("A2"_pos, "=E1+1");
+        freed.SetCells({ { "A1"_pos, "=5" }, { "E1"_pos, "2" }, { "F1"_pos, "=D1*2" } });
+        ASSERT_EQUAL(freed.GetValue("F1"_pos), CellInterface::Value(16.0));
+        ASSERT(is_circular(freed, "A3"_pos, "=F1"));
+        ASSERT(is_circular(freed, "E1"_pos, "=D1"));
+        freed.SetCell("E1"_pos, "10");
+        ASSERT_EQUAL(freed.GetValue("F1"_pos), CellInterface::Value(32.0));
+        freed.SetCells({ { "A3"_pos, "=E1*2" }, { "A1"_pos, "=E1" } });
+        ASSERT_EQUAL(freed.GetValue("F1"_pos), CellInterface::Value(82.0));
+        std::stringstream freed_snapshot;
+        freed.SaveSnapshot(freed_snapshot);
+        Sheet freed_restored;
+        freed_restored.LoadSnapshot(freed_snapshot);
+        ASSERT_EQUAL(freed_restored.GetValue("F1"_pos), CellInterface::Value(82.0));
+        ASSERT(is_circular(freed_restored, "E1"_pos, "=F1"));
+
+        // уровни пересчёта учитывают диапазоны: сумма считается после своих ячеек
+        Sheet levels;
+        for (int row = 0; row < 100; ++row) {
+            levels.SetCell(Position{ row, 0 }, "=" + std::to_string(row) + "+0");
+        }
+        levels.SetCell("B1"_pos, "=SUM(A1:A100)");
+        levels.SetCell("C1"_pos, "=B1*2");
+        ASSERT_EQUAL(levels.RecalculateDirty(), 102u);
+        ASSERT_EQUAL(levels.GetValue("C1"_pos), CellInterface::Value(9900.0));
+        levels.SetCell("A50"_pos, "=1000");
+        ASSERT_EQUAL(levels.RecalculateDirty(), 3u);
+        ASSERT_EQUAL(levels.GetValue("C1"_pos), CellInterface::Value(9900.0 + 2 * (1000 - 49)));
+    }
+
+    void TestValueColumns() {
+        Sheet sheet;
+        sheet.SetCell("B1"_pos, "4");
+        sheet.SetCell("B2"_pos, "abc");
+        sheet.SetCell("B3"_pos, "=B1*2");
+        sheet.SetCell("B4"_pos, "=1/0");
+        sheet.SetCell("B6"_pos, "'7");
+        sheet.SetCell("B300"_pos, "2.5");
+        {
+            // числа подряд, в пустых местах нули; нечисловой текст и пустые ячейки — не числа
+            const ValueSpan span = sheet.GetValueSpan("B10"_pos);
+            ASSERT_EQUAL(span.GetFirstRow(), 0);
+            ASSERT_EQUAL(span.GetValues()[0], 4.0);
+            ASSERT_EQUAL(span.GetValues()[1], 0.0);
+            ASSERT_EQUAL(span.GetValues()[2], 8.0);
+            ASSERT(span.IsNumber(0) && !span.IsNumber(1) && span.IsNumber(2) && !span.IsNumber(4));
+            ASSERT(span.IsError(3) && span.GetError(3) == FormulaError::Category::Arithmetic);
+            ASSERT(span.IsNumber(5) && span.GetValues()[5] == 7.0);
+        ASSERT_EQUAL(span.CountNumbers(0, ValueSpan::SIZE), 3u);
+            ASSERT_EQUAL(span.FindError(0, ValueSpan::SIZE), 3);
+            ASSERT_EQUAL(span.FindError(4, ValueSpan::SIZE), ValueSpan::SIZE);
+            ASSERT(span.AllNumbers(0, 1) && !span.AllNumbers(0, 2));
+            const ValueSpan next = sheet.GetValueSpan("B300"_pos);
+            ASSERT_EQUAL(next.GetFirstRow(), ValueSpan::SIZE);
+            ASSERT_EQUAL(next.GetValues()[299 - ValueSpan::SIZE], 2.5);
+        }
+        // правка ячейки и сброс кэша зависимой формулы обновляют сегмент
+        sheet.SetCell("B1"_pos, "5");
+        ASSERT_EQUAL(sheet.GetValueSpan("B1"_pos).GetValues()[2], 10.0);
+        sheet.BeginBatch();
+        sheet.SetCell("B1"_pos, "6");
+        sheet.ClearCell("B4"_pos);
+        sheet.Rollback();
+        ASSERT_EQUAL(sheet.GetValueSpan("B1"_pos).GetValues()[0], 5.0);
+        ASSERT(sheet.GetValueSpan("B1"_pos).IsError(3));
+        sheet.ClearCell("B4"_pos);
+        ASSERT_EQUAL(sheet.GetValueSpan("B1"_pos).FindError(0, ValueSpan::SIZE), ValueSpan::SIZE);
+
+        // формула в том же сегменте за пределами диапазона зависит от суммы: сегмент
+        // не кэшируется, пока она не вычислена, и рекурсии нет
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "2");
+        sheet.SetCell("A20"_pos, "=A30+1");
+        sheet.SetCell("A30"_pos, "=SUM(A1:A2)");
+        ASSERT_EQUAL(sheet.GetValue("A20"_pos), CellInterface::Value(4.0));
+        sheet.SetCell("A2"_pos, "5");
+        ASSERT_EQUAL(sheet.GetValue("A30"_pos), CellInterface::Value(6.0));
+        ASSERT_EQUAL(sheet.GetValue("A20"_pos), CellInterface::Value(7.0));
+
+        // по столбцам читается первая ошибка в построчном порядке
+        sheet.SetCell("D1"_pos, "=1/0");
+        sheet.SetCell("C2"_pos, "=B2");
+        sheet.SetCell("E1"_pos, "=SUM(C1:D2)");
+        ASSERT_EQUAL(sheet.GetValue("E1"_pos), CellInterface::Value(FormulaError::Category::Arithmetic));
+        sheet.SetCell("C1"_pos, "=B2+1");
+        ASSERT_EQUAL(sheet.GetValue("E1"_pos), CellInterface::Value(FormulaError::Category::Value));
+
+        // диапазоны, которые читают несколько потоков сразу, строят сегменты один раз
+        Sheet shared;
+        for (int row = 0; row < 2000; ++row) {
+            shared.SetCell(Position{ row, 0 }, row % 10 == 0 ? "=" + std::to_string(row) : std::to_string(row));
+        }
+        for (int row = 0; row < 8; ++row) {
+            shared.SetCell(Position{ row, 2 }, "=SUM(A1:A" + std::to_string(1000 + row * 100) + ")");
+        }
+        std::vector<std::thread> readers;
+        std::atomic<bool> correct{ true };
+        for (int reader = 0; reader < 4; ++reader) {
+            readers.emplace_back([&shared, &correct, reader] {
+                for (int i = 0; i < 8; ++i) {
+                    const int row = (reader + i) % 8;
+                    const double rows = 1000 + row * 100;
+                    if (!(shared.GetValue(Position{ row, 2 }) == CellInterface::Value(rows * (rows - 1) / 2))) {
+                        correct = false;
+                    }
+                }
+            });
+        }
+        for (std::thread& reader : readers) {
+            reader.join();
+        }
+        ASSERT(correct);
+    }
+
+    void TestBufferedPrint() {
+        // построчный вывод по всем позициям через operator<<, как печатал лист раньше
+        auto reference = [](const Sheet& sheet, std::ostream& output, bool values) {
+            const Size size = sheet.GetPrintableSize();
+            for (int row = 0; row < size.rows; ++row) {
+                for (int col = 0; col < size.cols; ++col) {
+                    if (const CellInterface* cell = sheet.GetCell({ row, col })) {
+                        if (!values) {
+                            output << cell->GetText();
+                        }
+                        else {
+                            std::visit([&output](const auto& value) {
+                                output << value;
+                            }, cell->GetValue());
+                        }
+                    }
+                    if (col + 1 < size.cols) {
+                        output << '\t';
+                    }
+                }
+                output << '\n';
+            }
+        };
+        auto check = [&reference](const Sheet& sheet, const std::function<void(std::ostream&)>& setup) {
+            for (bool values : { false, true }) {
+                std::ostringstream expected, actual;
+                setup(expected);
+                setup(actual);
+                reference(sheet, expected, values);
+                if (values) {
+                    sheet.PrintValues(actual);
+                }
+                else {
+                    sheet.PrintTexts(actual);
+                }
+                ASSERT_EQUAL(actual.str(), expected.str());
+            }
+        };
+
+        Sheet sheet;
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 0, 0 }));
+        check(sheet, [](std::ostream&) {});
+        const std::vector<std::string> texts = { "=1/3", "=1e20*3", "=0.1+0.2", "=-0.000012345678", "=123456789",
+            "=-1/0", "12.50", "'=1", "text", "=A1+B1*2", "=ZZ1", "=2/3*1e-300" };
+        for (size_t i = 0; i < texts.size(); ++i) {
+            sheet.SetCell(Position{ static_cast<int>(i) * 3, static_cast<int>(i % 5) * 2 }, texts[i]);
+        }
+        sheet.SetCell("B40"_pos, "=1");
+        check(sheet, [](std::ostream&) {});
+        check(sheet, [](std::ostream& os) { os.precision(12); });
+        check(sheet, [](std::ostream& os) { os << std::fixed; });
+        check(sheet, [](std::ostream& os) { os << std::scientific << std::uppercase; });
+        check(sheet, [](std::ostream& os) { os.width(8); });
+
+        // вывод больше одного блока буфера и длинные пустые промежутки
+        Sheet sparse;
+        for (int row = 0; row < 5000; row += 7) {
+            sparse.SetCell(Position{ row, (row * 31) % 900 }, "=" + std::to_string(row) + "/7");
+        }
+        check(sparse, [](std::ostream&) {});
+    }
+
+    void TestWindowPrint() {
+        Sheet sheet;
+        // цепочка в столбце A, в C формулы от неё, в D текст на каждой десятой строке
+        sheet.SetCell("A1"_pos, "1");
+        for (int row = 1; row < 1000; ++row) {
+            sheet.SetCell(Position{ row, 0 }, "=A" + std::to_string(row) + "+1");
+        }
+        for (int row = 0; row < 1000; ++row) {
+            sheet.SetCell(Position{ row, 2 }, "=A" + std::to_string(row + 1) + "*2");
+            if (row % 10 == 0) {
+                sheet.SetCell(Position{ row, 3 }, "t" + std::to_string(row));
+            }
+        }
+        auto needs_evaluation = [&sheet](Position pos) {
+            return static_cast<const Cell*>(sheet.GetCell(pos))->NeedsEvaluation();
+        };
+
+        // окно C500:E511, столбец E пустой
+        const Position top_left = "C500"_pos;
+        const Size size{ 12, 3 };
+        std::string expected_values, expected_texts;
+        for (int row = top_left.row; row < top_left.row + size.rows; ++row) {
+            expected_values += std::to_string((row + 1) * 2) + "\t";
+            expected_texts += "=A" + std::to_string(row + 1) + "*2\t";
+            if (row % 10 == 0) {
+                expected_values += "t" + std::to_string(row);
+                expected_texts += "t" + std::to_string(row);
+            }
+            expected_values += "\t\n";
+            expected_texts += "\t\n";
+        }
+        std::ostringstream texts;
+        sheet.PrintTexts(texts, top_left, size);
+        ASSERT_EQUAL(texts.str(), expected_texts);
+        ASSERT(needs_evaluation("C505"_pos));
+        std::ostringstream values;
+        sheet.PrintValues(values, top_left, size);
+        ASSERT_EQUAL(values.str(), expected_values);
+        // вычислены окно и то, от чего оно зависит, и ничего сверх этого
+        ASSERT(!needs_evaluation("C511"_pos));
+        ASSERT(!needs_evaluation("A1"_pos));
+        ASSERT(!needs_evaluation("A511"_pos));
+        ASSERT(needs_evaluation("A512"_pos));
+        ASSERT(needs_evaluation("C499"_pos));
+        ASSERT(needs_evaluation("C512"_pos));
+
+        const std::vector<CellInterface::Value> window = sheet.GetValues("B600"_pos, Size{ 3, 3 });
+        ASSERT_EQUAL(window.size(), 9u);
+        for (int row = 0; row < 3; ++row) {
+            for (int col = 0; col < 3; ++col) {
+                const Position pos{ 599 + row, 1 + col };
+                ASSERT(window[row * 3 + col] == sheet.GetValue(pos));
+            }
+        }
+        ASSERT(window[3 * 0 + 1] == CellInterface::Value{ 1200.0 });
+        ASSERT(window[3 * 1 + 2] == CellInterface::Value{ std::string("t600") });
+        ASSERT(needs_evaluation("C700"_pos));
+
+        // окно за пределами заполненной части печатается пустыми полями
+        std::ostringstream blank;
+        sheet.PrintValues(blank, Position{ 5000, 100 }, Size{ 2, 3 });
+        ASSERT_EQUAL(blank.str(), "\t\t\n\t\t\n");
+        std::ostringstream empty;
+        sheet.PrintTexts(empty, "A1"_pos, Size{ 0, 5 });
+        ASSERT_EQUAL(empty.str(), "");
+        ASSERT(sheet.GetValues("A1"_pos, Size{ 4, 0 }).empty());
+
+        // окно должно помещаться в лист
+        auto rejects = [&sheet](Position pos, Size window_size) {
+            try {
+                std::ostringstream output;
+                sheet.PrintValues(output, pos, window_size);
+            }
+            catch (const InvalidPositionException&) {
+                return true;
+            }
+            return false;
+        };
+        ASSERT(rejects(Position{ -1, 0 }, Size{ 1, 1 }));
+        ASSERT(rejects("A1"_pos, Size{ -1, 1 }));
+        ASSERT(rejects(Position{ Position::MAX_ROWS - 1, 0 }, Size{ 2, 1 }));
+        ASSERT(rejects(Position{ 0, 1 }, Size{ 1, Position::MAX_COLS }));
+        ASSERT(!rejects(Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 }, Size{ 1, 1 }));
+    }
+
+    void TestPositionKeys() {
+        const std::vector<Position> corners = { { 0, 0 }, { 0, Position::MAX_COLS - 1 }, { 1, 0 },
+            { Position::MAX_ROWS - 1, 0 }, { Position::MAX_ROWS - 1, Position::MAX_COLS - 1 } };
+        for (size_t i = 0; i < corners.size(); ++i) {
+            ASSERT_EQUAL(Position::FromKey(corners[i].ToKey()), corners[i]);
+            if (i > 0) {
+                // ключи упорядочены так же, как позиции
+                ASSERT(corners[i - 1] < corners[i]);
+                ASSERT(corners[i - 1].ToKey() < corners[i].ToKey());
+            }
+        }
+        ASSERT_EQUAL((Position{ 0, 0 }.ToKey()), 0u);
+        ASSERT_EQUAL((Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 }.ToKey()), (1u << 28) - 1);
+
+        // строгий слабый порядок: раньше B1 < A2 и A2 < B1 были верны одновременно
+        ASSERT("B1"_pos < "A2"_pos);
+        ASSERT(!("A2"_pos < "B1"_pos));
+        ASSERT(!("B2"_pos < "B2"_pos));
+        std::vector<Position> shuffled;
+        for (int i = 0; i < 500; ++i) {
+            shuffled.push_back({ (i * 37) % 23 - 5, (i * 53) % 19 - 7 });
+        }
+        std::sort(shuffled.begin(), shuffled.end());
+        for (size_t i = 1; i < shuffled.size(); ++i) {
+            const Position lhs = shuffled[i - 1];
+            const Position rhs = shuffled[i];
+            ASSERT(lhs.row < rhs.row || (lhs.row == rhs.row && lhs.col <= rhs.col));
+        }
+
+        // соседние позиции и смещения с отрицательными полями расходятся по хэшу
+        PositionHash hash;
+        std::unordered_set<size_t> hashes;
+        for (int row = -20; row < 20; ++row) {
+            for (int col = -20; col < 20; ++col) {
+                hashes.insert(hash(Position{ row, col }));
+            }
+        }
+        ASSERT_EQUAL(hashes.size(), 1600u);
+        ASSERT(hash("A2"_pos) != hash("B1"_pos));
+
+        // ссылки формулы идут в построчном порядке и без повторов
+        auto formula = ParseFormula("B1+A2+SUM(A1:B2)+A1");
+        ASSERT_EQUAL(formula->GetReferencedCells(), (std::vector<Position>{ "A1"_pos, "B1"_pos, "A2"_pos, "B2"_pos }));
+    }
+
+    void TestPositionCodec() {
+        // разбор работает при компиляции
+        static_assert("A1"_pos == Position{ 0, 0 });
+        static_assert("AB12"_pos == Position{ 11, 27 });
+        static_assert("XFD16384"_pos == Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 });
+        static_assert(Position::FromString("XFE1") == Position{ -1, -1 });
+
+        // все столбцы от A до XFD, с номерами строк разной длины, туда и обратно
+        char buffer[Position::MAX_STRING_LENGTH];
+        for (int col = 0; col < Position::MAX_COLS; ++col) {
+            for (int row : { 0, 9, 99, 999, 9999, Position::MAX_ROWS - 1 }) {
+                const Position pos{ row, col };
+                const auto [end, error] = pos.ToChars(buffer, buffer + sizeof(buffer));
+                ASSERT(error == std::errc{});
+                const std::string_view text(buffer, end - buffer);
+                ASSERT_EQUAL(pos.ToString(), text);
+                ASSERT_EQUAL(Position::FromString(text), pos);
+            }
+        }
+
+        // места не хватило или позиция недопустима
+        const auto short_buffer = "AA100"_pos.ToChars(buffer, buffer + 4);
+        ASSERT(short_buffer.ec == std::errc::value_too_large && short_buffer.ptr == buffer + 4);
+        const auto one_letter = "AA1"_pos.ToChars(buffer, buffer + 1);
+        ASSERT(one_letter.ec == std::errc::value_too_large && one_letter.ptr == buffer + 1);
+        const auto invalid = Position::NONE.ToChars(buffer, buffer + sizeof(buffer));
+        ASSERT(invalid.ec == std::errc::invalid_argument && invalid.ptr == buffer);
+
+        // номер за пределами листа отвергается до переполнения
+        for (std::string_view text : { "A16385", "A99999999", "ZZZZZZZ1", "XFE1", "AAAA1", "a1", "A1B", "$A$1", "A 1" }) {
+            ASSERT(!Position::FromString(text).IsValid());
+        }
+        // ведущие нули допускались и раньше
+        ASSERT_EQUAL(Position::FromString("B007"), "B7"_pos);
+    }
+
+    void TestBatchInvalidation() {
+        auto throws_logic_error = [](const std::function<void()>& call) {
+            try {
+                call();
+            }
+            catch (const std::logic_error&) {
+                return true;
+            }
+            return false;
+        };
+
+        // значения внутри пакета не читаются, и после отката видно прежнее состояние
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1+1");
+        sheet.SetCell("C1"_pos, "=B1*2");
+        sheet.BeginBatch();
+        sheet.SetCell("A1"_pos, "10");
+        ASSERT(throws_logic_error([&sheet] { sheet.GetCell("B1"_pos)->GetValue(); }));
+        sheet.Rollback();
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+        ASSERT_EQUAL(sheet.GetValue("B1"_pos), CellInterface::Value{ 2.0 });
+        ASSERT_EQUAL(sheet.GetValue("C1"_pos), CellInterface::Value{ 4.0 });
+
+        // при фиксации сбрасывается и кэш самих изменённых ячеек
+        sheet.BeginBatch();
+        sheet.SetCell("B1"_pos, "=A1+3");
+        sheet.SetCell("A1"_pos, "5");
+        sheet.Commit();
+        ASSERT_EQUAL(sheet.GetValue("B1"_pos), CellInterface::Value{ 8.0 });
+        ASSERT_EQUAL(sheet.GetValue("C1"_pos), CellInterface::Value{ 16.0 });
+
+        // формулы пакета без кэша не вычисляются по его промежуточному состоянию
+        Sheet fresh;
+        fresh.BeginBatch();
+        fresh.SetCell("A1"_pos, "=B1+1");
+        fresh.SetCell("B1"_pos, "=2");
+        std::ostringstream printed;
+        ASSERT(throws_logic_error([&fresh, &printed] { fresh.PrintValues(printed); }));
+        fresh.Commit();
+        fresh.PrintValues(printed);
+        ASSERT_EQUAL(printed.str(), "3\t2\n");
+
+        // пересчёт и загрузка снимка внутри пакета отвергаются
+        sheet.BeginBatch();
+        ASSERT(throws_logic_error([&sheet] { sheet.RecalculateDirty(); }));
+        ASSERT(throws_logic_error([&sheet] { sheet.RecalculateAll(); }));
+        std::istringstream snapshot("");
+        ASSERT(throws_logic_error([&sheet, &snapshot] { sheet.LoadSnapshot(snapshot); }));
+        sheet.Rollback();
+        ASSERT_EQUAL(sheet.GetValue("C1"_pos), CellInterface::Value{ 16.0 });
+    }
+
+    void TestRangeIndex() {
+        // случайные прямоугольники, в том числе во всю строку и во весь лист, сверяются с перебором
+        struct Rect {
+            Position top_left;
+            Size size;
+        };
+        std::vector<Rect> rects;
+        unsigned seed = 777;
+        auto next_random = [&seed](int bound) {
+            seed = seed * 1103515245 + 12345;
+            return static_cast<int>((seed >> 8) % bound);
+        };
+        for (int i = 0; i < 300; ++i) {
+            const int row = next_random(Position::MAX_ROWS);
+            const int col = next_random(Position::MAX_COLS);
+            const int rows = 1 + next_random(i % 3 == 0 ? Position::MAX_ROWS - row : std::min(50, Position::MAX_ROWS - row));
+            const int cols = 1 + next_random(i % 3 == 1 ? Position::MAX_COLS - col : std::min(50, Position::MAX_COLS - col));
+            rects.push_back({ { row, col }, { rows, cols } });
+        }
+        rects.push_back({ { 5, 0 }, { 1, Position::MAX_COLS } });
+        rects.push_back({ { 0, 0 }, { Position::MAX_ROWS, Position::MAX_COLS } });
+
+        RangeIndex index;
+        for (uint32_t id = 0; id < rects.size(); ++id) {
+            index.Insert(id, rects[id].top_left, rects[id].size);
+        }
+        std::vector<bool> present(rects.size(), true);
+        auto check = [&](Position pos) {
+            std::vector<uint32_t> found;
+            index.ForEachContaining(pos, [&found](uint32_t id) {
+                found.push_back(id);
+            });
+            std::sort(found.begin(), found.end());
+            std::vector<uint32_t> expected;
+            for (uint32_t id = 0; id < rects.size(); ++id) {
+                const Rect& rect = rects[id];
+                if (present[id] && pos.row >= rect.top_left.row && pos.row < rect.top_left.row + rect.size.rows
+                    && pos.col >= rect.top_left.col && pos.col < rect.top_left.col + rect.size.cols) {
+                    expected.push_back(id);
+                }
+            }
+            ASSERT(found == expected);
+        };
+        auto check_all = [&]() {
+            for (int i = 0; i < 2000; ++i) {
+                check({ next_random(Position::MAX_ROWS), next_random(Position::MAX_COLS) });
+            }
+            for (const Rect& rect : rects) {
+                check(rect.top_left);
+                check({ rect.top_left.row + rect.size.rows - 1, rect.top_left.col + rect.size.cols - 1 });
+            }
+            check({ 5, Position::MAX_COLS - 1 });
+        };
+        check_all();
+        for (uint32_t id = 0; id < rects.size(); id += 2) {
+            index.Erase(id, rects[id].top_left, rects[id].size);
+            present[id] = false;
+        }
+        ASSERT_EQUAL(index.GetSize(), rects.size() / 2);
+        check_all();
+        for (uint32_t id = 1; id < rects.size(); id += 2) {
+            index.Erase(id, rects[id].top_left, rects[id].size);
+        }
+        ASSERT(index.Empty());
+        int reported = 0;
+        index.ForEachContaining({ 5, 5 }, [&reported](uint32_t) {
+            ++reported;
+        });
+        ASSERT_EQUAL(reported, 0);
+    }
 }  // namespace
 
 int main() {
@@ -458,4 +1886,28 @@ int main() {
     RUN_TEST(tr, TestForwardErrors); //OK
     RUN_TEST(tr, TestClearPrint); //OK
     RUN_TEST(tr, TestExample); //OK
+    RUN_TEST(tr, TestTiledStorage);
+    RUN_TEST(tr, TestPrintableSizeTracking);
+    RUN_TEST(tr, TestDependencyUpdates);
+    RUN_TEST(tr, TestInvalidationPass);
+    RUN_TEST(tr, TestIncrementalCycleDetection);
+    RUN_TEST(tr, TestEvaluationContext);
+    RUN_TEST(tr, TestNumericTextCells);
+    RUN_TEST(tr, TestFormulaParser);
+    RUN_TEST(tr, TestFormulaSharing);
+    RUN_TEST(tr, TestBatchUpdates);
+    RUN_TEST(tr, TestLoadTexts);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestRecalculate);
+    RUN_TEST(tr, TestBackgroundRecalc);
+    RUN_TEST(tr, TestConcurrentReaders);
+    RUN_TEST(tr, TestRangeFunctions);
+    RUN_TEST(tr, TestRangeDependencies);
+    RUN_TEST(tr, TestValueColumns);
+    RUN_TEST(tr, TestBufferedPrint);
+    RUN_TEST(tr, TestWindowPrint);
+    RUN_TEST(tr, TestPositionKeys);
+    RUN_TEST(tr, TestPositionCodec);
+    RUN_TEST(tr, TestBatchInvalidation);
+    RUN_TEST(tr, TestRangeIndex);
 }
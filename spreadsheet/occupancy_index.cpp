@@ -0,0 +1,91 @@
+#include "occupancy_index.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace {
+	int HighestBit(uint64_t word) {
+		assert(word != 0);
+#if defined(__GNUC__) || defined(__clang__)
+		return 63 - __builtin_clzll(word);
+#else
+		int bit = 0;
+		while (word >>= 1) {
+			++bit;
+		}
+		return bit;
+#endif
+	}
+}// namespace
+
+OccupancyIndex::Axis::Axis(int size)
+	: counts_(size, 0)
+{
+}
+
+void OccupancyIndex::Axis::Increment(int index) {
+	if (counts_[index]++ == 0) {
+		const int word = index / WORD_BITS;
+		used_[word] |= uint64_t{ 1 } << (index % WORD_BITS);
+		summary_[word / WORD_BITS] |= uint64_t{ 1 } << (word % WORD_BITS);
+	}
+}
+
+void OccupancyIndex::Axis::Decrement(int index) {
+	assert(counts_[index] > 0);
+	if (--counts_[index] == 0) {
+		const int word = index / WORD_BITS;
+		used_[word] &= ~(uint64_t{ 1 } << (index % WORD_BITS));
+		if (used_[word] == 0) {
+			summary_[word / WORD_BITS] &= ~(uint64_t{ 1 } << (word % WORD_BITS));
+		}
+	}
+}
+
+void OccupancyIndex::Axis::Clear() {
+	std::fill(counts_.begin(), counts_.end(), 0);
+	used_.fill(0);
+	summary_.fill(0);
+}
+
+int OccupancyIndex::Axis::GetLast() const {
+	for (int s = MAX_SUMMARY - 1; s >= 0; --s) {
+		if (summary_[s] != 0) {
+			const int word = s * WORD_BITS + HighestBit(summary_[s]);
+			return word * WORD_BITS + HighestBit(used_[word]);
+		}
+	}
+	return -1;
+}
+
+OccupancyIndex::OccupancyIndex()
+	: rows_(Position::MAX_ROWS), cols_(Position::MAX_COLS)
+{
+}
+
+void OccupancyIndex::Add(Position pos) {
+	rows_.Increment(pos.row);
+	cols_.Increment(pos.col);
+}
+
+void OccupancyIndex::Remove(Position pos) {
+	rows_.Decrement(pos.row);
+	cols_.Decrement(pos.col);
+}
+
+void OccupancyIndex::Clear() {
+	rows_.Clear();
+	cols_.Clear();
+}
+
+int OccupancyIndex::GetLastUsedRow() const {
+	return rows_.GetLast();
+}
+
+int OccupancyIndex::GetLastUsedCol() const {
+	return cols_.GetLast();
+}
+
+Size OccupancyIndex::GetPrintableSize() const {
+	return { GetLastUsedRow() + 1, GetLastUsedCol() + 1 };
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+// Counts populated cells per row and per column.
+// A non-zero counter sets a bit in a two-level bitmap (one bit per line, one summary bit per
+// 64 lines), so the last used row/column is found by scanning at most a handful of words.
+// Add/Remove and all queries are O(1).
+class OccupancyIndex {
+public:
+	OccupancyIndex();
+
+	void Add(Position pos);
+	void Remove(Position pos);
+	void Clear();
+
+	// -1 when the sheet is empty
+	int GetLastUsedRow() const;
+	int GetLastUsedCol() const;
+
+	Size GetPrintableSize() const;
+
+private:
+	class Axis {
+	public:
+		explicit Axis(int size);
+
+		void Increment(int index);
+		void Decrement(int index);
+		void Clear();
+		int GetLast() const;
+
+	private:
+		static constexpr int WORD_BITS = 64;
+		static constexpr int MAX_WORDS = (Position::MAX_ROWS > Position::MAX_COLS ? Position::MAX_ROWS : Position::MAX_COLS) / WORD_BITS;
+		static constexpr int MAX_SUMMARY = (MAX_WORDS + WORD_BITS - 1) / WORD_BITS;
+
+		std::vector<uint32_t> counts_;
+		std::array<uint64_t, MAX_WORDS> used_{};
+		std::array<uint64_t, MAX_SUMMARY> summary_{};
+	};
+
+	Axis rows_;
+	Axis cols_;
+};
@@ -0,0 +1,71 @@
+#include "range_index.h"
+
+#include <algorithm>
+#include <cassert>
+
+template <typename Func>
+void RangeIndex::ForEachCoverNode(int first, int last, Func&& func) {
+	// снизу вверх: на каждом уровне от краёв отрезка отходит не больше чем по одному узлу
+	uint32_t left = static_cast<uint32_t>(LEAVES + first);
+	uint32_t right = static_cast<uint32_t>(LEAVES + last);
+	for (int level = DEPTH; left < right; --level, left >>= 1, right >>= 1) {
+		if (left & 1) {
+			func(left++, level);
+		}
+		if (right & 1) {
+			func(--right, level);
+		}
+	}
+}
+
+void RangeIndex::Insert(uint32_t id, Position top_left, Size size) {
+	assert(top_left.IsValid() && size.rows > 0 && size.cols > 0);
+	if (columns_.empty()) {
+		columns_.resize(2 * LEAVES);
+	}
+	ForEachCoverNode(top_left.col, top_left.col + size.cols, [this, id, top_left, size](uint32_t column, int column_level) {
+		std::unique_ptr<RowTree>& tree = columns_[column];
+		if (!tree) {
+			tree = std::make_unique<RowTree>();
+		}
+		RowTree& rows = *tree;
+		ForEachCoverNode(top_left.row, top_left.row + size.rows, [&rows, id](uint32_t node, int level) {
+			rows.nodes[node].push_back(id);
+			rows.levels.Add(level);
+		});
+		column_levels_.Add(column_level);
+	});
+	++size_;
+}
+
+void RangeIndex::Erase(uint32_t id, Position top_left, Size size) {
+	ForEachCoverNode(top_left.col, top_left.col + size.cols, [this, id, top_left, size](uint32_t column, int column_level) {
+		std::unique_ptr<RowTree>& rows = columns_[column];
+		assert(rows);
+		RowTree& tree = *rows;
+		ForEachCoverNode(top_left.row, top_left.row + size.rows, [&tree, id](uint32_t node, int level) {
+			const auto found = tree.nodes.find(node);
+			assert(found != tree.nodes.end());
+			std::vector<uint32_t>& ids = found->second;
+			const auto it = std::find(ids.begin(), ids.end(), id);
+			assert(it != ids.end());
+			*it = ids.back();
+			ids.pop_back();
+			if (ids.empty()) {
+				tree.nodes.erase(found);
+			}
+			tree.levels.Remove(level);
+		});
+		if (tree.nodes.empty()) {
+			rows.reset();
+		}
+		column_levels_.Remove(column_level);
+	});
+	--size_;
+}
+
+void RangeIndex::Clear() {
+	columns_.clear();
+	column_levels_ = {};
+	size_ = 0;
+}
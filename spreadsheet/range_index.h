@@ -0,0 +1,115 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Rectangles of cells, each known by an id, indexed by the cells they cover: the question
+// it answers is "which rectangles contain this position".
+// A two-level segment tree: an outer tree over the columns whose nodes hold inner trees
+// over the rows. Both are complete binary trees in heap numbering (node 1 is the root,
+// node n has children 2n and 2n+1, leaf of index i is LEAVES + i). The columns of a
+// rectangle are tiled exactly by O(log MAX_COLS) outer nodes and its rows, in the row
+// tree of each of them, by O(log MAX_ROWS) inner nodes, so a rectangle takes
+// O(log MAX_COLS * log MAX_ROWS) entries however wide or tall it is. A lookup walks from
+// the leaf of the column up to the root and, in every row tree on the way, from the leaf
+// of the row up to the root: O(log MAX_COLS * log MAX_ROWS + k), meeting every containing
+// rectangle exactly once. Only nodes holding ids are allocated, and masks of non-empty
+// tree levels skip the others without a lookup.
+class RangeIndex {
+public:
+	void Insert(uint32_t id, Position top_left, Size size);
+	// top_left and size must be those id was inserted with
+	void Erase(uint32_t id, Position top_left, Size size);
+	void Clear();
+
+	bool Empty() const {
+		return size_ == 0;
+	}
+	size_t GetSize() const {
+		return size_;
+	}
+
+	// func(uint32_t id) for every rectangle containing pos; any pos is accepted
+	template <typename Func>
+	void ForEachContaining(Position pos, Func&& func) const {
+		if (pos.row < 0 || pos.row >= LEAVES || pos.col < 0 || pos.col >= LEAVES || columns_.empty()) {
+			return;
+		}
+		// обходятся только непустые уровни: узел уровня level над листом i — (LEAVES + i) >> (DEPTH - level)
+		for (uint32_t column_levels = column_levels_.mask; column_levels != 0; column_levels &= column_levels - 1) {
+			const int column_level = CountTrailingZeros(column_levels);
+			if (const RowTree* rows = columns_[static_cast<uint32_t>(LEAVES + pos.col) >> (DEPTH - column_level)].get()) {
+				rows->ForEachContaining(pos.row, func);
+			}
+		}
+	}
+
+private:
+	static constexpr int DEPTH = 14;  // levels below the root
+	static constexpr int LEAVES = 1 << DEPTH;
+
+	static_assert(LEAVES == Position::MAX_ROWS && LEAVES == Position::MAX_COLS,
+		"both trees have one leaf per row or column");
+
+	// entries per level of one tree, and a bit for every level that has any
+	struct Levels {
+		void Add(int level) {
+			++sizes[level];
+			mask |= 1u << level;
+		}
+		void Remove(int level) {
+			if (--sizes[level] == 0) {
+				mask &= ~(1u << level);
+			}
+		}
+
+		std::array<uint32_t, DEPTH + 1> sizes{};
+		uint32_t mask = 0;
+	};
+
+	struct RowTree {
+		template <typename Func>
+		void ForEachContaining(int row, Func& func) const {
+			for (uint32_t non_empty = levels.mask; non_empty != 0; non_empty &= non_empty - 1) {
+				const int level = CountTrailingZeros(non_empty);
+				const auto found = nodes.find(static_cast<uint32_t>(LEAVES + row) >> (DEPTH - level));
+				if (found != nodes.end()) {
+					for (uint32_t id : found->second) {
+						func(id);
+					}
+				}
+			}
+		}
+
+		std::unordered_map<uint32_t, std::vector<uint32_t>> nodes;  // tree node -> ids
+		Levels levels;
+	};
+
+	static int CountTrailingZeros(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+		return __builtin_ctz(mask);
+#else
+		int bit = 0;
+		while (!(mask & 1u)) {
+			mask >>= 1;
+			++bit;
+		}
+		return bit;
+#endif
+	}
+
+	// func(node, level) for the tree nodes covering [first, last) of either dimension
+	template <typename Func>
+	static void ForEachCoverNode(int first, int last, Func&& func);
+
+	// row trees by column tree node; all 2 * LEAVES slots are allocated with the first range
+	std::vector<std::unique_ptr<RowTree>> columns_;
+	Levels column_levels_;
+	size_t size_ = 0;
+};
@@ -2,70 +2,338 @@
 
 #include "cell.h"
 #include "common.h"
+#include "thread_pool.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <charconv>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
 #include <functional>
 #include <iostream>
+#include <locale>
+#include <mutex>
 #include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string_view>
+#include <system_error>
+#include <thread>
 
 using namespace std::literals;
 
-Sheet::Sheet() {
-	rows_.reserve(Position::MAX_ROWS);
-	cols_.reserve(Position::MAX_COLS);
-	rows_.push_back(0);
-	cols_.push_back(0);
+Sheet::Sheet() = default;
+
+// Worker state of background mode. The worker reads the sheet under a shared lock like any
+// reader; mutex only guards the fields below and is never held while waiting for mutex_.
+struct Sheet::BackgroundRecalc {
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable wake;  // an edit ended, or stop
+	std::condition_variable idle;  // the worker made progress or finished
+	bool stop = false;
+	bool requested = true;  // there may be dirty formulas
+	bool busy = false;
+	uint64_t progress = 0;  // chunks computed, lets waiting readers look again
+};
+
+namespace {
+	// sheet whose scope the current thread is inside, so nested public calls do not lock again
+	thread_local const Sheet* scope_owner = nullptr;
+	thread_local bool scope_exclusive = false;
+
+	// Prints a table of size cells from top_left row by row. Cells come in row-major order, the gaps
+	// between them become runs of tabs, and the text is collected in a buffer that goes
+	// to the stream in blocks. Numbers are formatted with std::to_chars, which gives the
+	// bytes operator<< would for a stream with default flags and the classic locale; a
+	// stream set up otherwise gets every piece through operator<< as before.
+	class TableWriter {
+	public:
+		TableWriter(std::ostream& output, Position top_left, Size size)
+			: output_(output)
+			, top_left_(top_left)
+			, size_(size)
+			, direct_(output.width() != 0 || output.getloc() != std::locale::classic()
+				|| (output.flags() & (std::ios_base::floatfield | std::ios_base::showpoint | std::ios_base::showpos | std::ios_base::uppercase)) != 0)
+		{
+			if (!direct_) {
+				buffer_.reserve(BUFFER_SIZE + BUFFER_SIZE / 4);
+			}
+		}
+
+		// pos is inside the table, to the right of or below the previous cell
+		void MoveTo(Position pos) {
+			while (row_ < pos.row - top_left_.row) {
+				EndRow();
+			}
+			Fill('\t', pos.col - top_left_.col - col_);
+			col_ = pos.col - top_left_.col;
+		}
+
+		void Write(std::string_view text) {
+			if (direct_) {
+				output_ << text;
+				return;
+			}
+			buffer_ += text;
+			FlushIfFull();
+		}
+
+		void Write(double number) {
+			char chars[128];
+			const auto [end, error] = std::to_chars(chars, chars + sizeof(chars), number, std::chars_format::general, static_cast<int>(output_.precision()));
+			if (direct_ || error != std::errc{}) {
+				Flush();
+				output_ << number;
+				return;
+			}
+			buffer_.append(chars, end);
+			FlushIfFull();
+		}
+
+		void Write(FormulaError error) {
+			Write(error.ToString());
+		}
+
+		// ends the remaining rows and sends the rest of the buffer
+		void Finish() {
+			while (row_ < size_.rows) {
+				EndRow();
+			}
+			Flush();
+		}
+
+	private:
+		static constexpr size_t BUFFER_SIZE = 64 * 1024;
+
+		void EndRow() {
+			Fill('\t', size_.cols - 1 - col_);
+			Fill('\n', 1);
+			++row_;
+			col_ = 0;
+		}
+
+		void Fill(char c, int count) {
+			if (count <= 0) {
+				return;
+			}
+			if (direct_) {
+				for (int i = 0; i < count; ++i) {
+					output_ << c;
+				}
+				return;
+			}
+			buffer_.append(static_cast<size_t>(count), c);
+			FlushIfFull();
+		}
+
+		void FlushIfFull() {
+			if (buffer_.size() >= BUFFER_SIZE) {
+				Flush();
+			}
+		}
+
+		void Flush() {
+			output_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+			buffer_.clear();
+		}
+
+		std::ostream& output_;
+		Position top_left_;
+		Size size_;
+		bool direct_;
+		std::string buffer_;
+		int row_ = 0;
+		int col_ = 0;  // column of the last cell written in the row, 0 at its start
+	};
+
+	// the window must be a rectangle of the sheet, possibly empty
+	void CheckWindow(Position top_left, Size size) {
+		if (!top_left.IsValid() || size.rows < 0 || size.cols < 0
+			|| size.rows > Position::MAX_ROWS - top_left.row || size.cols > Position::MAX_COLS - top_left.col) {
+			throw InvalidPositionException{ "" };
+		}
+	}
+}// namespace
+
+Sheet::AccessScope::AccessScope(const Sheet& sheet, Access access)
+	: sheet_(scope_owner == &sheet ? nullptr : &sheet)
+	, access_(access)
+{
+	if (!sheet_) {
+		// общая блокировка не превращается в исключительную
+		assert(scope_exclusive || access == Access::Read);
+		return;
+	}
+	assert(!scope_owner);
+	if (access == Access::Edit) {
+		++sheet.waiting_writers_;
+		sheet.mutex_.lock();
+		if (--sheet.waiting_writers_ == 0) {
+			// читатель проверяет счётчик под writer_gate_, так что пробуждение не теряется
+			{
+				std::lock_guard gate(sheet.writer_gate_);
+			}
+			sheet.writers_gone_.notify_all();
+		}
+	}
+	else {
+		// ждущий писатель проходит раньше новых читателей; без писателей замок не берётся
+		if (sheet.waiting_writers_.load() > 0) {
+			std::unique_lock gate(sheet.writer_gate_);
+			sheet.writers_gone_.wait(gate, [&sheet] {
+				return sheet.waiting_writers_.load() == 0;
+			});
+		}
+		sheet.mutex_.lock_shared();
+	}
+	scope_owner = &sheet;
+	scope_exclusive = access == Access::Edit;
+}
+
+Sheet::AccessScope::~AccessScope() {
+	if (!sheet_) {
+		return;
+	}
+	scope_owner = nullptr;
+	if (access_ == Access::Read) {
+		sheet_->mutex_.unlock_shared();
+		return;
+	}
+	sheet_->mutex_.unlock();
+	if (BackgroundRecalc* background = sheet_->background_.get()) {
+		{
+			std::lock_guard lock(background->mutex);
+			background->requested = true;
+		}
+		background->wake.notify_all();
+	}
 }
 
-Sheet::~Sheet() = default;
+Sheet::~Sheet() {
+	SetBackgroundRecalc(false);
+}
 
 void Sheet::SetCell(Position pos, std::string text) {
 	if (!pos.IsValid()) {
 		throw InvalidPositionException{ "" };
 	}
+	AccessScope scope(*this, Access::Edit);
 	Cell elem(this);
-	elem.Set(std::move(text));
+	elem.Set(std::move(text), pos);
 
-	Cell copy_elem(this);
-	bool prev_value_exists = false;
-	if (CheckCellExistance(pos)) {
-		prev_value_exists = true;
-		copy_elem = std::move(*sheet_[pos.row][pos.col]);
+	if (in_batch_) {
+		RecordBatchEdit(pos);
+		if (!FindCell(pos)) {
+			occupancy_.Add(pos);
+		}
+		cells_.Emplace(pos, std::move(elem));
+		values_.MarkStale(pos);
+		return;
 	}
 
-	std::unique_ptr<Cell> new_cell(std::make_unique<Cell>(std::move(elem)));
-	sheet_[pos.row].insert_or_assign(pos.col, std::move(new_cell));
-
-	Cell* for_check = prev_value_exists ? &copy_elem : nullptr;
-	CheckCyclicDependences(for_check, pos);
-	ClearDependentCellCache(pos);
+	std::vector<Position> refs;
+	std::vector<RangeReference> ranges;
+	if (const FormulaImpl* formula = elem.GetFormulaImpl()) {
+		refs = formula->GetSingleReferences();
+		ranges = formula->GetRangeReferences();
+	}
+	if (!UpdateDependences(pos, refs, ranges)) {
+		throw CircularDependencyException{ "" };
+	}
 
-	//если значение в ячейке уже существовало, то она могла ссылаться на другие ячейки
-	// лишние связи нужно удалить
-	if (prev_value_exists) {
-		DeleteDependence(pos, copy_elem.GetReferencedCells());
+	if (!FindCell(pos)) {
+		occupancy_.Add(pos);
+	}
+	cells_.Emplace(pos, std::move(elem));
+	values_.MarkStale(pos);
+	// ячейки диапазонов не создаются: пустая ячейка в диапазоне просто пропускается
+	for (auto ref_pos : refs) {
+		AddEmptyCell(ref_pos);
 	}
+	InvalidateDependentCells(pos);
+}
 
-	for (auto ref_pos : sheet_[pos.row][pos.col]->GetReferencedCells()) {
-		SetDependence(pos, ref_pos);
+//если значение в ячейке уже существовало, то она могла ссылаться на другие ячейки
+// старые связи заменяются новыми; при циклической зависимости граф остаётся прежним
+bool Sheet::UpdateDependences(Position pos, const std::vector<Position>& refs, const std::vector<RangeReference>& ranges) {
+	std::vector<Position> prev_refs;
+	graph_.ForEachPrecedent(pos, [&prev_refs](Position ref_pos) {
+		prev_refs.push_back(ref_pos);
+	});
+	std::vector<RangeReference> prev_ranges;
+	graph_.ForEachRange(pos, [&prev_ranges](Position top_left, Size size) {
+		prev_ranges.push_back({ top_left, size });
+	});
+	graph_.RemoveOutEdges(pos);
+
+	const auto link = [this, pos](const std::vector<Position>& cells, const std::vector<RangeReference>& areas) {
+		for (auto ref_pos : cells) {
+			if (!graph_.AddEdge(pos, ref_pos)) {
+				return false;
+			}
+		}
+		for (const RangeReference& range : areas) {
+			if (!graph_.AddRange(pos, range.top_left, range.size)) {
+				return false;
+			}
+		}
+		return true;
+	};
+	if (!link(refs, ranges)) {
+		graph_.RemoveOutEdges(pos);
+		[[maybe_unused]] const bool restored = link(prev_refs, prev_ranges);
+		assert(restored);
+		return false;
 	}
+	return true;
+}
 
-	rows_.push_back(pos.row + 1);
-	cols_.push_back(pos.col + 1);
-	MakeHigherSize();
+void Sheet::EvaluateFormulas(Position pos) const {
+	assert(!in_batch_);
+	// обход в глубину с выходом: ячейка вычисляется, когда вычислены все её ссылки
+	struct Frame {
+		Position pos;
+		bool expanded;
+	};
+	std::vector<Frame> stack{ { pos, false } };
+	while (!stack.empty()) {
+		const Frame frame = stack.back();
+		stack.pop_back();
+		const Cell* cell = FindCell(frame.pos);
+		if (!cell || !cell->NeedsEvaluation()) {
+			continue;
+		}
+		if (frame.expanded) {
+			cell->GetValue();
+			continue;
+		}
+		stack.push_back({ frame.pos, true });
+		graph_.ForEachPrecedent(frame.pos, [this, &stack](Position ref_pos) {
+			const Cell* ref = FindCell(ref_pos);
+			if (ref && ref->NeedsEvaluation()) {
+				stack.push_back({ ref_pos, false });
+			}
+		});
+		// в диапазоне обходятся только существующие ячейки
+		graph_.ForEachRange(frame.pos, [this, &stack](Position top_left, Size size) {
+			cells_.ForEachInRect(top_left, size, [&stack](Position ref_pos, const Cell& ref) {
+				if (ref.NeedsEvaluation()) {
+					stack.push_back({ ref_pos, false });
+				}
+			});
+		});
+	}
 }
 
-void Sheet::SetDependence(Position dependent, Position parent) {
-	if (!CheckCellExistance(parent)) {
-		Cell empty(this);
-		empty.Set("");
-		std::unique_ptr<Cell> new_cell(std::make_unique<Cell>(std::move(empty)));
-		sheet_[parent.row].insert_or_assign(parent.col, std::move(new_cell));
-		rows_.push_back(parent.row + 1);
-		cols_.push_back(parent.col + 1);
-		MakeHigherSize();
+// ячейка, на которую ссылается формула, должна существовать
+void Sheet::AddEmptyCell(Position pos) {
+	if (!FindCell(pos)) {
+		cells_.Emplace(pos, this);
+		occupancy_.Add(pos);
 	}
-	sheet_[parent.row][parent.col]->SetDependences(dependent);
 }
 
 
@@ -74,10 +342,7 @@ const CellInterface* Sheet::GetCell(Position pos) const {
 		throw InvalidPositionException{ "" };
 	}
 
-	if (CheckCellExistance(pos)) {
-		return sheet_.at(pos.row).at(pos.col).get();
-	}
-	return nullptr;
+	return FindCell(pos);
 }
 
 CellInterface* Sheet::GetCell(Position pos) {
@@ -85,182 +350,676 @@ CellInterface* Sheet::GetCell(Position pos) {
 		throw InvalidPositionException{ "" };
 	}
 
-	if (CheckCellExistance(pos)) {
-
-		return sheet_[pos.row][pos.col].get();
-	}
-	return nullptr;
+	return FindCell(pos);
 }
 
 void Sheet::ClearCell(Position pos) {
 	if (!pos.IsValid()) {
 		throw InvalidPositionException{ "" };
 	}
+	AccessScope scope(*this, Access::Edit);
+
+	if (in_batch_) {
+		if (FindCell(pos)) {
+			RecordBatchEdit(pos);
+			cells_.Erase(pos);
+			occupancy_.Remove(pos);
+			values_.MarkStale(pos);
+		}
+		return;
+	}
 
-	if (CheckCellExistance(pos)) {
-		ClearDependentCellCache(pos);
+	if (FindCell(pos)) {
+		InvalidateDependentCells(pos);
 		//если значение в ячейке уже существовало, то она могла ссылаться на другие ячейки
 		// лишние связи нужно удалить
-		std::vector<Position> copy_elem = sheet_[pos.row][pos.col]->GetReferencedCells();
+		graph_.RemoveOutEdges(pos);
 
-		if (sheet_[pos.row].size() == 1) {
-			sheet_.erase(pos.row);
-		}
-		else {
-			sheet_[pos.row].erase(pos.col);
-		}
-		DeleteDependence(pos, std::move(copy_elem));
+		cells_.Erase(pos);
+		occupancy_.Remove(pos);
+		values_.MarkStale(pos);
+	}
+}
 
-		auto pos_row = std::find(rows_.begin(), rows_.end(), pos.row + 1);
-		rows_.erase(pos_row);
-		auto pos_col = std::find(cols_.begin(), cols_.end(), pos.col + 1);
-		cols_.erase(pos_col);
-		MakeLowerSize();
+void Sheet::BeginBatch() {
+	AccessScope scope(*this, Access::Edit);
+	if (in_batch_) {
+		throw std::logic_error("batch is already open");
 	}
+	in_batch_ = true;
 }
 
-//удалить недействительный кэш
-void Sheet::ClearDependentCellCache(Position pos) {
-	auto deps = sheet_[pos.row][pos.col]->GetDependentCells();
+bool Sheet::InBatch() const {
+	return in_batch_;
+}
 
-	if (deps.empty()) {
+template <typename Edits>
+void Sheet::ApplyAsBatch(Edits&& edits) {
+	// читатели не должны застать пакет открытым
+	AccessScope scope(*this, Access::Edit);
+	if (in_batch_) {
+		edits();
 		return;
 	}
-	for (auto [row, col] : deps) {
-		if (CheckCellExistance({ row, col })) {
-			if (sheet_[row][col]->HasEmptyCache()) {
-				return;
-			}
-			sheet_[row][col]->InvalidateCache(pos);
-			ClearDependentCellCache({ row, col });
-		}
+	BeginBatch();
+	try {
+		edits();
+	}
+	catch (...) {
+		Rollback();
+		throw;
 	}
+	Commit();
 }
 
-void Sheet::DeleteDependence(Position pos, std::vector<Position>&& prev_refs) {
-	std::vector<Position> new_refs;
-	if (CheckCellExistance(pos)) {
-		new_refs = sheet_[pos.row][pos.col]->GetReferencedCells();
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+	ApplyAsBatch([&] {
+		for (auto& [pos, text] : cells) {
+			SetCell(pos, std::move(text));
+		}
+	});
+}
+
+void Sheet::LoadTexts(std::istream& input, char delimiter) {
+	AccessScope scope(*this, Access::Edit);
+	if (!in_batch_) {
+		ApplyAsBatch([&] {
+			LoadRows(input, delimiter, nullptr);
+		});
+		return;
+	}
+	// в открытом пакете при ошибке отменяются только правки самой загрузки
+	const size_t journal_mark = batch_.size();
+	const size_t saved_mark = batch_saved_.size();
+	LoadJournal overwritten;
+	try {
+		LoadRows(input, delimiter, &overwritten);
+	}
+	catch (...) {
+		UndoLoad(journal_mark, saved_mark, overwritten);
+		throw;
 	}
-	std::vector<Position> diff;
-	std::set_difference(prev_refs.begin(), prev_refs.end(), new_refs.begin(), new_refs.end(), std::back_inserter(diff));
+}
+
+// строки читаются блоками; неполная последняя строка блока переносится в начало буфера
+void Sheet::LoadRows(std::istream& input, char delimiter, LoadJournal* overwritten) {
+	constexpr size_t CHUNK_SIZE = 1 << 20;
+	std::vector<char> buffer(CHUNK_SIZE);
+	size_t kept = 0;
+	int row = 0;
+	while (true) {
+		input.read(buffer.data() + kept, static_cast<std::streamsize>(buffer.size() - kept));
+		const size_t filled = kept + static_cast<size_t>(input.gcount());
+		const std::string_view data(buffer.data(), filled);
 
-	//удалить недействительные обратные зависимости
-	for (auto d : diff) {
-		if (CheckCellExistance(d)) {
-			sheet_[d.row][d.col]->DeleteDependence(pos);
+		size_t line_start = 0;
+		for (size_t line_end = data.find('\n'); line_end != data.npos; line_end = data.find('\n', line_start)) {
+			LoadRow(data.substr(line_start, line_end - line_start), row++, delimiter, overwritten);
+			line_start = line_end + 1;
+		}
+
+		if (!input) {
+			if (line_start < filled) {
+				LoadRow(data.substr(line_start), row, delimiter, overwritten);
+			}
+			break;
+		}
+		kept = filled - line_start;
+		std::copy(buffer.begin() + line_start, buffer.begin() + filled, buffer.begin());
+		if (kept == buffer.size()) {
+			// строка не поместилась в буфер целиком
+			buffer.resize(buffer.size() * 2);
 		}
 	}
 }
 
-void Sheet::CheckCyclicDependences(Cell* copy_cell, Position pos) {
-	try {
-		std::unordered_set<Position, PositionHash> unic_cells{};
-		SearchCyclicDependences(sheet_[pos.row][pos.col].get(), unic_cells);
-	}
-	catch (const CircularDependencyException& exp) {
-		if (copy_cell != nullptr) {
-			std::unique_ptr<Cell> prev_cell(std::make_unique<Cell>(std::move(*copy_cell)));
-			sheet_[pos.row].insert_or_assign(pos.col, std::move(prev_cell));
-			for (auto ref_pos : sheet_[pos.row][pos.col]->GetReferencedCells()) {
-				SetDependence(pos, ref_pos);
+void Sheet::LoadRow(std::string_view line, int row, char delimiter, LoadJournal* overwritten) {
+	if (!line.empty() && line.back() == '\r') {
+		line.remove_suffix(1);
+	}
+	int col = 0;
+	while (true) {
+		const size_t field_end = line.find(delimiter);
+		const std::string_view field = line.substr(0, field_end);
+		if (!field.empty()) {
+			try {
+				const Position pos{ row, col };
+				if (!pos.IsValid()) {
+					throw InvalidPositionException{ "" };
+				}
+				// каждое поле пишется в свою ячейку, так что отмеченная ячейка менялась до загрузки
+				if (overwritten && batch_touched_.Contains(pos)) {
+					std::optional<Cell>& saved = overwritten->emplace_back(pos, std::nullopt).second;
+					if (Cell* cell = FindCell(pos)) {
+						saved.emplace(std::move(*cell));
+					}
+				}
+				LoadCell(pos, field);
+			}
+			catch (const std::exception& exc) {
+				std::throw_with_nested(TextLoadException(row + 1, col + 1, exc.what()));
 			}
 		}
-		std::throw_with_nested(CircularDependencyException{ exp.what() });
+		if (field_end == line.npos) {
+			break;
+		}
+		line.remove_prefix(field_end + 1);
+		++col;
 	}
 }
 
-void Sheet::SearchCyclicDependences(Cell* cell, std::unordered_set<Position, PositionHash>& unic_cells) const {
-	std::vector<Position> cells = cell->GetReferencedCells();
-	if (cells.empty()) {
+void Sheet::LoadCell(Position pos, std::string_view text) {
+	assert(in_batch_);
+	if (text[0] == FORMULA_SIGN && text.size() != 1) {
+		SetCell(pos, std::string(text));
 		return;
 	}
+	// как SetCell в пакете, но ячейка заполняется на месте, без Cell::Set
+	RecordBatchEdit(pos);
+	Cell* cell = FindCell(pos);
+	if (!cell) {
+		occupancy_.Add(pos);
+		cell = &cells_.Emplace(pos, this);
+	}
+	cell->SetText(text);
+	values_.MarkStale(pos);
+}
 
-	for (Position c : cells) {
-		if (unic_cells.find(c) != unic_cells.end()) {
-			throw CircularDependencyException{ "" };
+void Sheet::UndoLoad(size_t journal_mark, size_t saved_mark, LoadJournal& overwritten) {
+	// ячейки, которые первой в пакете изменила загрузка, возвращаются как при откате
+	for (size_t i = journal_mark; i < batch_.size(); ++i) {
+		const Position pos = batch_[i];
+		if (cells_.Erase(pos)) {
+			occupancy_.Remove(pos);
+		}
+		values_.MarkStale(pos);
+		batch_touched_.Erase(pos);
+	}
+	for (size_t i = saved_mark; i < batch_saved_.size(); ++i) {
+		auto& [pos, cell] = batch_saved_[i];
+		occupancy_.Add(pos);
+		cells_.Emplace(pos, std::move(cell));
+	}
+	batch_.erase(batch_.begin() + journal_mark, batch_.end());
+	batch_saved_.erase(batch_saved_.begin() + saved_mark, batch_saved_.end());
+	// остальные получают то, что было в них перед загрузкой
+	for (auto& [pos, cell] : overwritten) {
+		if (cells_.Erase(pos)) {
+			occupancy_.Remove(pos);
 		}
-		unic_cells.insert(c);
-		if (CheckCellExistance({ c.row, c.col })) {
-			SearchCyclicDependences(sheet_.at(c.row).at(c.col).get(), unic_cells);
+		if (cell) {
+			occupancy_.Add(pos);
+			cells_.Emplace(pos, std::move(*cell));
 		}
+		values_.MarkStale(pos);
 	}
 }
 
-Size Sheet::GetPrintableSize() const {
-	return min_size_;
+void Sheet::RecordBatchEdit(Position pos) {
+	if (batch_touched_.Contains(pos)) {
+		return;
+	}
+	batch_touched_.Emplace(pos, true);
+	batch_.push_back(pos);
+	if (Cell* cell = FindCell(pos)) {
+		batch_saved_.emplace_back(pos, std::move(*cell));
+	}
 }
 
-void Sheet::PrintValues(std::ostream& output) const {
-	for (int row = 0; row < min_size_.rows; ++row) {
-		for (int col = 0; col < min_size_.cols; ++col) {
-			if (CheckCellExistance({ row, col })) {
-				const auto& val = sheet_.at(row).at(col)->GetValue();
-				ExtractValue(output, val);
+void Sheet::RestoreBatchCells() {
+	for (Position pos : batch_) {
+		if (cells_.Erase(pos)) {
+			occupancy_.Remove(pos);
+		}
+		values_.MarkStale(pos);
+	}
+	for (auto& [pos, cell] : batch_saved_) {
+		occupancy_.Add(pos);
+		cells_.Emplace(pos, std::move(cell));
+	}
+}
+
+// граф ещё описывает ячейки до пакета: связи изменённых ячеек заменяются без проверок,
+// порядок и циклы проверяются одним проходом по всему графу
+std::vector<Position> Sheet::LinkBatchCells() {
+	for (Position pos : batch_) {
+		graph_.RemoveOutEdges(pos);
+	}
+	std::vector<Position> formulas;
+	for (Position pos : batch_) {
+		const Cell* cell = FindCell(pos);
+		if (const FormulaImpl* formula = cell ? cell->GetFormulaImpl() : nullptr) {
+			formulas.push_back(pos);
+			for (Position ref_pos : formula->GetSingleReferences()) {
+				graph_.AddEdgeUnchecked(pos, ref_pos);
 			}
-			if (col + 1 < min_size_.cols) {
-				output << '\t';
+			for (const RangeReference& range : formula->GetRangeReferences()) {
+				graph_.AddRangeUnchecked(pos, range.top_left, range.size);
 			}
 		}
-		output << '\n';
 	}
+	return formulas;
 }
 
-void Sheet::PrintTexts(std::ostream& output) const {
-	for (int row = 0; row < min_size_.rows; ++row) {
-		for (int col = 0; col < min_size_.cols; ++col) {
-			if (CheckCellExistance({ row, col })) {
-				output << sheet_.at(row).at(col)->GetText();
-			}
-			if (col + 1 < min_size_.cols) {
-				output << '\t';
+void Sheet::Commit() {
+	AccessScope scope(*this, Access::Edit);
+	if (!in_batch_) {
+		throw std::logic_error("no open batch");
+	}
+	std::vector<Position> formulas = LinkBatchCells();
+	if (!graph_.RebuildOrder()) {
+		RestoreBatchCells();
+		formulas = LinkBatchCells();
+		[[maybe_unused]] const bool restored = graph_.RebuildOrder();
+		assert(restored);
+		InvalidateBatchCells(formulas);
+		EndBatch();
+		throw CircularDependencyException{ "" };
+	}
+
+	// у текста и чисел нет ни ссылок, ни кэша: обходятся только формулы пакета
+	for (Position pos : formulas) {
+		graph_.ForEachPrecedent(pos, [this](Position ref_pos) {
+			AddEmptyCell(ref_pos);
+		});
+	}
+	InvalidateBatchCells(formulas);
+	EndBatch();
+}
+
+void Sheet::Rollback() {
+	AccessScope scope(*this, Access::Edit);
+	if (!in_batch_) {
+		throw std::logic_error("no open batch");
+	}
+	// граф не менялся с начала пакета и описывает восстановленные ячейки
+	RestoreBatchCells();
+	InvalidateBatchCells(batch_);
+	EndBatch();
+}
+
+// одна инвалидация от всех изменённых ячеек сразу; сбрасываются и формулы самого пакета,
+// ведь значение, прочитанное внутри пакета, могло опираться на его промежуточное состояние
+void Sheet::InvalidateBatchCells(const std::vector<Position>& cells) {
+	const auto invalidate = [this](Position pos) {
+		if (Cell* cell = FindCell(pos)) {
+			cell->InvalidateCache(pos);
+		}
+		values_.MarkStale(pos);
+	};
+	for (Position pos : cells) {
+		invalidate(pos);
+	}
+	graph_.ForEachTransitiveDependent(batch_, invalidate);
+}
+
+void Sheet::ClearAll() {
+	cells_.Clear();
+	occupancy_.Clear();
+	graph_ = DependencyGraph{};
+	values_.Clear();
+}
+
+void Sheet::EndBatch() {
+	// журнал большой загрузки не держим до следующего пакета
+	batch_.clear();
+	batch_.shrink_to_fit();
+	batch_saved_.clear();
+	batch_saved_.shrink_to_fit();
+	batch_touched_.Clear();
+	in_batch_ = false;
+}
+
+size_t Sheet::RecalculateDirty() {
+	AccessScope scope(*this, Access::Edit);
+	if (in_batch_) {
+		throw std::logic_error("cannot recalculate inside an open batch");
+	}
+	std::vector<Position> dirty;
+	cells_.ForEach([&dirty](Position pos, const Cell& cell) {
+		if (cell.NeedsEvaluation()) {
+			dirty.push_back(pos);
+		}
+	});
+	for (const std::vector<Position>& level : graph_.Levelize(dirty)) {
+		EvaluateLevel(level);
+	}
+	return dirty.size();
+}
+
+size_t Sheet::RecalculateAll() {
+	AccessScope scope(*this, Access::Edit);
+	if (in_batch_) {
+		throw std::logic_error("cannot recalculate inside an open batch");
+	}
+	std::vector<Position> formulas;
+	cells_.ForEach([&formulas](Position pos, const Cell& cell) {
+		if (cell.GetFormulaImpl()) {
+			formulas.push_back(pos);
+		}
+	});
+	for (Position pos : formulas) {
+		FindCell(pos)->InvalidateCache(pos);
+		values_.MarkStale(pos);
+	}
+	return RecalculateDirty();
+}
+
+// предшественники уровня уже вычислены, так что ячейки читают только готовые значения
+// и пишут каждая свой кэш
+void Sheet::EvaluateLevel(const std::vector<Position>& cells) {
+	constexpr size_t MIN_PARALLEL_CELLS = 256;
+	constexpr size_t MIN_CHUNK_SIZE = 64;
+	const auto evaluate = [this, &cells](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i) {
+			FindCell(cells[i])->GetNumber();
+		}
+	};
+	if (cells.size() < MIN_PARALLEL_CELLS) {
+		evaluate(0, cells.size());
+		return;
+	}
+	if (!recalc_pool_) {
+		recalc_pool_ = std::make_unique<ThreadPool>();
+	}
+	// несколько кусков на поток, чтобы потоки выравнивали нагрузку между собой
+	const size_t chunk_size = std::max(MIN_CHUNK_SIZE, cells.size() / (recalc_pool_->GetThreadCount() * 8));
+	recalc_pool_->ParallelFor(cells.size(), chunk_size, evaluate);
+}
+
+void Sheet::SetBackgroundRecalc(bool enabled) {
+	if (enabled == IsBackgroundRecalc()) {
+		return;
+	}
+	if (enabled) {
+		background_ = std::make_unique<BackgroundRecalc>();
+		background_->worker = std::thread([this] {
+			RunBackgroundRecalc();
+		});
+		return;
+	}
+	{
+		std::lock_guard lock(background_->mutex);
+		background_->stop = true;
+	}
+	background_->wake.notify_all();
+	background_->worker.join();
+	background_.reset();
+}
+
+bool Sheet::IsBackgroundRecalc() const {
+	return background_ != nullptr;
+}
+
+CellInterface::Value Sheet::GetValue(Position pos, ReadPolicy policy) {
+	if (!pos.IsValid()) {
+		throw InvalidPositionException{ "" };
+	}
+	if (background_ && policy == ReadPolicy::Wait) {
+		BackgroundRecalc& background = *background_;
+		std::unique_lock lock(background.mutex);
+		while (true) {
+			const bool idle = !background.busy && !background.requested;
+			const uint64_t progress = background.progress;
+			lock.unlock();
+			{
+				// если рабочий поток до ячейки не дойдёт, она вычисляется здесь
+				AccessScope scope(*this, Access::Read);
+				CheckValuesReadable();
+				const Cell* cell = FindCell(pos);
+				if (idle || !cell || !cell->NeedsEvaluation()) {
+					return ReadValue(pos);
+				}
 			}
+			lock.lock();
+			background.idle.wait(lock, [&] {
+				return background.progress != progress || (!background.busy && !background.requested);
+			});
+		}
+	}
+	AccessScope scope(*this, Access::Read);
+	CheckValuesReadable();
+	return ReadValue(pos);
+}
+
+ValueSpan Sheet::GetValueSpan(Position pos) const {
+	if (!pos.IsValid()) {
+		throw InvalidPositionException{ "" };
+	}
+	AccessScope scope(*this, Access::Read);
+	CheckValuesReadable();
+	const Position first{ pos.row - pos.row % ValueSpan::SIZE, pos.col };
+	// здесь, вне вычисления формулы, можно вычислить весь сегмент, и он всегда кэшируется
+	ValueSegment unused;
+	return ReadValueSpan(first, first.row + ValueSpan::SIZE, unused);
+}
+
+ValueSpan Sheet::ReadValueSpan(Position pos, int end_row, ValueSegment& scratch) const {
+	const int first_row = pos.row - pos.row % ValueSpan::SIZE;
+	if (const ValueSegment* segment = values_.FindFresh(pos)) {
+		return { *segment, first_row };
+	}
+	end_row = std::min(end_row, first_row + ValueSpan::SIZE);
+	// формулы вычисляются до блокировки сегментов: они сами читают диапазоны
+	cells_.ForEachInRect(pos, { end_row - pos.row, 1 }, [this](Position cell_pos, const Cell& cell) {
+		if (cell.NeedsEvaluation()) {
+			EvaluateFormulas(cell_pos);
 		}
-		output << '\n';
+	});
+	const Position first{ first_row, pos.col };
+	if (const ValueSegment* segment = values_.Build(pos, [this, first](ValueSegment& segment) {
+			return FillValueSegment(first, ValueSpan::SIZE, segment);
+		})) {
+		return { *segment, first_row };
 	}
+	scratch.Reset();
+	[[maybe_unused]] const bool filled = FillValueSegment(pos, end_row - pos.row, scratch);
+	assert(filled);
+	return { scratch, first_row };
+}
+
+bool Sheet::FillValueSegment(Position first, int rows, ValueSegment& segment) const {
+	bool complete = true;
+	cells_.ForEachInRect(first, { rows, 1 }, [&segment, &complete](Position pos, const Cell& cell) {
+		if (cell.NeedsEvaluation()) {
+			complete = false;
+			return;
+		}
+		const std::optional<FormulaInterface::Value> operand = cell.GetRangeOperand();
+		if (!operand) {
+			return;
+		}
+		const int index = pos.row % ValueSpan::SIZE;
+		if (const double* number = std::get_if<double>(&*operand)) {
+			segment.SetNumber(index, *number);
+		}
+		else {
+			segment.SetError(index, std::get<FormulaError>(*operand).GetCategory());
+		}
+	});
+	return complete;
 }
 
-void Sheet::ExtractValue(std::ostream& output, const CellInterface::Value& val) const {
-	if (std::holds_alternative<std::string>(val)) {
-		output << std::get<std::string>(val);
+void Sheet::WaitRecalcIdle() {
+	if (in_batch_) {
+		throw std::logic_error("cannot wait for recalculation inside an open batch");
 	}
-	if (std::holds_alternative<double>(val)) {
-		output << std::get<double>(val);
+	if (!background_) {
+		return;
 	}
-	if (std::holds_alternative<FormulaError>(val)) {
-		output << std::get<FormulaError>(val);
+	// если другой поток откроет пакет во время ожидания, оно продлится до конца пакета:
+	// рабочий поток продолжит после него
+	BackgroundRecalc& background = *background_;
+	std::unique_lock lock(background.mutex);
+	background.idle.wait(lock, [&] {
+		return !in_batch_ && !background.busy && !background.requested;
+	});
+}
+
+void Sheet::RunBackgroundRecalc() {
+	BackgroundRecalc& background = *background_;
+	std::unique_lock lock(background.mutex);
+	while (true) {
+		// писатель, ждущий блокировку, снимет requested только после своей правки
+		background.wake.wait(lock, [&] {
+			return background.stop || (background.requested && !in_batch_ && waiting_writers_.load() == 0);
+		});
+		if (background.stop) {
+			return;
+		}
+		background.requested = false;
+		background.busy = true;
+		lock.unlock();
+		const bool finished = RecalculateInBackground();
+		lock.lock();
+		// недосчитанное продолжится после правки
+		background.requested = background.requested || !finished;
+		background.busy = false;
+		background.idle.notify_all();
 	}
 }
 
-bool Sheet::CheckCellExistance(Position pos) const {
-	if (sheet_.find(pos.row) != sheet_.end()) {
-		if (sheet_.at(pos.row).find(pos.col) != sheet_.at(pos.row).end()) {
-			return true;
+bool Sheet::RecalculateInBackground() {
+	constexpr size_t CHUNK_SIZE = 256;
+	BackgroundRecalc& background = *background_;
+	std::shared_lock sheet_lock(mutex_);
+	if (in_batch_) {
+		return true;
+	}
+	std::vector<Position> dirty;
+	cells_.ForEach([&dirty](Position pos, const Cell& cell) {
+		if (cell.NeedsEvaluation()) {
+			dirty.push_back(pos);
+		}
+	});
+	size_t computed = 0;
+	for (const std::vector<Position>& level : graph_.Levelize(dirty)) {
+		for (Position pos : level) {
+			FindCell(pos)->GetNumber();
+			if (++computed % CHUNK_SIZE != 0) {
+				continue;
+			}
+			{
+				std::lock_guard lock(background.mutex);
+				++background.progress;
+				if (background.stop) {
+					return false;
+				}
+			}
+			background.idle.notify_all();
+			// после правки список грязных ячеек устарел, проход начнётся заново
+			if (waiting_writers_.load() > 0) {
+				return false;
+			}
 		}
 	}
-	return false;
+	return true;
+}
+
+//удалить недействительный кэш у всех ячеек, прямо или косвенно зависящих от pos
+size_t Sheet::InvalidateDependentCells(Position pos) {
+	AccessScope scope(*this, Access::Edit);
+	size_t dirtied = 0;
+	graph_.ForEachTransitiveDependent(pos, [this, pos, &dirtied](Position dep) {
+		Cell* dep_cell = FindCell(dep);
+		if (dep_cell && !dep_cell->HasEmptyCache()) {
+			dep_cell->InvalidateCache(pos);
+			values_.MarkStale(dep);
+			++dirtied;
+		}
+	});
+	return dirtied;
+}
+
+Size Sheet::GetPrintableSize() const {
+	AccessScope scope(*this, Access::Read);
+	return occupancy_.GetPrintableSize();
+}
+
+void Sheet::PrintValues(std::ostream& output) const {
+	AccessScope scope(*this, Access::Read);
+	PrintValues(output, Position{ 0, 0 }, GetPrintableSize());
+}
+
+void Sheet::PrintTexts(std::ostream& output) const {
+	AccessScope scope(*this, Access::Read);
+	PrintTexts(output, Position{ 0, 0 }, GetPrintableSize());
+}
+
+void Sheet::PrintValues(std::ostream& output, Position top_left, Size size) const {
+	CheckWindow(top_left, size);
+	AccessScope scope(*this, Access::Read);
+	CheckValuesReadable();
+	// обходятся только заполненные ячейки окна, по строкам; формулы вычисляются лениво,
+	// вместе с тем, от чего они зависят
+	TableWriter writer(output, top_left, size);
+	cells_.ForEachInRectByRows(top_left, size, [&writer](Position pos, const Cell& cell) {
+		writer.MoveTo(pos);
+		std::visit([&writer](const auto& value) {
+			writer.Write(value);
+		}, cell.GetValue());
+	});
+	writer.Finish();
+}
+
+void Sheet::PrintTexts(std::ostream& output, Position top_left, Size size) const {
+	CheckWindow(top_left, size);
+	AccessScope scope(*this, Access::Read);
+	TableWriter writer(output, top_left, size);
+	cells_.ForEachInRectByRows(top_left, size, [&writer](Position pos, const Cell& cell) {
+		writer.MoveTo(pos);
+		writer.Write(cell.GetText());
+	});
+	writer.Finish();
 }
 
-void Sheet::UpdateSize() {
-	std::sort(rows_.begin(), rows_.end());
-	std::sort(cols_.begin(), cols_.end());
+std::vector<CellInterface::Value> Sheet::GetValues(Position top_left, Size size) const {
+	CheckWindow(top_left, size);
+	AccessScope scope(*this, Access::Read);
+	CheckValuesReadable();
+	std::vector<CellInterface::Value> values(static_cast<size_t>(size.rows) * size.cols, EmptyImpl{}.GetValue(*this));
+	cells_.ForEachInRect(top_left, size, [&values, top_left, size](Position pos, const Cell& cell) {
+		values[static_cast<size_t>(pos.row - top_left.row) * size.cols + (pos.col - top_left.col)] = cell.GetValue();
+	});
+	return values;
 }
 
-void Sheet::MakeHigherSize() {
-	UpdateSize();
-	if (min_size_.rows < rows_.back()) {
-		min_size_.rows = rows_.back();
+// формулы внутри пакета вычислились бы по его промежуточному состоянию
+void Sheet::CheckValuesReadable() const {
+	if (in_batch_) {
+		throw std::logic_error("cannot read values inside an open batch");
 	}
-	if (min_size_.cols < cols_.back()) {
-		min_size_.cols = cols_.back();
+}
+
+CellInterface::Value Sheet::ReadValue(Position pos) const {
+	if (const Cell* cell = FindCell(pos)) {
+		return cell->GetValue();
 	}
+	return EmptyImpl{}.GetValue(*this);
+}
+
+Cell* Sheet::FindCell(Position pos) {
+	return cells_.Find(pos);
+}
+
+const Cell* Sheet::FindCell(Position pos) const {
+	return cells_.Find(pos);
+}
+
+FormulaPool& Sheet::GetFormulaPool() {
+	return formulas_;
+}
+
+const FormulaPool& Sheet::GetFormulaPool() const {
+	return formulas_;
+}
 
+int Sheet::GetLastUsedRow() const {
+	return occupancy_.GetLastUsedRow();
 }
 
-void Sheet::MakeLowerSize() {
-	UpdateSize();
-	min_size_.rows = rows_.back();
-	min_size_.cols = cols_.back();
+int Sheet::GetLastUsedCol() const {
+	return occupancy_.GetLastUsedCol();
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
@@ -2,10 +2,62 @@
 
 #include "cell.h"
 #include "common.h"
+#include "dependency_graph.h"
+#include "formula_pool.h"
+#include "occupancy_index.h"
+#include "tiled_grid.h"
+#include "value_columns.h"
 
-#include <unordered_map>
-#include <unordered_set>
+#include <atomic>
+#include <condition_variable>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
+// Thrown by Sheet::LoadTexts when a field cannot be set; the original exception is nested.
+// Line and field numbers are 1-based.
+class TextLoadException : public std::runtime_error {
+public:
+    TextLoadException(int line, int field, const std::string& reason)
+        : std::runtime_error("line " + std::to_string(line) + ", field " + std::to_string(field) + ": " + reason)
+        , line_(line)
+        , field_(field) {
+    }
+
+    int GetLine() const {
+        return line_;
+    }
+    int GetField() const {
+        return field_;
+    }
+
+private:
+    int line_;
+    int field_;
+};
+
+class ThreadPool;
+
+// Thrown by Sheet::LoadSnapshot for data that is not a snapshot of a supported version
+// or is damaged.
+class SnapshotException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Threads: any number of readers may call GetValue(pos, policy), PrintValues, PrintTexts,
+// GetPrintableSize and SaveSnapshot at the same time as one writer edits the sheet. Readers
+// share the sheet and compute dirty formulas in place (a formula cache is a single atomic
+// word); every other public call takes it exclusively, and waiting writers are let in ahead
+// of new readers. Pointers returned by GetCell are not protected: use them only while no
+// other thread edits the sheet.
 class Sheet : public SheetInterface {
 public:
     Sheet();
@@ -18,27 +70,198 @@ public:
 
     void ClearCell(Position pos) override;
 
+    // Batch editing. Between BeginBatch() and Commit(), SetCell and ClearCell only replace
+    // the contents of cells (formulas are still parsed, and a bad one still throws from its
+    // SetCell); dependencies are relinked, checked for cycles and invalidated once, in
+    // Commit(). If the edits close a cycle, Commit() restores the sheet to its state before
+    // BeginBatch() and throws CircularDependencyException. Rollback() discards the edits.
+    // Whichever way the batch ends, the cached values of the edited cells and of every cell
+    // depending on them are dropped. Cell values are not read while a batch is open, from
+    // any thread: GetValue, GetValues, GetValueSpan, PrintValues, SaveSnapshot with values
+    // and CellInterface::GetValue throw std::logic_error then.
+    void BeginBatch();
+    void Commit();
+    void Rollback();
+    bool InBatch() const;
+    // applies all edits atomically; inside an open batch they simply join it
+    void SetCells(std::vector<std::pair<Position, std::string>> cells);
+
+    // Inverse of PrintTexts: reads delimiter-separated lines into the cells from A1 on, as
+    // one batch. Empty fields leave their cells untouched; there is no quoting, so fields
+    // cannot contain the delimiter or line breaks. A field that SetCell rejects aborts the
+    // load with TextLoadException and nothing is changed. Inside an open batch the load
+    // joins it, and a failed load undoes only its own edits.
+    void LoadTexts(std::istream& input, char delimiter = '\t');
+
+    // Eager recalculation. RecalculateDirty() computes every formula that has no cached
+    // value: they are split into dependency levels (DependencyGraph::Levelize) and the cells
+    // of each level are evaluated in parallel on a thread pool, each writing only its own
+    // cache, exactly once. RecalculateAll() drops every cached value first. Both return the
+    // number of formulas computed. Both hold the sheet exclusively, so readers wait for them.
+    // Inside an open batch they throw std::logic_error.
+    size_t RecalculateDirty();
+    size_t RecalculateAll();
+
+    // Background recalculation. While it is on, an edit returns as soon as the caches are
+    // invalidated and a worker thread recalculates the dirty formulas in dependency order.
+    // The worker reads the sheet alongside the readers, steps aside as soon as a writer
+    // waits and starts over after the edit. Switch the mode from the writer thread while
+    // no readers are running.
+    enum class ReadPolicy {
+        Compute,  // a dirty cell is evaluated on the calling thread
+        Wait,     // the caller waits until the worker has computed the cell
+    };
+    void SetBackgroundRecalc(bool enabled);
+    bool IsBackgroundRecalc() const;
+    // value of the cell at pos; a missing cell reads as an empty one. Inside an open batch
+    // it throws std::logic_error.
+    CellInterface::Value GetValue(Position pos, ReadPolicy policy = ReadPolicy::Compute);
+    // blocks until the worker has nothing left to compute (returns at once if it is off);
+    // the worker does not run inside a batch, so called in one it throws std::logic_error
+    void WaitRecalcIdle();
+
+    // Column-major cache of computed values for vectorized consumers: the segment of column
+    // pos.col holding row pos.row, i.e. ValueSpan::SIZE rows from a multiple of that, as a
+    // contiguous array of doubles with bitmaps of numbers and errors (see value_columns.h).
+    // Formulas of the segment without a value are computed first. The span stays valid
+    // until the next edit; readers may call this alongside each other like GetValue.
+    // Range functions in formulas read the same cache.
+    ValueSpan GetValueSpan(Position pos) const;
+
+    // Binary snapshot of the sheet (see snapshot.cpp for the layout): cell texts, every
+    // formula shape once as its compiled program, and optionally the computed formula
+    // values. Restoring parses and evaluates nothing; dependencies are relinked in one
+    // pass as in Commit(). The format is versioned and uses the byte order of the
+    // machine that wrote it. LoadSnapshot replaces the contents of the sheet; if the data
+    // is rejected it throws SnapshotException and leaves the sheet empty. Inside an open
+    // batch it throws std::logic_error.
+    void SaveSnapshot(std::ostream& output, bool with_values = false) const;
+    void LoadSnapshot(std::istream& input);
+
     Size GetPrintableSize() const override;
 
+    // -1 when the sheet is empty
+    int GetLastUsedRow() const;
+    int GetLastUsedCol() const;
+
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    // Window of size cells from top_left, in the same format as the whole-sheet versions
+    // (which print the window {0, 0}, GetPrintableSize()). Only the formulas of the window
+    // are computed, along with the cells they depend on, and the walk visits only the
+    // populated cells of the window, so the cost follows the window rather than the sheet.
+    // The window must lie within the sheet (an empty one prints nothing), otherwise
+    // InvalidPositionException is thrown.
+    void PrintValues(std::ostream& output, Position top_left, Size size) const;
+    void PrintTexts(std::ostream& output, Position top_left, Size size) const;
+    // Values of the window row by row: the cell at top_left + (r, c) is element
+    // r * size.cols + c. Missing cells read as empty ones, as with GetValue.
+    std::vector<CellInterface::Value> GetValues(Position top_left, Size size) const;
+
+    // compiled formulas shared by the cells of the sheet
+    FormulaPool& GetFormulaPool();
+    const FormulaPool& GetFormulaPool() const;
+
+    // Drops cached values of every cell depending on pos, directly or transitively.
+    // Each affected cell is visited once. Returns the number of caches dropped.
+    size_t InvalidateDependentCells(Position pos);
+
 private:
-    std::unordered_map<int, std::unordered_map<int, std::unique_ptr<Cell>>> sheet_; //u_map<row, u_map<col, Cell*>> 
-    Size min_size_;
-    std::vector<int> rows_;
-    std::vector<int> cols_;
-
-    void SetDependence(Position ref_pos, Position parent);
-    void ClearDependentCellCache(Position pos);
-    void DeleteDependence(Position pos, std::vector<Position>&& prev_refs);
-
-    void ExtractValue(std::ostream& output, const CellInterface::Value& val) const;
-    bool CheckCellExistance(Position) const;
-    void CheckCyclicDependences(Cell* copy_cell, Position pos);
-    void SearchCyclicDependences(Cell* cell, std::unordered_set<Position, PositionHash>& unic_cells) const;
-
-    void UpdateSize();
-    void MakeHigherSize();
-    void MakeLowerSize();
+    friend class EvaluationContext;
+
+    FormulaPool formulas_;  // declared before cells_ so that it outlives them
+    TiledGrid<Cell> cells_; // cells are stored inline in the tile slots
+    OccupancyIndex occupancy_;
+    DependencyGraph graph_;
+    // every change of a cell or of its cached value marks its segment stale; readers build
+    // segments, hence mutable
+    mutable ValueColumns values_;
+
+    // readers hold mutex_ shared, every other public call exclusively; new readers sleep
+    // on writers_gone_ while waiting_writers_ is not zero
+    mutable std::shared_mutex mutex_;
+    mutable std::atomic<int> waiting_writers_{ 0 };
+    mutable std::mutex writer_gate_;
+    mutable std::condition_variable writers_gone_;
+
+    // cells edited in the open batch and the contents of those that existed before it;
+    // in_batch_ is also read by the background worker outside mutex_
+    std::atomic<bool> in_batch_{ false };
+    std::vector<Position> batch_;
+    std::vector<std::pair<Position, Cell>> batch_saved_;
+    TiledGrid<bool> batch_touched_;
+
+    std::unique_ptr<ThreadPool> recalc_pool_;  // created by the first parallel level
+
+    struct BackgroundRecalc;
+    std::unique_ptr<BackgroundRecalc> background_;  // null while background mode is off
+
+    enum class Access {
+        Read,  // shared with other readers and the background worker
+        Edit,  // exclusive; the worker is asked to run again afterwards
+    };
+
+    // Holds mutex_ for the duration of one public call. Scopes nested on the same thread
+    // (SetCells -> SetCell) do nothing, the outermost one holds the lock.
+    class AccessScope {
+    public:
+        AccessScope(const Sheet& sheet, Access access);
+        ~AccessScope();
+
+        AccessScope(const AccessScope&) = delete;
+        AccessScope& operator=(const AccessScope&) = delete;
+
+    private:
+        const Sheet* sheet_;  // null for a nested scope
+        Access access_;
+    };
+
+    // throws std::logic_error while a batch is open
+    void CheckValuesReadable() const;
+    bool UpdateDependences(Position pos, const std::vector<Position>& refs, const std::vector<RangeReference>& ranges);
+    // Computes pos and every uncached formula it depends on, precedents first, with an
+    // explicit stack: each formula then finds its operands cached, so long chains of
+    // references never turn into deep recursion.
+    void EvaluateFormulas(Position pos) const;
+    void AddEmptyCell(Position pos);
+    // remembers what pos held before the batch touched it
+    void RecordBatchEdit(Position pos);
+    // puts the recorded contents back
+    void RestoreBatchCells();
+    // drops the caches of cells, which are batch cells, and of the transitive dependents of
+    // every batch cell
+    void InvalidateBatchCells(const std::vector<Position>& cells);
+    // returns the batch cells holding formulas
+    std::vector<Position> LinkBatchCells();
+    void EndBatch();
+    // runs edits in a batch of its own, unless one is already open
+    template <typename Edits>
+    void ApplyAsBatch(Edits&& edits);
+    // What the cells a load overwrites held before it, if the batch had already changed
+    // them; not kept when the load has a batch of its own, since the batch journal covers it.
+    using LoadJournal = std::vector<std::pair<Position, std::optional<Cell>>>;
+    void LoadRows(std::istream& input, char delimiter, LoadJournal* overwritten);
+    void LoadRow(std::string_view line, int row, char delimiter, LoadJournal* overwritten);
+    // sets a field inside the batch; text and numbers go in without a temporary string
+    void LoadCell(Position pos, std::string_view text);
+    // puts back what a failed load inside an open batch changed
+    void UndoLoad(size_t journal_mark, size_t saved_mark, LoadJournal& overwritten);
+    void ClearAll();
+    // computes the formulas of one dependency level
+    void EvaluateLevel(const std::vector<Position>& cells);
+    void RunBackgroundRecalc();
+    // one pass over the dirty formulas; false if it stopped early for a writer or stop
+    bool RecalculateInBackground();
+    // Segment holding pos, with the formulas in rows [pos.row, end_row) of it computed.
+    // A segment that still has formulas without a value elsewhere is not cached (computing
+    // them here could lead back into the formula being evaluated); the rows asked for are
+    // then read into scratch instead.
+    ValueSpan ReadValueSpan(Position pos, int end_row, ValueSegment& scratch) const;
+    // false if a formula of the rows has no value; the rest is filled anyway
+    bool FillValueSegment(Position first, int rows, ValueSegment& segment) const;
+
+    CellInterface::Value ReadValue(Position pos) const;
+    Cell* FindCell(Position pos);
+    const Cell* FindCell(Position pos) const;
 };
\ No newline at end of file
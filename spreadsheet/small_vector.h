@@ -0,0 +1,173 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <type_traits>
+
+// Vector with room for N elements inside the object itself; it only touches the heap once
+// it grows past N. Restricted to trivially copyable elements, which is all the dependency
+// bookkeeping needs and lets growth and copies be plain memcpy.
+template <typename T, size_t N>
+class SmallVector {
+	static_assert(std::is_trivially_copyable_v<T>, "SmallVector holds trivially copyable types only");
+	static_assert(N > 0, "inline capacity must be positive");
+
+public:
+	using value_type = T;
+	using iterator = T*;
+	using const_iterator = const T*;
+
+	SmallVector() = default;
+
+	SmallVector(const SmallVector& other) {
+		Append(other);
+	}
+
+	SmallVector(SmallVector&& other) noexcept {
+		Steal(other);
+	}
+
+	SmallVector& operator=(const SmallVector& rhs) {
+		if (this != &rhs) {
+			clear();
+			Append(rhs);
+		}
+		return *this;
+	}
+
+	SmallVector& operator=(SmallVector&& rhs) noexcept {
+		if (this != &rhs) {
+			Release();
+			Steal(rhs);
+		}
+		return *this;
+	}
+
+	~SmallVector() {
+		Release();
+	}
+
+	void push_back(const T& value) {
+		if (size_ == capacity_) {
+			Grow(capacity_ * 2);
+		}
+		data_[size_++] = value;
+	}
+
+	void pop_back() {
+		assert(size_ > 0);
+		--size_;
+	}
+
+	void clear() {
+		size_ = 0;
+	}
+
+	T& operator[](size_t index) {
+		assert(index < size_);
+		return data_[index];
+	}
+
+	const T& operator[](size_t index) const {
+		assert(index < size_);
+		return data_[index];
+	}
+
+	T& back() {
+		assert(size_ > 0);
+		return data_[size_ - 1];
+	}
+
+	const T& back() const {
+		assert(size_ > 0);
+		return data_[size_ - 1];
+	}
+
+	size_t size() const {
+		return size_;
+	}
+
+	bool empty() const {
+		return size_ == 0;
+	}
+
+	iterator begin() {
+		return data_;
+	}
+
+	iterator end() {
+		return data_ + size_;
+	}
+
+	const_iterator begin() const {
+		return data_;
+	}
+
+	const_iterator end() const {
+		return data_ + size_;
+	}
+
+private:
+	bool IsInline() const {
+		return data_ == InlineData();
+	}
+
+	T* InlineData() {
+		return reinterpret_cast<T*>(inline_);
+	}
+
+	const T* InlineData() const {
+		return reinterpret_cast<const T*>(inline_);
+	}
+
+	void Grow(uint32_t capacity) {
+		T* data = static_cast<T*>(::operator new(sizeof(T) * capacity));
+		std::memcpy(static_cast<void*>(data), data_, sizeof(T) * size_);
+		const uint32_t size = size_;
+		Release();
+		data_ = data;
+		size_ = size;
+		capacity_ = capacity;
+	}
+
+	void Append(const SmallVector& other) {
+		if (other.size_ > capacity_) {
+			Grow(other.size_);
+		}
+		std::memcpy(static_cast<void*>(data_), other.data_, sizeof(T) * other.size_);
+		size_ = other.size_;
+	}
+
+	// expects this to be empty and inline
+	void Steal(SmallVector& other) {
+		if (other.IsInline()) {
+			Append(other);
+		}
+		else {
+			data_ = other.data_;
+			size_ = other.size_;
+			capacity_ = other.capacity_;
+			other.data_ = other.InlineData();
+			other.capacity_ = N;
+		}
+		other.size_ = 0;
+	}
+
+	// frees the heap buffer, if any, and goes back to the inline one
+	void Release() {
+		if (!IsInline()) {
+			::operator delete(data_);
+			data_ = InlineData();
+			capacity_ = N;
+		}
+		size_ = 0;
+	}
+
+	T* data_ = InlineData();
+	uint32_t size_ = 0;
+	uint32_t capacity_ = N;
+	alignas(T) unsigned char inline_[sizeof(T) * N];
+};
@@ -0,0 +1,382 @@
+#include "sheet.h"
+
+#include "FormulaAST.h"
+#include "cell.h"
+
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// Layout of a snapshot, integers and doubles in the byte order of the writer:
+//   header  "SSNP", u32 version, u32 byte order mark 0x01020304, u32 flags
+//   shapes  u32 count, then per shape u32 instruction count and the instructions:
+//           u8 opcode, followed by f64 for a number, i16 row, i16 col offsets for a cell,
+//           u8 function, i16 row, i16 col, u16 rows, u16 cols for a range,
+//           u8 function for an argument, u8 function, u32 argument count for a call
+//   cells   u32 count, then per cell in row-major order u16 row, u16 col, u8 kind and
+//           for text:    u32 size and the bytes
+//           for formula: u32 shape index and, with FLAG_VALUES, u8 cache state followed
+//                        by f64 for a number or u8 category for an error
+// Dependencies are not stored: they follow from the formulas and are relinked on load.
+
+namespace {
+	constexpr std::string_view MAGIC = "SSNP";
+	constexpr uint32_t VERSION = 2;  // 1 had no ranges and functions, it reads the same
+	constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+	constexpr uint32_t FLAG_VALUES = 1;
+
+	static_assert(Position::MAX_ROWS <= 1 << 15 && Position::MAX_COLS <= 1 << 15,
+		"positions and offsets are stored in 16 bits");
+
+	enum class CellKind : uint8_t {
+		Empty,
+		Text,
+		Formula,
+	};
+
+	enum class CacheState : uint8_t {
+		None,
+		Number,
+		Error,
+	};
+
+	class SnapshotWriter {
+	public:
+		template <typename T>
+		void Put(T value) {
+			static_assert(std::is_trivially_copyable_v<T>);
+			const size_t offset = buffer_.size();
+			buffer_.resize(offset + sizeof(T));
+			std::memcpy(buffer_.data() + offset, &value, sizeof(T));
+		}
+
+		void PutBytes(std::string_view bytes) {
+			buffer_.append(bytes);
+		}
+
+		const std::string& GetBuffer() const {
+			return buffer_;
+		}
+
+	private:
+		std::string buffer_;
+	};
+
+	class SnapshotReader {
+	public:
+		explicit SnapshotReader(std::string_view data)
+			: data_(data) {
+		}
+
+		template <typename T>
+		T Get() {
+			static_assert(std::is_trivially_copyable_v<T>);
+			T value;
+			std::memcpy(&value, Take(sizeof(T)).data(), sizeof(T));
+			return value;
+		}
+
+		std::string_view Take(size_t size) {
+			if (size > data_.size()) {
+				throw SnapshotException("Snapshot is truncated");
+			}
+			const std::string_view bytes = data_.substr(0, size);
+			data_.remove_prefix(size);
+			return bytes;
+		}
+
+		bool AtEnd() const {
+			return data_.empty();
+		}
+
+	private:
+		std::string_view data_;
+	};
+
+	std::string ReadAll(std::istream& input) {
+		constexpr size_t CHUNK_SIZE = 1 << 20;
+		std::string data;
+		while (input) {
+			const size_t offset = data.size();
+			data.resize(offset + CHUNK_SIZE);
+			input.read(data.data() + offset, CHUNK_SIZE);
+			data.resize(offset + static_cast<size_t>(input.gcount()));
+		}
+		return data;
+	}
+
+	ASTImpl::Function ReadFunction(SnapshotReader& reader) {
+		const uint8_t function = reader.Get<uint8_t>();
+		if (function > static_cast<uint8_t>(ASTImpl::Function::Count)) {
+			throw SnapshotException("Unknown formula function");
+		}
+		return static_cast<ASTImpl::Function>(function);
+	}
+
+	std::vector<ASTImpl::Instruction> ReadProgram(SnapshotReader& reader) {
+		const uint32_t size = reader.Get<uint32_t>();
+		std::vector<ASTImpl::Instruction> program;
+		for (uint32_t i = 0; i < size; ++i) {
+			ASTImpl::Instruction instruction{};
+			const uint8_t code = reader.Get<uint8_t>();
+			if (code > static_cast<uint8_t>(ASTImpl::OpCode::Call)) {
+				throw SnapshotException("Unknown formula instruction");
+			}
+			instruction.code = static_cast<ASTImpl::OpCode>(code);
+			switch (instruction.code) {
+			case ASTImpl::OpCode::Number:
+				instruction.number = reader.Get<double>();
+				break;
+			case ASTImpl::OpCode::Cell:
+				instruction.cell.row = reader.Get<int16_t>();
+				instruction.cell.col = reader.Get<int16_t>();
+				break;
+			case ASTImpl::OpCode::Range:
+				instruction.function = ReadFunction(reader);
+				instruction.range.row = reader.Get<int16_t>();
+				instruction.range.col = reader.Get<int16_t>();
+				instruction.range.rows = reader.Get<uint16_t>();
+				instruction.range.cols = reader.Get<uint16_t>();
+				break;
+			case ASTImpl::OpCode::Argument:
+				instruction.function = ReadFunction(reader);
+				break;
+			case ASTImpl::OpCode::Call:
+				instruction.function = ReadFunction(reader);
+				instruction.arg_count = reader.Get<uint32_t>();
+				break;
+			default:
+				break;
+			}
+			program.push_back(instruction);
+		}
+		return program;
+	}
+}// namespace
+
+void Sheet::SaveSnapshot(std::ostream& output, bool with_values) const {
+	AccessScope scope(*this, Access::Read);
+	if (with_values) {
+		CheckValuesReadable();
+	}
+	SnapshotWriter writer;
+	writer.PutBytes(MAGIC);
+	writer.Put(VERSION);
+	writer.Put(BYTE_ORDER_MARK);
+	writer.Put(with_values ? FLAG_VALUES : uint32_t{ 0 });
+
+	// формы нумеруются в порядке первой встречи
+	std::unordered_map<const SharedFormula*, uint32_t> shape_index;
+	std::vector<const SharedFormula*> shapes;
+	cells_.ForEach([&](Position, const Cell& cell) {
+		if (const FormulaImpl* formula = cell.GetFormulaImpl()) {
+			const SharedFormula* shape = &formula->GetFormula();
+			if (shape_index.emplace(shape, static_cast<uint32_t>(shapes.size())).second) {
+				shapes.push_back(shape);
+			}
+		}
+	});
+
+	writer.Put(static_cast<uint32_t>(shapes.size()));
+	for (const SharedFormula* shape : shapes) {
+		const auto& program = shape->GetAST().GetProgram();
+		writer.Put(static_cast<uint32_t>(program.size()));
+		for (const ASTImpl::Instruction& instruction : program) {
+			writer.Put(static_cast<uint8_t>(instruction.code));
+			switch (instruction.code) {
+			case ASTImpl::OpCode::Number:
+				writer.Put(instruction.number);
+				break;
+			case ASTImpl::OpCode::Cell:
+				writer.Put(static_cast<int16_t>(instruction.cell.row));
+				writer.Put(static_cast<int16_t>(instruction.cell.col));
+				break;
+			case ASTImpl::OpCode::Range:
+				writer.Put(static_cast<uint8_t>(instruction.function));
+				writer.Put(instruction.range.row);
+				writer.Put(instruction.range.col);
+				writer.Put(instruction.range.rows);
+				writer.Put(instruction.range.cols);
+				break;
+			case ASTImpl::OpCode::Argument:
+				writer.Put(static_cast<uint8_t>(instruction.function));
+				break;
+			case ASTImpl::OpCode::Call:
+				writer.Put(static_cast<uint8_t>(instruction.function));
+				writer.Put(instruction.arg_count);
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	writer.Put(static_cast<uint32_t>(cells_.Size()));
+	cells_.ForEach([&](Position pos, const Cell& cell) {
+		writer.Put(static_cast<uint16_t>(pos.row));
+		writer.Put(static_cast<uint16_t>(pos.col));
+		if (const FormulaImpl* formula = cell.GetFormulaImpl()) {
+			writer.Put(CellKind::Formula);
+			writer.Put(shape_index.at(&formula->GetFormula()));
+			if (with_values) {
+				const auto value = formula->GetCachedValue();
+				if (!value) {
+					writer.Put(CacheState::None);
+				}
+				else if (std::holds_alternative<double>(*value)) {
+					writer.Put(CacheState::Number);
+					writer.Put(std::get<double>(*value));
+				}
+				else {
+					writer.Put(CacheState::Error);
+					writer.Put(static_cast<uint8_t>(std::get<FormulaError>(*value).GetCategory()));
+				}
+			}
+			return;
+		}
+		const std::string text = cell.GetText();
+		if (text.empty()) {
+			writer.Put(CellKind::Empty);
+			return;
+		}
+		writer.Put(CellKind::Text);
+		writer.Put(static_cast<uint32_t>(text.size()));
+		writer.PutBytes(text);
+	});
+
+	const std::string& buffer = writer.GetBuffer();
+	output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+}
+
+void Sheet::LoadSnapshot(std::istream& input) {
+	const std::string data = ReadAll(input);
+	AccessScope scope(*this, Access::Edit);
+	if (in_batch_) {
+		throw std::logic_error("cannot load a snapshot into an open batch");
+	}
+	ClearAll();
+	try {
+		SnapshotReader reader(data);
+		if (reader.Take(MAGIC.size()) != MAGIC) {
+			throw SnapshotException("Not a sheet snapshot");
+		}
+		const uint32_t version = reader.Get<uint32_t>();
+		if (version == 0 || version > VERSION) {
+			throw SnapshotException("Unsupported snapshot version");
+		}
+		if (reader.Get<uint32_t>() != BYTE_ORDER_MARK) {
+			throw SnapshotException("Snapshot was written with another byte order");
+		}
+		const uint32_t flags = reader.Get<uint32_t>();
+		if (flags & ~FLAG_VALUES) {
+			throw SnapshotException("Unknown snapshot flags");
+		}
+
+		// форма регистрируется в пуле у первой ячейки, которая её использует
+		const uint32_t shape_count = reader.Get<uint32_t>();
+		std::vector<FormulaAST> asts;
+		for (uint32_t i = 0; i < shape_count; ++i) {
+			asts.push_back(BuildFormulaAST(ReadProgram(reader)));
+		}
+		std::vector<std::shared_ptr<const SharedFormula>> shapes(asts.size());
+
+		std::vector<Position> formula_cells;
+		const uint32_t cell_count = reader.Get<uint32_t>();
+		for (uint32_t i = 0; i < cell_count; ++i) {
+			Position pos;
+			pos.row = reader.Get<uint16_t>();
+			pos.col = reader.Get<uint16_t>();
+			if (!pos.IsValid() || FindCell(pos)) {
+				throw SnapshotException("Invalid cell position in snapshot");
+			}
+
+			Cell cell(this);
+			switch (reader.Get<CellKind>()) {
+			case CellKind::Empty:
+				break;
+			case CellKind::Text: {
+				const uint32_t size = reader.Get<uint32_t>();
+				cell.Set(std::string(reader.Take(size)), pos);
+				break;
+			}
+			case CellKind::Formula: {
+				const uint32_t index = reader.Get<uint32_t>();
+				if (index >= shapes.size()) {
+					throw SnapshotException("Invalid formula index in snapshot");
+				}
+				if (!shapes[index]) {
+					shapes[index] = formulas_.Adopt(std::move(asts[index]), pos);
+				}
+				cell.SetFormula(shapes[index], pos);
+				if (flags & FLAG_VALUES) {
+					FormulaImpl& formula = *cell.GetFormulaImpl();
+					switch (reader.Get<CacheState>()) {
+					case CacheState::None:
+						break;
+					case CacheState::Number:
+						formula.SetCachedValue(reader.Get<double>());
+						break;
+					case CacheState::Error: {
+						const uint8_t category = reader.Get<uint8_t>();
+						if (category > static_cast<uint8_t>(FormulaError::Category::Arithmetic)) {
+							throw SnapshotException("Invalid error category in snapshot");
+						}
+						formula.SetCachedValue(FormulaError{ static_cast<FormulaError::Category>(category) });
+						break;
+					}
+					default:
+						throw SnapshotException("Invalid cached value in snapshot");
+					}
+				}
+				const FormulaImpl& formula = *cell.GetFormulaImpl();
+				for (Position ref_pos : formula.GetSingleReferences()) {
+					if (!ref_pos.IsValid()) {
+						throw SnapshotException("Invalid reference in snapshot");
+					}
+					graph_.AddEdgeUnchecked(pos, ref_pos);
+				}
+				for (const RangeReference& range : formula.GetRangeReferences()) {
+					const Position bottom_right{ range.top_left.row + range.size.rows - 1, range.top_left.col + range.size.cols - 1 };
+					if (!range.top_left.IsValid() || !bottom_right.IsValid()) {
+						throw SnapshotException("Invalid reference in snapshot");
+					}
+					graph_.AddRangeUnchecked(pos, range.top_left, range.size);
+				}
+				formula_cells.push_back(pos);
+				break;
+			}
+			default:
+				throw SnapshotException("Invalid cell kind in snapshot");
+			}
+			occupancy_.Add(pos);
+			cells_.Emplace(pos, std::move(cell));
+		}
+		if (!reader.AtEnd()) {
+			throw SnapshotException("Unexpected data after snapshot");
+		}
+
+		if (!graph_.RebuildOrder()) {
+			throw SnapshotException("Snapshot has a circular dependency");
+		}
+		for (Position pos : formula_cells) {
+			graph_.ForEachPrecedent(pos, [this](Position ref_pos) {
+				AddEmptyCell(ref_pos);
+			});
+		}
+	}
+	catch (const SnapshotException&) {
+		ClearAll();
+		throw;
+	}
+	catch (const std::exception& exc) {
+		ClearAll();
+		std::throw_with_nested(SnapshotException(exc.what()));
+	}
+}
@@ -1,14 +1,9 @@
 #include "common.h"
 
-#include <cctype>
-#include <sstream>
-
-#include <array>
-#include <vector>
+#include <algorithm>
+#include <system_error>
 
 const int ALPHA_SIZE = 26;
-const int MAX_POSITION_LENGTH = 8;
-const int ANSI_A_INDEX = 65;
 
 const Position Position::NONE = { -1, -1 };
 
@@ -37,19 +32,6 @@ std::string_view FormulaError::ToString() const {
 	return "";
 }
 
-size_t PositionHash::operator()(Position pos) const {
-	return std::hash<std::string>()(pos.ToString());
-}
-
-
-bool Position::operator==(const Position rhs) const {
-	return rhs.row == row && rhs.col == col;
-}
-
-bool Position::operator<(const Position rhs) const {
-	return col <= rhs.col ? row < rhs.row : false;
-}
-
 bool Position::IsValid() const {
 	static const int MAX_VAL = 16384;
 	bool negative = col < 0 || row < 0;
@@ -58,57 +40,26 @@ bool Position::IsValid() const {
 }
 
 std::string Position::ToString() const {
-	if (!IsValid()) {
-		return "";
-	}
-	std::vector<char> letters;
-	int c = col;
-	do {
-		letters.push_back(c % ALPHA_SIZE + ANSI_A_INDEX);
-		c /= ALPHA_SIZE;
-		--c;
-	} while (c >= 0);
-	std::string result(letters.rbegin(), letters.rend());
-	result += std::to_string(row + 1);
-	return result;
+	char buffer[MAX_STRING_LENGTH];
+	const auto [end, error] = ToChars(buffer, buffer + sizeof(buffer));
+	return error == std::errc{} ? std::string(buffer, end) : std::string{};
 }
 
-Position Position::FromString(std::string_view str) {
-	if (str.empty() || str.size() > MAX_POSITION_LENGTH) {
-		return NONE;
-	}
-	size_t i = 0;
-	while (std::isalpha(str[i])) {
-		++i;
-		if (i == str.size()) {
-			return NONE;
-		}
-	}
-	Position res;
-	std::string_view letters = str.substr(0, i);
-	res.col = letters.empty() ? -1 : 0;
-	int pow = 1;
-	bool is_not_first = false;
-	for (auto it = letters.rbegin(); it < letters.rend(); ++it) {
-		if (*it - ANSI_A_INDEX > ALPHA_SIZE) {
-			res = NONE;
-			break;
-		}
-		res.col += (*it - ANSI_A_INDEX + is_not_first) * pow;
-		pow *= ALPHA_SIZE;
-		is_not_first = true;
+std::to_chars_result Position::ToChars(char* first, char* last) const {
+	if (!IsValid()) {
+		return { first, std::errc::invalid_argument };
 	}
-	std::string_view numbers = str.substr(i, str.npos);
-	for (auto it = numbers.begin(); it < numbers.end(); ++it) {
-		if (!std::isdigit(*it)) {
-			return NONE;
-		}
+	// буквы столбца получаются с младшей, в биективной записи по основанию 26
+	char letters[MAX_STRING_LENGTH];
+	int count = 0;
+	for (int c = col + 1; c > 0; c = (c - 1) / ALPHA_SIZE) {
+		letters[count++] = static_cast<char>('A' + (c - 1) % ALPHA_SIZE);
 	}
-	res.row = std::stoi(std::string(numbers));
-	if (res.row <= 0) {
-		return NONE;
+	if (last - first < count) {
+		return { last, std::errc::value_too_large };
 	}
-	return { res.row - 1, res.col };
+	first = std::reverse_copy(letters, letters + count, first);
+	return std::to_chars(first, last, row + 1);
 }
 
 bool Size::operator==(Size rhs) const {
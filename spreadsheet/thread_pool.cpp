@@ -0,0 +1,98 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <utility>
+
+ThreadPool::ThreadPool(size_t thread_count) {
+	for (size_t i = 1; i < thread_count; ++i) {
+		workers_.emplace_back([this] {
+			WorkerLoop();
+		});
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard lock(mutex_);
+		stop_ = true;
+	}
+	wake_.notify_all();
+	for (std::thread& worker : workers_) {
+		worker.join();
+	}
+}
+
+size_t ThreadPool::GetThreadCount() const {
+	return workers_.size() + 1;
+}
+
+void ThreadPool::ParallelFor(size_t count, size_t chunk_size, const std::function<void(size_t, size_t)>& func) {
+	chunk_size = std::max<size_t>(chunk_size, 1);
+	if (workers_.empty() || count <= chunk_size) {
+		if (count > 0) {
+			func(0, count);
+		}
+		return;
+	}
+	{
+		std::lock_guard lock(mutex_);
+		job_ = &func;
+		count_ = count;
+		chunk_size_ = chunk_size;
+		next_ = 0;
+		error_ = nullptr;
+		active_ = workers_.size();
+		++generation_;
+	}
+	wake_.notify_all();
+	RunChunks();
+
+	std::unique_lock lock(mutex_);
+	done_.wait(lock, [this] {
+		return active_ == 0;
+	});
+	job_ = nullptr;
+	if (error_) {
+		std::rethrow_exception(std::exchange(error_, nullptr));
+	}
+}
+
+void ThreadPool::WorkerLoop() {
+	size_t seen_generation = 0;
+	std::unique_lock lock(mutex_);
+	while (true) {
+		wake_.wait(lock, [&] {
+			return stop_ || generation_ != seen_generation;
+		});
+		if (stop_) {
+			return;
+		}
+		seen_generation = generation_;
+		lock.unlock();
+		RunChunks();
+		lock.lock();
+		if (--active_ == 0) {
+			done_.notify_one();
+		}
+	}
+}
+
+void ThreadPool::RunChunks() {
+	while (true) {
+		const size_t begin = next_.fetch_add(chunk_size_);
+		if (begin >= count_) {
+			return;
+		}
+		try {
+			(*job_)(begin, std::min(begin + chunk_size_, count_));
+		}
+		catch (...) {
+			std::lock_guard lock(mutex_);
+			if (!error_) {
+				error_ = std::current_exception();
+			}
+			// остальные куски уже не раздаём
+			next_ = count_;
+		}
+	}
+}
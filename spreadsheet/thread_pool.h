@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for data-parallel loops.
+// ParallelFor hands out chunks of the index range through one atomic counter, so a thread
+// that is done with its chunk simply takes the next one and fast threads pick up the work
+// of slow ones; the calling thread takes part as well. One loop runs at a time.
+class ThreadPool {
+public:
+	// thread_count includes the calling thread; 1 runs every loop inline
+	explicit ThreadPool(size_t thread_count = std::thread::hardware_concurrency());
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	size_t GetThreadCount() const;
+
+	// Calls func(begin, end) for consecutive chunks of [0, count) of at most chunk_size
+	// indices and returns when all of them are done. The first exception thrown by func
+	// is rethrown here; chunks not started by then are skipped.
+	void ParallelFor(size_t count, size_t chunk_size, const std::function<void(size_t, size_t)>& func);
+
+private:
+	void WorkerLoop();
+	void RunChunks();
+
+	std::vector<std::thread> workers_;
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	std::condition_variable done_;
+	bool stop_ = false;
+	size_t generation_ = 0;  // number of loops started, wakes the workers
+	size_t active_ = 0;      // workers still inside the current loop
+
+	// the current loop; written under mutex_ before the workers are woken
+	const std::function<void(size_t, size_t)>* job_ = nullptr;
+	size_t count_ = 0;
+	size_t chunk_size_ = 1;
+	std::atomic<size_t> next_{ 0 };
+	std::exception_ptr error_;
+};
@@ -0,0 +1,298 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Sparse Position -> T storage.
+// The sheet is split into TILE_SIZE x TILE_SIZE tiles. The tile directory is a flat array
+// indexed by (tile row, tile column), so a lookup is a couple of shifts and two array reads,
+// no hashing. Inside a tile the slots are dense and row-major, and every tile row keeps a
+// 64-bit occupancy mask, so row scans touch contiguous memory and skip empty slots by bits.
+// A tile is released as soon as its last slot is erased.
+template <typename T>
+class TiledGrid {
+public:
+	static constexpr int TILE_SHIFT = 6;
+	static constexpr int TILE_SIZE = 1 << TILE_SHIFT;
+	static constexpr int TILE_MASK = TILE_SIZE - 1;
+	static constexpr int TILE_ROWS = (Position::MAX_ROWS + TILE_SIZE - 1) / TILE_SIZE;
+	static constexpr int TILE_COLS = (Position::MAX_COLS + TILE_SIZE - 1) / TILE_SIZE;
+
+	static_assert(TILE_SIZE == 64, "a tile row occupancy mask is one uint64_t");
+
+	TiledGrid()
+		: tiles_(static_cast<size_t>(TILE_ROWS) * TILE_COLS) {
+	}
+
+	TiledGrid(const TiledGrid&) = delete;
+	TiledGrid& operator=(const TiledGrid&) = delete;
+	TiledGrid(TiledGrid&&) = default;
+	TiledGrid& operator=(TiledGrid&&) = default;
+	~TiledGrid() = default;
+
+	T* Find(Position pos) {
+		Tile* tile = tiles_[TileIndex(pos)].get();
+		return tile && tile->Has(pos) ? &tile->At(pos) : nullptr;
+	}
+
+	const T* Find(Position pos) const {
+		const Tile* tile = tiles_[TileIndex(pos)].get();
+		return tile && tile->Has(pos) ? &tile->At(pos) : nullptr;
+	}
+
+	bool Contains(Position pos) const {
+		return Find(pos) != nullptr;
+	}
+
+	// Creates the value in place, replacing the previous one if the slot is taken.
+	template <typename... Args>
+	T& Emplace(Position pos, Args&&... args) {
+		auto& tile = tiles_[TileIndex(pos)];
+		if (!tile) {
+			tile = std::make_unique<Tile>();
+		}
+		if (tile->Has(pos)) {
+			tile->Destroy(pos);
+			--size_;
+		}
+		T& value = tile->Construct(pos, std::forward<Args>(args)...);
+		++size_;
+		return value;
+	}
+
+	// Returns false if there was nothing to erase.
+	bool Erase(Position pos) {
+		auto& tile = tiles_[TileIndex(pos)];
+		if (!tile || !tile->Has(pos)) {
+			return false;
+		}
+		tile->Destroy(pos);
+		--size_;
+		if (tile->Empty()) {
+			tile.reset();
+		}
+		return true;
+	}
+
+	size_t Size() const {
+		return size_;
+	}
+
+	bool Empty() const {
+		return size_ == 0;
+	}
+
+	void Clear() {
+		for (auto& tile : tiles_) {
+			tile.reset();
+		}
+		size_ = 0;
+	}
+
+	// Calls func(col, value) for every populated slot of the row with col in [first_col, last_col),
+	// in increasing column order.
+	template <typename Func>
+	void ForEachInRow(int row, int first_col, int last_col, Func&& func) const {
+		if (first_col >= last_col) {
+			return;
+		}
+		const int tile_row = row >> TILE_SHIFT;
+		const int local_row = row & TILE_MASK;
+		const int last_tile_col = (last_col - 1) >> TILE_SHIFT;
+		for (int tile_col = first_col >> TILE_SHIFT; tile_col <= last_tile_col; ++tile_col) {
+			const Tile* tile = tiles_[static_cast<size_t>(tile_row) * TILE_COLS + tile_col].get();
+			if (!tile) {
+				continue;
+			}
+			uint64_t mask = tile->occupied[local_row] & ColumnMask(tile_col, first_col, last_col);
+			const int base_col = tile_col << TILE_SHIFT;
+			while (mask) {
+				const int bit = CountTrailingZeros(mask);
+				mask &= mask - 1;
+				func(base_col + bit, tile->Slot(local_row, bit));
+			}
+		}
+	}
+
+	// Calls func(pos, value) for every populated slot of the rectangle, tile by tile;
+	// tiles that are not allocated cost one directory read each.
+	template <typename Func>
+	void ForEachInRect(Position top_left, ::Size size, Func&& func) const {
+		if (size.rows <= 0 || size.cols <= 0) {
+			return;
+		}
+		const int last_row = top_left.row + size.rows;
+		const int last_col = top_left.col + size.cols;
+		for (int tile_row = top_left.row >> TILE_SHIFT; tile_row <= (last_row - 1) >> TILE_SHIFT; ++tile_row) {
+			const int base_row = tile_row << TILE_SHIFT;
+			const int first_local = top_left.row > base_row ? top_left.row - base_row : 0;
+			const int last_local = last_row - base_row < TILE_SIZE ? last_row - base_row : TILE_SIZE;
+			for (int tile_col = top_left.col >> TILE_SHIFT; tile_col <= (last_col - 1) >> TILE_SHIFT; ++tile_col) {
+				const Tile* tile = tiles_[static_cast<size_t>(tile_row) * TILE_COLS + tile_col].get();
+				if (!tile) {
+					continue;
+				}
+				const uint64_t columns = ColumnMask(tile_col, top_left.col, last_col);
+				const int base_col = tile_col << TILE_SHIFT;
+				for (int local_row = first_local; local_row < last_local; ++local_row) {
+					uint64_t mask = tile->occupied[local_row] & columns;
+					while (mask) {
+						const int bit = CountTrailingZeros(mask);
+						mask &= mask - 1;
+						func(Position{ base_row + local_row, base_col + bit }, tile->Slot(local_row, bit));
+					}
+				}
+			}
+		}
+	}
+
+	// Calls func(pos, value) for every populated slot in row-major order.
+	template <typename Func>
+	void ForEach(Func&& func) const {
+		ForEachInRectByRows(Position{ 0, 0 }, ::Size{ Position::MAX_ROWS, Position::MAX_COLS }, func);
+	}
+
+	// Calls func(pos, value) for every populated slot of the rectangle in row-major order.
+	template <typename Func>
+	void ForEachInRectByRows(Position top_left, ::Size size, Func&& func) const {
+		if (size.rows <= 0 || size.cols <= 0) {
+			return;
+		}
+		const int last_row = top_left.row + size.rows;
+		const int last_col = top_left.col + size.cols;
+		const int first_tile_col = top_left.col >> TILE_SHIFT;
+		const int last_tile_col = (last_col - 1) >> TILE_SHIFT;
+		// rows of tiles are scanned for allocated tiles once, not once per cell row
+		std::array<int, TILE_COLS> populated;
+		std::array<uint64_t, TILE_COLS> columns;
+		for (int tile_row = top_left.row >> TILE_SHIFT; tile_row <= (last_row - 1) >> TILE_SHIFT; ++tile_row) {
+			const auto* row_begin = &tiles_[static_cast<size_t>(tile_row) * TILE_COLS];
+			int populated_count = 0;
+			for (int tile_col = first_tile_col; tile_col <= last_tile_col; ++tile_col) {
+				if (row_begin[tile_col]) {
+					columns[populated_count] = ColumnMask(tile_col, top_left.col, last_col);
+					populated[populated_count++] = tile_col;
+				}
+			}
+			const int base_row = tile_row << TILE_SHIFT;
+			const int first_local = top_left.row > base_row ? top_left.row - base_row : 0;
+			const int last_local = last_row - base_row < TILE_SIZE ? last_row - base_row : TILE_SIZE;
+			for (int local_row = first_local; populated_count > 0 && local_row < last_local; ++local_row) {
+				const int row = base_row + local_row;
+				for (int i = 0; i < populated_count; ++i) {
+					const int tile_col = populated[i];
+					const Tile* tile = row_begin[tile_col].get();
+					uint64_t mask = tile->occupied[local_row] & columns[i];
+					while (mask) {
+						const int bit = CountTrailingZeros(mask);
+						mask &= mask - 1;
+						func(Position{ row, (tile_col << TILE_SHIFT) + bit }, tile->Slot(local_row, bit));
+					}
+				}
+			}
+		}
+	}
+
+private:
+	struct Tile {
+		// user-provided so that make_unique does not zero the slot storage
+		Tile() {
+		}
+		Tile(const Tile&) = delete;
+		Tile& operator=(const Tile&) = delete;
+
+		~Tile() {
+			for (int local_row = 0; local_row < TILE_SIZE; ++local_row) {
+				uint64_t mask = occupied[local_row];
+				while (mask) {
+					const int bit = CountTrailingZeros(mask);
+					mask &= mask - 1;
+					Slot(local_row, bit).~T();
+				}
+			}
+		}
+
+		bool Has(Position pos) const {
+			return (occupied[pos.row & TILE_MASK] >> (pos.col & TILE_MASK)) & 1u;
+		}
+
+		bool Empty() const {
+			return count == 0;
+		}
+
+		T& At(Position pos) {
+			return Slot(pos.row & TILE_MASK, pos.col & TILE_MASK);
+		}
+
+		const T& At(Position pos) const {
+			return Slot(pos.row & TILE_MASK, pos.col & TILE_MASK);
+		}
+
+		T& Slot(int local_row, int local_col) {
+			return *std::launder(reinterpret_cast<T*>(&slots[local_row * TILE_SIZE + local_col]));
+		}
+
+		const T& Slot(int local_row, int local_col) const {
+			return *std::launder(reinterpret_cast<const T*>(&slots[local_row * TILE_SIZE + local_col]));
+		}
+
+		template <typename... Args>
+		T& Construct(Position pos, Args&&... args) {
+			auto* slot = &slots[(pos.row & TILE_MASK) * TILE_SIZE + (pos.col & TILE_MASK)];
+			T* value = ::new (static_cast<void*>(slot)) T(std::forward<Args>(args)...);
+			occupied[pos.row & TILE_MASK] |= uint64_t{ 1 } << (pos.col & TILE_MASK);
+			++count;
+			return *value;
+		}
+
+		void Destroy(Position pos) {
+			At(pos).~T();
+			occupied[pos.row & TILE_MASK] &= ~(uint64_t{ 1 } << (pos.col & TILE_MASK));
+			--count;
+		}
+
+		struct SlotStorage {
+			alignas(T) unsigned char bytes[sizeof(T)];
+		};
+
+		std::array<uint64_t, TILE_SIZE> occupied{};
+		int count = 0;
+		SlotStorage slots[TILE_SIZE * TILE_SIZE];
+	};
+
+	static size_t TileIndex(Position pos) {
+		return static_cast<size_t>(pos.row >> TILE_SHIFT) * TILE_COLS + (pos.col >> TILE_SHIFT);
+	}
+
+	// bits of the tile columns that fall into [first_col, last_col)
+	static uint64_t ColumnMask(int tile_col, int first_col, int last_col) {
+		const int base_col = tile_col << TILE_SHIFT;
+		const int from = first_col > base_col ? first_col - base_col : 0;
+		const int to = last_col - base_col < TILE_SIZE ? last_col - base_col : TILE_SIZE;
+		const uint64_t upper = to == TILE_SIZE ? ~uint64_t{ 0 } : (uint64_t{ 1 } << to) - 1;
+		return upper & ~((uint64_t{ 1 } << from) - 1);
+	}
+
+	static int CountTrailingZeros(uint64_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+		return __builtin_ctzll(mask);
+#else
+		int bit = 0;
+		while (!(mask & 1u)) {
+			mask >>= 1;
+			++bit;
+		}
+		return bit;
+#endif
+	}
+
+	std::vector<std::unique_ptr<Tile>> tiles_;
+	size_t size_ = 0;
+};
@@ -0,0 +1,122 @@
+#include "value_columns.h"
+
+#include <algorithm>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+void ValueSegment::Reset() {
+	std::fill(std::begin(values), std::end(values), 0.0);
+	std::fill(std::begin(numbers), std::end(numbers), 0);
+	std::fill(std::begin(errors), std::end(errors), 0);
+}
+
+size_t ValueSpan::CountNumbers(int begin, int end) const {
+	size_t count = 0;
+	for (int word = begin / 64; begin < end && word <= (end - 1) / 64; ++word) {
+		count += CountBits(segment_->numbers[word] & WordMask(word, begin, end));
+	}
+	return count;
+}
+
+bool ValueSpan::AllNumbers(int begin, int end) const {
+	for (int word = begin / 64; begin < end && word <= (end - 1) / 64; ++word) {
+		const uint64_t mask = WordMask(word, begin, end);
+		if ((segment_->numbers[word] & mask) != mask) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int ValueSpan::FindError(int begin, int end) const {
+	for (int word = begin / 64; begin < end && word <= (end - 1) / 64; ++word) {
+		if (const uint64_t mask = segment_->errors[word] & WordMask(word, begin, end)) {
+			return word * 64 + CountTrailingZeros(mask);
+		}
+	}
+	return end;
+}
+
+uint64_t ValueSpan::WordMask(int word, int begin, int end) {
+	const int base = word * 64;
+	const int from = begin > base ? begin - base : 0;
+	const int to = end - base < 64 ? end - base : 64;
+	const uint64_t upper = to == 64 ? ~uint64_t{ 0 } : (uint64_t{ 1 } << to) - 1;
+	return upper & ~((uint64_t{ 1 } << from) - 1);
+}
+
+int ValueSpan::CountBits(uint64_t mask) {
+#if defined(_MSC_VER)
+	return static_cast<int>(__popcnt64(mask));
+#else
+	return __builtin_popcountll(mask);
+#endif
+}
+
+int ValueSpan::CountTrailingZeros(uint64_t mask) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, mask);
+	return static_cast<int>(index);
+#else
+	return __builtin_ctzll(mask);
+#endif
+}
+
+ValueColumns::ValueColumns()
+	: columns_(new std::atomic<Column*>[Position::MAX_COLS]()) {
+}
+
+ValueColumns::~ValueColumns() {
+	Clear();
+}
+
+void ValueColumns::MarkStale(Position pos) {
+	Column* column = columns_[pos.col].load(std::memory_order_relaxed);
+	if (!column) {
+		return;
+	}
+	if (Entry* entry = column->entries[pos.row / SEGMENT_ROWS].load(std::memory_order_relaxed)) {
+		entry->fresh.store(false, std::memory_order_relaxed);
+	}
+}
+
+void ValueColumns::Clear() {
+	for (int col = 0; col < Position::MAX_COLS; ++col) {
+		Column* column = columns_[col].exchange(nullptr, std::memory_order_relaxed);
+		if (!column) {
+			continue;
+		}
+		for (std::atomic<Entry*>& entry : column->entries) {
+			delete entry.load(std::memory_order_relaxed);
+		}
+		delete column;
+	}
+}
+
+const ValueSegment* ValueColumns::FindFresh(Position pos) const {
+	const Entry* entry = FindEntry(pos);
+	return entry && entry->fresh.load(std::memory_order_acquire) ? &entry->segment : nullptr;
+}
+
+const ValueColumns::Entry* ValueColumns::FindEntry(Position pos) const {
+	const Column* column = columns_[pos.col].load(std::memory_order_acquire);
+	return column ? column->entries[pos.row / SEGMENT_ROWS].load(std::memory_order_acquire) : nullptr;
+}
+
+ValueColumns::Entry& ValueColumns::GetEntry(Position pos) {
+	Column* column = columns_[pos.col].load(std::memory_order_relaxed);
+	if (!column) {
+		column = new Column;
+		columns_[pos.col].store(column, std::memory_order_release);
+	}
+	std::atomic<Entry*>& slot = column->entries[pos.row / SEGMENT_ROWS];
+	Entry* entry = slot.load(std::memory_order_relaxed);
+	if (!entry) {
+		entry = new Entry;
+		slot.store(entry, std::memory_order_release);
+	}
+	return *entry;
+}
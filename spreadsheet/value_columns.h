@@ -0,0 +1,151 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+// Computed values of SEGMENT_ROWS consecutive cells of one column, laid out for vector
+// loops: the numbers in a contiguous double array, plus one bitmap of the cells that hold
+// a number and one of the cells whose formula evaluated to an error. Slots without a
+// number hold 0, so a plain sum over the array is the sum of the numbers. Cells read as
+// in a range given to a function: empty cells and text that is not a number are neither.
+struct ValueSegment {
+	static constexpr int SEGMENT_ROWS = 256;
+	static constexpr int MASK_WORDS = SEGMENT_ROWS / 64;
+
+	double values[SEGMENT_ROWS];
+	uint64_t numbers[MASK_WORDS];
+	uint64_t errors[MASK_WORDS];
+	FormulaError::Category categories[SEGMENT_ROWS];  // meaningful where the error bit is set
+
+	void Reset();
+	void SetNumber(int index, double value) {
+		values[index] = value;
+		numbers[index / 64] |= uint64_t{ 1 } << (index % 64);
+	}
+	void SetError(int index, FormulaError::Category category) {
+		categories[index] = category;
+		errors[index / 64] |= uint64_t{ 1 } << (index % 64);
+	}
+};
+
+// Read-only view of a ValueSegment; indices are rows counted from GetFirstRow().
+// The queries over [begin, end) work on whole bitmap words.
+class ValueSpan {
+public:
+	static constexpr int SIZE = ValueSegment::SEGMENT_ROWS;
+
+	ValueSpan(const ValueSegment& segment, int first_row)
+		: segment_(&segment)
+		, first_row_(first_row) {
+	}
+
+	int GetFirstRow() const {
+		return first_row_;
+	}
+	const double* GetValues() const {
+		return segment_->values;
+	}
+	bool IsNumber(int index) const {
+		return (segment_->numbers[index / 64] >> (index % 64)) & 1;
+	}
+	bool IsError(int index) const {
+		return (segment_->errors[index / 64] >> (index % 64)) & 1;
+	}
+	FormulaError::Category GetError(int index) const {
+		return segment_->categories[index];
+	}
+
+	size_t CountNumbers(int begin, int end) const;
+	bool AllNumbers(int begin, int end) const;
+	// index of the first error, or end if there is none
+	int FindError(int begin, int end) const;
+
+	// func(double) for every number in [begin, end), in row order
+	template <typename Func>
+	void ForEachNumber(int begin, int end, Func&& func) const {
+		for (int word = begin / 64; word <= (end - 1) / 64 && begin < end; ++word) {
+			uint64_t mask = segment_->numbers[word] & WordMask(word, begin, end);
+			while (mask) {
+				const int bit = CountTrailingZeros(mask);
+				mask &= mask - 1;
+				func(segment_->values[word * 64 + bit]);
+			}
+		}
+	}
+
+private:
+	// bits of the word that fall into [begin, end)
+	static uint64_t WordMask(int word, int begin, int end);
+	static int CountBits(uint64_t mask);
+	static int CountTrailingZeros(uint64_t mask);
+
+	const ValueSegment* segment_;
+	int first_row_;
+};
+
+// Column-major cache of computed values kept by the sheet next to the per-cell caches.
+// Segments are built on demand by readers and marked stale by the writer whenever a cell
+// of theirs changes or loses its cached value, so a fresh segment always holds the
+// current values. The directory is preallocated and its slots are published atomically,
+// so readers find fresh segments without a lock; building one takes build_mutex_.
+class ValueColumns {
+public:
+	static constexpr int SEGMENT_ROWS = ValueSegment::SEGMENT_ROWS;
+
+	ValueColumns();
+	~ValueColumns();
+
+	ValueColumns(const ValueColumns&) = delete;
+	ValueColumns& operator=(const ValueColumns&) = delete;
+
+	// writer only, while no reader runs
+	void MarkStale(Position pos);
+	void Clear();
+
+	// the segment holding pos if it is up to date, nullptr otherwise
+	const ValueSegment* FindFresh(Position pos) const;
+	// Brings the segment holding pos up to date with bool fill(ValueSegment&), unless
+	// another thread has done it meanwhile. If fill returns false the segment stays stale
+	// and nullptr is returned. fill must not call back into this object.
+	template <typename Fill>
+	const ValueSegment* Build(Position pos, Fill&& fill) {
+		std::lock_guard lock(build_mutex_);
+		Entry& entry = GetEntry(pos);
+		if (!entry.fresh.load(std::memory_order_relaxed)) {
+			entry.segment.Reset();
+			if (!fill(entry.segment)) {
+				return nullptr;
+			}
+			entry.fresh.store(true, std::memory_order_release);
+		}
+		return &entry.segment;
+	}
+
+private:
+	static constexpr int SEGMENTS_PER_COLUMN = Position::MAX_ROWS / SEGMENT_ROWS;
+
+	static_assert(Position::MAX_ROWS % SEGMENT_ROWS == 0, "segments tile a column");
+	static_assert(SEGMENT_ROWS % 64 == 0, "segment bitmaps are whole words");
+
+	struct Entry {
+		ValueSegment segment;
+		std::atomic<bool> fresh{ false };
+	};
+	struct Column {
+		std::array<std::atomic<Entry*>, SEGMENTS_PER_COLUMN> entries{};
+	};
+
+	const Entry* FindEntry(Position pos) const;
+	// creates the entry if needed; build_mutex_ must be held
+	Entry& GetEntry(Position pos);
+
+	// owned; raw atomic pointers, so that readers may look them up while another reader adds one
+	std::unique_ptr<std::atomic<Column*>[]> columns_;
+	std::mutex build_mutex_;
+};